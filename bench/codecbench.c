@@ -0,0 +1,342 @@
+// Microbenchmark comparing the cursor-based packet codec against the original
+// append_byte/remove_byte implementation, which is reproduced below unchanged
+// apart from naming so that both can be timed in the same process.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+
+#define ITERATIONS 200000
+
+static uint8_t*	mLegacyBuffer;
+static uint16_t	mLegacyBufferLength;
+
+static void legacy_append_byte(uint8_t byte);
+static uint8_t legacy_remove_byte();
+static int legacy_encode(nxtCommand command, nxtParameter parameters[], int parameter_count);
+static int legacy_decode(const uint8_t* body, int length, nxtCommand command, nxtResponse responses[], int response_count);
+
+static uint64_t now_ns();
+static void release_responses(nxtResponse responses[], int response_count);
+static void report(const char* workload, uint64_t legacy_ns, uint64_t cursor_ns);
+
+int main(int argc, char* argv[])
+{
+	uint8_t*	frame;
+	uint8_t	payload[59];
+	uint8_t	input_values_reply[16];
+	uint8_t	read_reply[64];
+	nxtParameter	set_output_state[7];
+	nxtParameter	write_chunk[2];
+	nxtResponse	input_values[10];
+	nxtResponse	read_data[4];
+	uint64_t	start;
+	uint64_t	legacy_ns;
+	uint64_t	cursor_ns;
+	int	iteration;
+
+	frame = malloc(NXT_FRAME_BUFFER_SIZE);
+	memset(payload, 0x5A, sizeof(payload));
+
+	// SETOUTPUTSTATE: port, power, mode, regulation, turn ratio, run state, tacho limit
+	set_output_state[0].type = NXT_TYPE_UBYTE;
+	set_output_state[0].value.ubyte = 0;
+	set_output_state[1].type = NXT_TYPE_SBYTE;
+	set_output_state[1].value.sbyte = 75;
+	set_output_state[2].type = NXT_TYPE_UBYTE;
+	set_output_state[2].value.ubyte = 0x07;
+	set_output_state[3].type = NXT_TYPE_UBYTE;
+	set_output_state[3].value.ubyte = 0x01;
+	set_output_state[4].type = NXT_TYPE_SBYTE;
+	set_output_state[4].value.sbyte = 0;
+	set_output_state[5].type = NXT_TYPE_UBYTE;
+	set_output_state[5].value.ubyte = 0x20;
+	set_output_state[6].type = NXT_TYPE_ULONG;
+	set_output_state[6].value.ulong = 720;
+
+	// WRITE: handle followed by a full chunk of data
+	write_chunk[0].type = NXT_TYPE_UBYTE;
+	write_chunk[0].value.ubyte = 1;
+	write_chunk[1].type = NXT_TYPE_BYTES;
+	write_chunk[1].value.bytes = payload;
+	write_chunk[1].length = sizeof(payload);
+
+	// GETINPUTVALUES reply
+	memset(input_values_reply, 0, sizeof(input_values_reply));
+	input_values_reply[0] = 0x02;
+	input_values_reply[1] = NXT_CMD_GETINPUTVALUES;
+	input_values_reply[4] = 1;
+	input_values_reply[8] = 0x34;
+	input_values_reply[9] = 0x02;
+	input_values[0].type = NXT_TYPE_UBYTE;
+	input_values[1].type = NXT_TYPE_UBYTE;
+	input_values[2].type = NXT_TYPE_BOOLEAN;
+	input_values[3].type = NXT_TYPE_BOOLEAN;
+	input_values[4].type = NXT_TYPE_UBYTE;
+	input_values[5].type = NXT_TYPE_UBYTE;
+	input_values[6].type = NXT_TYPE_UWORD;
+	input_values[7].type = NXT_TYPE_UWORD;
+	input_values[8].type = NXT_TYPE_SWORD;
+	input_values[9].type = NXT_TYPE_SWORD;
+
+	// READ reply carrying 60 bytes of file data
+	memset(read_reply, 0xA5, sizeof(read_reply));
+	read_reply[0] = 0x02;
+	read_reply[1] = NXT_CMD_READ;
+	read_reply[2] = 0;
+	read_reply[3] = 1;
+	read_reply[4] = 60;
+	read_reply[5] = 0;
+	read_data[0].type = NXT_TYPE_UBYTE;
+	read_data[1].type = NXT_TYPE_UBYTE;
+	read_data[2].type = NXT_TYPE_UWORD;
+	read_data[3].type = NXT_TYPE_BYTES;
+	read_data[3].length = -1;
+
+	printf("%-28s %12s %12s %9s\n", "workload", "legacy ns", "cursor ns", "speedup");
+
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		legacy_encode(NXT_CMD_SETOUTPUTSTATE, set_output_state, 7);
+		free(mLegacyBuffer);
+	}
+	legacy_ns = now_ns() - start;
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		codec_encode_command(frame, NXT_CMD_SETOUTPUTSTATE, true, set_output_state, 7);
+	}
+	cursor_ns = now_ns() - start;
+	report("encode SETOUTPUTSTATE", legacy_ns, cursor_ns);
+
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		legacy_encode(NXT_CMD_WRITE, write_chunk, 2);
+		free(mLegacyBuffer);
+	}
+	legacy_ns = now_ns() - start;
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		codec_encode_command(frame, NXT_CMD_WRITE, true, write_chunk, 2);
+	}
+	cursor_ns = now_ns() - start;
+	report("encode WRITE (59 bytes)", legacy_ns, cursor_ns);
+
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		legacy_decode(input_values_reply, sizeof(input_values_reply), NXT_CMD_GETINPUTVALUES, input_values, 10);
+	}
+	legacy_ns = now_ns() - start;
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		codec_decode_response(input_values_reply, sizeof(input_values_reply), NXT_CMD_GETINPUTVALUES, input_values, 10);
+	}
+	cursor_ns = now_ns() - start;
+	report("decode GETINPUTVALUES", legacy_ns, cursor_ns);
+
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		read_data[3].length = -1;
+		legacy_decode(read_reply, sizeof(read_reply), NXT_CMD_READ, read_data, 4);
+		release_responses(read_data, 4);
+	}
+	legacy_ns = now_ns() - start;
+	start = now_ns();
+	for (iteration = 0; iteration < ITERATIONS; iteration += 1)
+	{
+		read_data[3].length = -1;
+		codec_decode_response(read_reply, sizeof(read_reply), NXT_CMD_READ, read_data, 4);
+		release_responses(read_data, 4);
+	}
+	cursor_ns = now_ns() - start;
+	report("decode READ (60 bytes)", legacy_ns, cursor_ns);
+
+	free(frame);
+
+	return 0;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void release_responses(nxtResponse responses[], int response_count)
+{
+	int	response_index;
+
+	response_index = 0;
+	while (response_index < response_count)
+	{
+		if (responses[response_index].type == NXT_TYPE_BYTES)
+		{
+			free(responses[response_index].value.bytes);
+		}
+
+		response_index += 1;
+	}
+}
+
+static void report(const char* workload, uint64_t legacy_ns, uint64_t cursor_ns)
+{
+	printf("%-28s %12.1f %12.1f %8.1fx\n", workload, (double) legacy_ns / ITERATIONS, (double) cursor_ns / ITERATIONS, (double) legacy_ns / cursor_ns);
+}
+
+// LEGACY CODEC
+
+static int legacy_encode(nxtCommand command, nxtParameter parameters[], int parameter_count)
+{
+	int	parameter_index;
+	int	current_position;
+
+	mLegacyBuffer = malloc(2);
+	mLegacyBufferLength = 2;
+	mLegacyBuffer[0] = command < 0x80 ? 0x00 : 0x01;
+	mLegacyBuffer[1] = command;
+
+	parameter_index = 0;
+	while (parameter_index < parameter_count)
+	{
+		nxtParameter	parameter;
+
+		parameter = parameters[parameter_index];
+		switch (parameter.type)
+		{
+			case NXT_TYPE_BOOLEAN:
+			case NXT_TYPE_UBYTE:
+			case NXT_TYPE_SBYTE:
+				legacy_append_byte(parameter.value.ubyte);
+				break;
+			case NXT_TYPE_UWORD:
+			case NXT_TYPE_SWORD:
+				legacy_append_byte(parameter.value.uword & 0xFF);
+				legacy_append_byte((parameter.value.uword & 0xFF00) >> 8);
+				break;
+			case NXT_TYPE_ULONG:
+			case NXT_TYPE_SLONG:
+				legacy_append_byte(parameter.value.ulong & 0xFF);
+				legacy_append_byte((parameter.value.ulong & 0xFF00) >> 8);
+				legacy_append_byte((parameter.value.ulong & 0xFF0000) >> 16);
+				legacy_append_byte((parameter.value.ulong & 0xFF000000) >> 24);
+				break;
+			case NXT_TYPE_BYTES:
+				current_position = 0;
+				while (current_position < parameter.length)
+				{
+					legacy_append_byte(parameter.value.bytes[current_position]);
+					current_position += 1;
+				}
+				break;
+			default:
+				return false;
+		}
+
+		parameter_index += 1;
+	}
+
+	return true;
+}
+
+static int legacy_decode(const uint8_t* body, int length, nxtCommand command, nxtResponse responses[], int response_count)
+{
+	int	response_index;
+	int	current_position;
+
+	// the original implementation read each reply into a freshly allocated buffer
+	mLegacyBuffer = malloc(length);
+	memcpy(mLegacyBuffer, body, length);
+	mLegacyBufferLength = length;
+
+	if (mLegacyBuffer[0] != 0x02 || mLegacyBuffer[1] != command)
+	{
+		free(mLegacyBuffer);
+		return false;
+	}
+	legacy_remove_byte();
+	legacy_remove_byte();
+
+	response_index = 0;
+	while (response_index < response_count && mLegacyBufferLength > 0)
+	{
+		nxtResponse*	response;
+
+		response = &(responses[response_index]);
+		switch (response->type)
+		{
+			case NXT_TYPE_BOOLEAN:
+			case NXT_TYPE_UBYTE:
+			case NXT_TYPE_SBYTE:
+				response->value.ubyte = legacy_remove_byte();
+				break;
+			case NXT_TYPE_UWORD:
+			case NXT_TYPE_SWORD:
+				response->value.uword = legacy_remove_byte();
+				response->value.uword = response->value.uword | (legacy_remove_byte() << 8);
+				break;
+			case NXT_TYPE_ULONG:
+			case NXT_TYPE_SLONG:
+				response->value.ulong = legacy_remove_byte();
+				response->value.ulong = response->value.ulong | (legacy_remove_byte() << 8);
+				response->value.ulong = response->value.ulong | (legacy_remove_byte() << 16);
+				response->value.ulong = response->value.ulong | (legacy_remove_byte() << 24);
+				break;
+			case NXT_TYPE_BYTES:
+				response->length = mLegacyBufferLength;
+				response->value.bytes = malloc(response->length);
+				current_position = 0;
+				while (current_position < response->length)
+				{
+					response->value.bytes[current_position] = legacy_remove_byte();
+					current_position += 1;
+				}
+				break;
+			default:
+				free(mLegacyBuffer);
+				return false;
+		}
+
+		response_index += 1;
+	}
+
+	free(mLegacyBuffer);
+
+	return response_index;
+}
+
+static void legacy_append_byte(uint8_t byte)
+{
+	mLegacyBufferLength += 1;
+	mLegacyBuffer = realloc(mLegacyBuffer, mLegacyBufferLength);
+	mLegacyBuffer[mLegacyBufferLength - 1] = byte;
+}
+
+static uint8_t legacy_remove_byte()
+{
+	uint8_t	byte;
+	uint8_t*	new_buffer;
+
+	byte = mLegacyBuffer[0];
+	new_buffer = malloc(mLegacyBufferLength - 1);
+	memcpy(new_buffer, mLegacyBuffer + 1, mLegacyBufferLength - 1);
+	free(mLegacyBuffer);
+	mLegacyBuffer = new_buffer;
+	mLegacyBufferLength -= 1;
+
+	return byte;
+}
@@ -0,0 +1,528 @@
+// Standard libnxtbt workloads, reported as JSON so that results can be compared
+// across releases and transports.
+//
+//     nxtbench [-n iterations] [-s file_size] [-c chunk_size] [-w workloads] device
+//     nxtbench -e [-l latency_us] [-j jitter_us] [-b bytes_per_second] ...
+//
+// With -e the benchmark runs against an in-process emulated brick instead of a
+// device. Workloads are given as a comma-separated list of latency, rate,
+// upload, download and codec (all by default).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+#include "nxtemu.h"
+
+#define BENCH_FILENAME "nxtbench.dat"
+
+typedef struct
+{
+	int	iterations;
+	int	file_size;
+	int	chunk_size;
+	const char*	workloads;
+	bool	first_result;
+} benchOptions;
+
+static void run_latency(nxtConnection* connection, benchOptions* options, const char* name, nxtCommand command, nxtParameter parameters[], int parameter_count, nxtResponse responses[], int response_count);
+static void run_rate(nxtConnection* connection, benchOptions* options);
+static void run_upload(nxtConnection* connection, benchOptions* options);
+static void run_download(nxtConnection* connection, benchOptions* options);
+static void run_codec(benchOptions* options);
+static void report_latencies(benchOptions* options, const char* name, uint64_t samples[], int count, uint64_t elapsed);
+static void report_throughput(benchOptions* options, const char* name, uint64_t bytes, uint64_t elapsed, int errors);
+static void report_phases(nxtConnection* connection);
+static void begin_result(benchOptions* options, const char* name);
+static int wants(benchOptions* options, const char* workload);
+static int compare_samples(const void* first, const void* second);
+static uint64_t percentile(uint64_t sorted[], int count, double fraction);
+static uint64_t now_ns();
+
+int main(int argc, char* argv[])
+{
+	benchOptions	options;
+	nxtEmulatorLink	link;
+	nxtEmulator*	emulator;
+	nxtConnection*	connection;
+	nxtParameter	parameters[2];
+	nxtResponse	responses[10];
+	const char*	device;
+	bool	emulate;
+	int	option;
+
+	options.iterations = 1000;
+	options.file_size = 16384;
+	// 0 leaves the transfers to use the largest READ and WRITE that fit in a
+	// Bluetooth packet, which differ
+	options.chunk_size = 0;
+	options.workloads = "latency,rate,upload,download,codec";
+	options.first_result = true;
+	memset(&link, 0, sizeof(link));
+	link.seed = 1;
+	emulate = false;
+	emulator = NULL;
+
+	while ((option = getopt(argc, argv, "n:s:c:w:el:j:b:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'n':
+				options.iterations = atoi(optarg);
+				break;
+			case 's':
+				options.file_size = atoi(optarg);
+				break;
+			case 'c':
+				options.chunk_size = atoi(optarg);
+				break;
+			case 'w':
+				options.workloads = optarg;
+				break;
+			case 'e':
+				emulate = true;
+				break;
+			case 'l':
+				link.latency = atoi(optarg);
+				break;
+			case 'j':
+				link.jitter = atoi(optarg);
+				break;
+			case 'b':
+				link.bandwidth = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-s file_size] [-c chunk_size] [-w workloads] (-e [-l latency_us] [-j jitter_us] [-b bytes_per_second] | device)\n", argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+
+	if (options.iterations < 1 || options.chunk_size < 0 || options.chunk_size > NXT_FRAME_MAX_LENGTH - 3)
+	{
+		fprintf(stderr, "nxtbench: invalid iteration count or chunk size\n");
+		return 1;
+	}
+
+	if (emulate == true)
+	{
+		emulator = nxtEmuCreate(&link);
+		if (emulator == NULL)
+		{
+			perror("nxtbench: cannot start emulator");
+			return 1;
+		}
+		device = nxtEmuGetDevice(emulator);
+	}
+	else if (optind < argc)
+	{
+		device = argv[optind];
+	}
+	else
+	{
+		fprintf(stderr, "nxtbench: no device given\n");
+		return 1;
+	}
+
+	connection = nxtConnect(device);
+	if (connection == NULL)
+	{
+		perror("nxtbench: cannot open device");
+		nxtEmuDestroy(emulator);
+		return 1;
+	}
+
+	printf("{\n");
+	printf("  \"device\": \"%s\",\n", emulate == true ? "emulator" : device);
+	printf("  \"iterations\": %d,\n", options.iterations);
+	printf("  \"results\": [");
+
+	if (wants(&options, "latency") == true)
+	{
+		parameters[0].type = NXT_TYPE_UWORD;
+		parameters[0].value.uword = 440;
+		parameters[1].type = NXT_TYPE_UWORD;
+		parameters[1].value.uword = 1;
+		responses[0].type = NXT_TYPE_UBYTE;
+		run_latency(connection, &options, "latency/PLAYTONE", NXT_CMD_PLAYTONE, parameters, 2, responses, 1);
+
+		parameters[0].type = NXT_TYPE_UBYTE;
+		parameters[0].value.ubyte = 0;
+		responses[0].type = NXT_TYPE_UBYTE;
+		responses[1].type = NXT_TYPE_UBYTE;
+		responses[2].type = NXT_TYPE_BOOLEAN;
+		responses[3].type = NXT_TYPE_BOOLEAN;
+		responses[4].type = NXT_TYPE_UBYTE;
+		responses[5].type = NXT_TYPE_UBYTE;
+		responses[6].type = NXT_TYPE_UWORD;
+		responses[7].type = NXT_TYPE_UWORD;
+		responses[8].type = NXT_TYPE_SWORD;
+		responses[9].type = NXT_TYPE_SWORD;
+		run_latency(connection, &options, "latency/GETINPUTVALUES", NXT_CMD_GETINPUTVALUES, parameters, 1, responses, 10);
+
+		responses[0].type = NXT_TYPE_UBYTE;
+		responses[1].type = NXT_TYPE_ULONG;
+		run_latency(connection, &options, "latency/KEEPALIVE", NXT_CMD_KEEPALIVE, NULL, 0, responses, 2);
+	}
+	if (wants(&options, "rate") == true)
+	{
+		run_rate(connection, &options);
+	}
+	if (wants(&options, "upload") == true)
+	{
+		run_upload(connection, &options);
+	}
+	if (wants(&options, "download") == true)
+	{
+		run_download(connection, &options);
+	}
+	if (wants(&options, "codec") == true)
+	{
+		run_codec(&options);
+	}
+
+	printf("\n  ],\n");
+	report_phases(connection);
+	printf("}\n");
+
+	nxtDisconnect(connection);
+	nxtEmuDestroy(emulator);
+
+	return 0;
+}
+
+// WORKLOADS
+
+static void run_latency(nxtConnection* connection, benchOptions* options, const char* name, nxtCommand command, nxtParameter parameters[], int parameter_count, nxtResponse responses[], int response_count)
+{
+	uint64_t*	samples;
+	uint64_t	started;
+	uint64_t	start;
+	int	iteration;
+
+	samples = malloc(sizeof(uint64_t) * options->iterations);
+
+	started = now_ns();
+	iteration = 0;
+	while (iteration < options->iterations)
+	{
+		start = now_ns();
+		nxtConnDoCommand(connection, command, parameters, responses, parameter_count, response_count);
+		samples[iteration] = now_ns() - start;
+		iteration += 1;
+	}
+
+	report_latencies(options, name, samples, options->iterations, now_ns() - started);
+
+	free(samples);
+}
+
+// Sustained command rate: motor updates sent without waiting for a response,
+// and battery queries kept in flight through the pipeline.
+static void run_rate(nxtConnection* connection, benchOptions* options)
+{
+	nxtParameter	parameters[7];
+	nxtRequest*	requests;
+	nxtResponse*	responses;
+	uint64_t	started;
+	int	iteration;
+
+	parameters[0].type = NXT_TYPE_UBYTE;
+	parameters[0].value.ubyte = 0;
+	parameters[1].type = NXT_TYPE_SBYTE;
+	parameters[2].type = NXT_TYPE_UBYTE;
+	parameters[2].value.ubyte = 0x01;
+	parameters[3].type = NXT_TYPE_UBYTE;
+	parameters[3].value.ubyte = 0x00;
+	parameters[4].type = NXT_TYPE_SBYTE;
+	parameters[4].value.sbyte = 0;
+	parameters[5].type = NXT_TYPE_UBYTE;
+	parameters[5].value.ubyte = 0x20;
+	parameters[6].type = NXT_TYPE_ULONG;
+	parameters[6].value.ulong = 0;
+
+	started = now_ns();
+	iteration = 0;
+	while (iteration < options->iterations)
+	{
+		parameters[1].value.sbyte = iteration % 100;
+		nxtConnSendCommand(connection, NXT_CMD_SETOUTPUTSTATE, parameters, 7);
+		iteration += 1;
+	}
+	report_throughput(options, "rate/SETOUTPUTSTATE-noreply", 0, now_ns() - started, 0);
+
+	parameters[1].value.sbyte = 0;
+	parameters[2].value.ubyte = 0x00;
+	parameters[5].value.ubyte = 0x00;
+	nxtConnDoCommand(connection, NXT_CMD_SETOUTPUTSTATE, parameters, NULL, 7, 0);
+
+	requests = malloc(sizeof(nxtRequest) * options->iterations);
+	responses = malloc(sizeof(nxtResponse) * 2 * options->iterations);
+	iteration = 0;
+	while (iteration < options->iterations)
+	{
+		responses[2 * iteration].type = NXT_TYPE_UBYTE;
+		responses[2 * iteration + 1].type = NXT_TYPE_UWORD;
+		requests[iteration].command = NXT_CMD_GETBATTERYLEVEL;
+		requests[iteration].parameters = NULL;
+		requests[iteration].parameter_count = 0;
+		requests[iteration].responses = &(responses[2 * iteration]);
+		requests[iteration].response_count = 2;
+		iteration += 1;
+	}
+
+	started = now_ns();
+	nxtConnDoCommands(connection, requests, options->iterations);
+	report_throughput(options, "rate/GETBATTERYLEVEL-pipelined", 0, now_ns() - started, 0);
+
+	free(requests);
+	free(responses);
+}
+
+static void run_upload(nxtConnection* connection, benchOptions* options)
+{
+	nxtTransfer	transfer;
+	char	path[] = "/tmp/nxtbench-XXXXXX";
+	uint8_t*	data;
+	int	file;
+	int	result;
+
+	data = malloc(options->file_size);
+	memset(data, 0xA5, options->file_size);
+
+	file = mkstemp(path);
+	if (file < 0 || write(file, data, options->file_size) != options->file_size)
+	{
+		perror("nxtbench: cannot create upload file");
+		report_throughput(options, "upload", 0, 1, 1);
+		if (file >= 0)
+		{
+			close(file);
+			unlink(path);
+		}
+		free(data);
+		return;
+	}
+	close(file);
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.chunk_size = options->chunk_size;
+	result = nxtUploadFile(connection, path, BENCH_FILENAME, &transfer);
+
+	report_throughput(options, "upload", transfer.bytes, transfer.elapsed, result < 0 ? 1 : 0);
+
+	unlink(path);
+	free(data);
+}
+
+static void run_download(nxtConnection* connection, benchOptions* options)
+{
+	nxtTransfer	transfer;
+	uint8_t*	data;
+	int	result;
+
+	data = malloc(options->file_size);
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.chunk_size = options->chunk_size;
+	result = nxtDownloadBuffer(connection, BENCH_FILENAME, data, options->file_size, &transfer);
+
+	report_throughput(options, "download", transfer.bytes, transfer.elapsed, result < 0 ? 1 : 0);
+
+	free(data);
+}
+
+// Cost of encoding a SETOUTPUTSTATE request and decoding a GETINPUTVALUES
+// response exactly as nxtDoCommand does, without any I/O.
+static void run_codec(benchOptions* options)
+{
+	nxtParameter	parameters[7];
+	nxtResponse	responses[10];
+	uint8_t*	frame;
+	uint8_t	reply[16];
+	uint64_t*	samples;
+	uint64_t	started;
+	uint64_t	start;
+	int	iteration;
+	int	repeat;
+
+	frame = malloc(NXT_FRAME_BUFFER_SIZE);
+	samples = malloc(sizeof(uint64_t) * options->iterations);
+
+	parameters[0].type = NXT_TYPE_UBYTE;
+	parameters[0].value.ubyte = 0;
+	parameters[1].type = NXT_TYPE_SBYTE;
+	parameters[1].value.sbyte = 75;
+	parameters[2].type = NXT_TYPE_UBYTE;
+	parameters[2].value.ubyte = 0x07;
+	parameters[3].type = NXT_TYPE_UBYTE;
+	parameters[3].value.ubyte = 0x01;
+	parameters[4].type = NXT_TYPE_SBYTE;
+	parameters[4].value.sbyte = 0;
+	parameters[5].type = NXT_TYPE_UBYTE;
+	parameters[5].value.ubyte = 0x20;
+	parameters[6].type = NXT_TYPE_ULONG;
+	parameters[6].value.ulong = 720;
+
+	memset(reply, 0, sizeof(reply));
+	reply[0] = 0x02;
+	reply[1] = NXT_CMD_GETINPUTVALUES;
+	reply[4] = 1;
+	responses[0].type = NXT_TYPE_UBYTE;
+	responses[1].type = NXT_TYPE_UBYTE;
+	responses[2].type = NXT_TYPE_BOOLEAN;
+	responses[3].type = NXT_TYPE_BOOLEAN;
+	responses[4].type = NXT_TYPE_UBYTE;
+	responses[5].type = NXT_TYPE_UBYTE;
+	responses[6].type = NXT_TYPE_UWORD;
+	responses[7].type = NXT_TYPE_UWORD;
+	responses[8].type = NXT_TYPE_SWORD;
+	responses[9].type = NXT_TYPE_SWORD;
+
+	// each sample times a batch so that the clock resolution does not dominate
+	started = now_ns();
+	iteration = 0;
+	while (iteration < options->iterations)
+	{
+		start = now_ns();
+		repeat = 0;
+		while (repeat < 100)
+		{
+			codec_encode_command(frame, NXT_CMD_SETOUTPUTSTATE, true, parameters, 7);
+			codec_decode_response(reply, sizeof(reply), NXT_CMD_GETINPUTVALUES, responses, 10);
+			repeat += 1;
+		}
+		samples[iteration] = (now_ns() - start) / 100;
+		iteration += 1;
+	}
+
+	report_latencies(options, "codec/SETOUTPUTSTATE+GETINPUTVALUES", samples, options->iterations, (now_ns() - started) / 100);
+
+	free(samples);
+	free(frame);
+}
+
+// REPORTING
+
+static void report_latencies(benchOptions* options, const char* name, uint64_t samples[], int count, uint64_t elapsed)
+{
+	qsort(samples, count, sizeof(uint64_t), compare_samples);
+
+	begin_result(options, name);
+	printf("\"count\": %d, ", count);
+	printf("\"p50_us\": %.3f, ", percentile(samples, count, 0.50) / 1e3);
+	printf("\"p99_us\": %.3f, ", percentile(samples, count, 0.99) / 1e3);
+	printf("\"p999_us\": %.3f, ", percentile(samples, count, 0.999) / 1e3);
+	printf("\"max_us\": %.3f, ", samples[count - 1] / 1e3);
+	printf("\"ops_per_second\": %.1f }", count / (elapsed / 1e9));
+}
+
+static void report_throughput(benchOptions* options, const char* name, uint64_t bytes, uint64_t elapsed, int errors)
+{
+	begin_result(options, name);
+	if (bytes > 0)
+	{
+		printf("\"bytes\": %llu, ", (unsigned long long) bytes);
+		printf("\"bytes_per_second\": %.1f, ", bytes / (elapsed / 1e9));
+	}
+	else
+	{
+		printf("\"count\": %d, ", options->iterations);
+		printf("\"ops_per_second\": %.1f, ", options->iterations / (elapsed / 1e9));
+	}
+	printf("\"seconds\": %.6f, ", elapsed / 1e9);
+	printf("\"errors\": %d }", errors);
+}
+
+// Prints the library's own breakdown of where the time went across all of the
+// workloads that used the connection.
+static void report_phases(nxtConnection* connection)
+{
+	static const char*	names[NXT_PHASES] = { "encode", "write", "wait", "decode" };
+	nxtStats*	stats;
+	nxtHistogram*	histogram;
+	int	phase;
+
+	stats = malloc(sizeof(nxtStats));
+	nxtGetStats(connection, stats);
+
+	printf("  \"phases\": {");
+	phase = 0;
+	while (phase < NXT_PHASES)
+	{
+		histogram = &(stats->phases[phase]);
+		printf("%s\n    \"%s\": { ", phase == 0 ? "" : ",", names[phase]);
+		printf("\"count\": %llu, ", (unsigned long long) histogram->count);
+		printf("\"p50_us\": %.3f, ", nxtHistogramPercentile(histogram, 0.50) / 1e3);
+		printf("\"p99_us\": %.3f, ", nxtHistogramPercentile(histogram, 0.99) / 1e3);
+		printf("\"p999_us\": %.3f }", nxtHistogramPercentile(histogram, 0.999) / 1e3);
+		phase += 1;
+	}
+	printf("\n  }\n");
+
+	free(stats);
+}
+
+static void begin_result(benchOptions* options, const char* name)
+{
+	printf("%s\n    { \"workload\": \"%s\", ", options->first_result == true ? "" : ",", name);
+	options->first_result = false;
+	fflush(stdout);
+}
+
+static int wants(benchOptions* options, const char* workload)
+{
+	const char*	position;
+	int	length;
+
+	length = strlen(workload);
+	position = strstr(options->workloads, workload);
+	while (position != NULL)
+	{
+		if ((position == options->workloads || position[-1] == ',') && (position[length] == ',' || position[length] == 0))
+		{
+			return true;
+		}
+		position = strstr(position + 1, workload);
+	}
+
+	return false;
+}
+
+static int compare_samples(const void* first, const void* second)
+{
+	uint64_t	a;
+	uint64_t	b;
+
+	a = *(const uint64_t*) first;
+	b = *(const uint64_t*) second;
+
+	return (a > b) - (a < b);
+}
+
+static uint64_t percentile(uint64_t sorted[], int count, double fraction)
+{
+	int	index;
+
+	index = fraction * count;
+	if (index >= count)
+	{
+		index = count - 1;
+	}
+
+	return sorted[index];
+}
+
+static uint64_t now_ns()
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,1779 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+#include "nxtemu.h"
+
+#define EMU_PORTS_OUTPUT 3
+#define EMU_PORTS_INPUT 4
+#define EMU_MAILBOXES 10
+#define EMU_MAILBOX_DEPTH 5
+#define EMU_MESSAGE_LENGTH 59
+#define EMU_FILES 64
+#define EMU_HANDLES 16
+#define EMU_FLASH_SIZE (128 * 1024)
+#define EMU_SLEEP_TIME 600000	// milliseconds
+#define EMU_BATTERY_LEVEL 7800	// millivolts
+#define EMU_DEGREES_PER_SECOND 9	// tacho speed per unit of motor power
+
+typedef enum
+{
+	FILE_NORMAL,
+	FILE_LINEAR,
+	FILE_DATA,
+} emuFileKind;
+
+typedef enum
+{
+	HANDLE_FREE,
+	HANDLE_READ,
+	HANDLE_WRITE,
+	HANDLE_FIND,
+} emuHandleMode;
+
+typedef struct
+{
+	bool	used;
+	char	name[20];
+	emuFileKind	kind;
+	uint8_t*	data;
+	uint32_t	size;	// size given when the file was opened for writing
+	uint32_t	length;	// bytes written so far
+} emuFile;
+
+typedef struct
+{
+	emuHandleMode	mode;
+	int	file;	// index into files, or the next index to search for HANDLE_FIND
+	uint32_t	position;
+	char	pattern[20];
+} emuHandle;
+
+typedef struct
+{
+	int8_t	power;
+	uint8_t	mode;
+	uint8_t	regulation_mode;
+	int8_t	turn_ratio;
+	uint8_t	run_state;
+	uint32_t	tacho_limit;
+	int32_t	tacho_count;
+	int32_t	block_tacho_count;
+	int32_t	rotation_count;
+	double	position;	// degrees, fractional part of tacho_count
+	double	remaining;	// degrees left before the tacho limit is reached
+} emuMotor;
+
+typedef struct
+{
+	uint8_t	type;
+	uint8_t	mode;
+	bool	fixed;	// raw value set with nxtEmuSetInput rather than simulated
+	uint16_t	raw;
+	int16_t	scaled_offset;	// subtracted after RESETINPUTSCALEDVALUE
+} emuSensor;
+
+typedef struct
+{
+	uint8_t	length;
+	uint8_t	data[EMU_MESSAGE_LENGTH];
+} emuMessage;
+
+typedef struct emuResponse
+{
+	uint64_t	due;	// CLOCK_MONOTONIC nanoseconds at which to write the response
+	int	length;
+	struct emuResponse*	next;
+	uint8_t	data[];
+} emuResponse;
+
+struct nxtEmulator
+{
+	nxtEmulatorLink	link;
+	int	master;	// the pseudo-terminal, or the connected client of listener
+	int	slave;	// kept open so that the master does not see a hangup between clients
+	int	listener;	// listening socket, or -1 on a pseudo-terminal
+	char	device[128];	// what to pass to nxtConnect
+	int	wake[2];	// self-pipe used to stop the thread
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+
+	uint8_t*	input;
+	int	input_length;
+	uint8_t*	reply;
+	emuResponse*	responses_head;
+	emuResponse*	responses_tail;
+	uint64_t	uplink_free;
+	uint64_t	downlink_free;
+
+	uint64_t	started;
+	uint64_t	motors_updated;
+	char	brick_name[16];
+	char	program[20];
+	emuMotor	motors[EMU_PORTS_OUTPUT];
+	emuSensor	sensors[EMU_PORTS_INPUT];
+	emuMessage	mailboxes[EMU_MAILBOXES][EMU_MAILBOX_DEPTH];
+	int	mailbox_counts[EMU_MAILBOXES];
+	emuFile	files[EMU_FILES];
+	emuHandle	handles[EMU_HANDLES];
+};
+
+typedef int (*emuHandler)(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+
+static int open_pty(nxtEmulator* emulator);
+static int open_listener(nxtEmulator* emulator, const char* address);
+static void* run(void* argument);
+static void accept_client(nxtEmulator* emulator);
+static void drop_client(nxtEmulator* emulator);
+static void receive_requests(nxtEmulator* emulator, uint64_t now);
+static void handle_request(nxtEmulator* emulator, uint8_t* body, int length, uint64_t arrival);
+static void send_due_responses(nxtEmulator* emulator, uint64_t now);
+static uint64_t transfer_time(nxtEmulator* emulator, int length);
+static uint64_t now_ns();
+
+static void update_motors(nxtEmulator* emulator);
+static void sensor_values(nxtEmulator* emulator, int port, uint16_t* raw, uint16_t* normalized, int16_t* scaled);
+static int find_file(nxtEmulator* emulator, const char* name);
+static int file_is_open(nxtEmulator* emulator, int file);
+static uint32_t free_flash(nxtEmulator* emulator);
+static int allocate_handle(nxtEmulator* emulator);
+static int take_filename(nxtCursor* request, char* filename);
+static int open_for_writing(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply, emuFileKind kind);
+static void put_find_result(nxtEmulator* emulator, nxtCursor* reply, int handle, int* status);
+
+static int handle_startprogram(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_stopprogram(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_playsoundfile(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_playtone(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_setoutputstate(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_setinputmode(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getoutputstate(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getinputvalues(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_resetinputscaledvalue(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_messagewrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_resetmotorposition(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getbatterylevel(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_stopsoundplayback(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_keepalive(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_lsgetstatus(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_lswrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_lsread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getcurrentprogramname(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_messageread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_openread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_openwrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_read(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_write(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_close(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_delete(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_findfirst(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_findnext(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getfirmwareversion(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_openwritelinear(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_openwritedata(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_openappenddata(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_setbrickname(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+static int handle_getdeviceinfo(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply);
+
+static const emuHandler	mHandlers[256] =
+{
+	[NXT_CMD_STARTPROGRAM] = handle_startprogram,
+	[NXT_CMD_STOPPROGRAM] = handle_stopprogram,
+	[NXT_CMD_PLAYSOUNDFILE] = handle_playsoundfile,
+	[NXT_CMD_PLAYTONE] = handle_playtone,
+	[NXT_CMD_SETOUTPUTSTATE] = handle_setoutputstate,
+	[NXT_CMD_SETINPUTMODE] = handle_setinputmode,
+	[NXT_CMD_GETOUTPUTSTATE] = handle_getoutputstate,
+	[NXT_CMD_GETINPUTVALUES] = handle_getinputvalues,
+	[NXT_CMD_RESETINPUTSCALEDVALUE] = handle_resetinputscaledvalue,
+	[NXT_CMD_MESSAGEWRITE] = handle_messagewrite,
+	[NXT_CMD_RESETMOTORPOSITION] = handle_resetmotorposition,
+	[NXT_CMD_GETBATTERYLEVEL] = handle_getbatterylevel,
+	[NXT_CMD_STOPSOUNDPLAYBACK] = handle_stopsoundplayback,
+	[NXT_CMD_KEEPALIVE] = handle_keepalive,
+	[NXT_CMD_LSGETSTATUS] = handle_lsgetstatus,
+	[NXT_CMD_LSWRITE] = handle_lswrite,
+	[NXT_CMD_LSREAD] = handle_lsread,
+	[NXT_CMD_GETCURRENTPROGRAMNAME] = handle_getcurrentprogramname,
+	[NXT_CMD_MESSAGEREAD] = handle_messageread,
+	[NXT_CMD_OPENREAD] = handle_openread,
+	[NXT_CMD_OPENWRITE] = handle_openwrite,
+	[NXT_CMD_READ] = handle_read,
+	[NXT_CMD_WRITE] = handle_write,
+	[NXT_CMD_CLOSE] = handle_close,
+	[NXT_CMD_DELETE] = handle_delete,
+	[NXT_CMD_FINDFIRST] = handle_findfirst,
+	[NXT_CMD_FINDNEXT] = handle_findnext,
+	[NXT_CMD_GETFIRMWAREVERSION] = handle_getfirmwareversion,
+	[NXT_CMD_OPENWRITELINEAR] = handle_openwritelinear,
+	[NXT_CMD_OPENWRITEDATA] = handle_openwritedata,
+	[NXT_CMD_OPENAPPENDDATA] = handle_openappenddata,
+	[NXT_CMD_SETBRICKNAME] = handle_setbrickname,
+	[NXT_CMD_GETDEVICEINFO] = handle_getdeviceinfo,
+};
+
+// PUBLIC FUNCTIONS
+
+nxtEmulator* nxtEmuCreate(const nxtEmulatorLink* link)
+{
+	nxtEmulator*	emulator;
+
+	emulator = calloc(1, sizeof(nxtEmulator));
+	if (emulator == NULL)
+	{
+		return NULL;
+	}
+	if (link != NULL)
+	{
+		emulator->link = *link;
+	}
+	emulator->master = -1;
+	emulator->slave = -1;
+	emulator->listener = -1;
+	emulator->wake[0] = -1;
+	emulator->wake[1] = -1;
+
+	emulator->input = malloc(NXT_FRAME_BUFFER_SIZE);
+	emulator->reply = malloc(NXT_FRAME_BUFFER_SIZE);
+	if (emulator->input == NULL || emulator->reply == NULL)
+	{
+		nxtEmuDestroy(emulator);
+		return NULL;
+	}
+
+	if ((link != NULL && link->address != NULL ? open_listener(emulator, link->address) : open_pty(emulator)) == false)
+	{
+		nxtEmuDestroy(emulator);
+		return NULL;
+	}
+
+	if (pipe(emulator->wake) != 0)
+	{
+		nxtEmuDestroy(emulator);
+		return NULL;
+	}
+
+	strcpy(emulator->brick_name, "NXT");
+	emulator->started = now_ns();
+	emulator->motors_updated = emulator->started;
+	pthread_mutex_init(&emulator->lock, NULL);
+
+	if (pthread_create(&emulator->thread, NULL, run, emulator) != 0)
+	{
+		pthread_mutex_destroy(&emulator->lock);
+		close(emulator->wake[0]);
+		close(emulator->wake[1]);
+		emulator->wake[0] = -1;
+		nxtEmuDestroy(emulator);
+		return NULL;
+	}
+
+	return emulator;
+}
+
+void nxtEmuDestroy(nxtEmulator* emulator)
+{
+	emuResponse*	response;
+	int	file;
+
+	if (emulator == NULL)
+	{
+		return;
+	}
+
+	if (emulator->wake[0] >= 0)
+	{
+		write(emulator->wake[1], "", 1);
+		pthread_join(emulator->thread, NULL);
+		pthread_mutex_destroy(&emulator->lock);
+		close(emulator->wake[0]);
+		close(emulator->wake[1]);
+	}
+	if (emulator->slave >= 0)
+	{
+		close(emulator->slave);
+	}
+	if (emulator->master >= 0)
+	{
+		close(emulator->master);
+	}
+	if (emulator->listener >= 0)
+	{
+		close(emulator->listener);
+		if (strncmp(emulator->device, "unix:", 5) == 0)
+		{
+			unlink(emulator->device + 5);
+		}
+	}
+
+	while (emulator->responses_head != NULL)
+	{
+		response = emulator->responses_head;
+		emulator->responses_head = response->next;
+		free(response);
+	}
+	file = 0;
+	while (file < EMU_FILES)
+	{
+		free(emulator->files[file].data);
+		file += 1;
+	}
+	free(emulator->input);
+	free(emulator->reply);
+	free(emulator);
+}
+
+const char* nxtEmuGetDevice(nxtEmulator* emulator)
+{
+	return emulator->device;
+}
+
+// Fixes the raw value reported by an input port, instead of the simulated
+// waveform used by default.
+void nxtEmuSetInput(nxtEmulator* emulator, int port, uint16_t raw)
+{
+	if (port < 0 || port >= EMU_PORTS_INPUT)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&emulator->lock);
+	emulator->sensors[port].fixed = true;
+	emulator->sensors[port].raw = raw;
+	pthread_mutex_unlock(&emulator->lock);
+}
+
+// Places a file in the emulated flash memory, as if it had been uploaded.
+int nxtEmuAddFile(nxtEmulator* emulator, const char* filename, const uint8_t* data, uint32_t length)
+{
+	emuFile*	file;
+	int	index;
+
+	if (strlen(filename) > 19)
+	{
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+
+	pthread_mutex_lock(&emulator->lock);
+
+	if (find_file(emulator, filename) >= 0)
+	{
+		pthread_mutex_unlock(&emulator->lock);
+		return NXT_STS_FILE_EXISTS;
+	}
+	if (length > free_flash(emulator))
+	{
+		pthread_mutex_unlock(&emulator->lock);
+		return NXT_STS_NO_SPACE;
+	}
+
+	index = 0;
+	while (index < EMU_FILES && emulator->files[index].used == true)
+	{
+		index += 1;
+	}
+	if (index == EMU_FILES)
+	{
+		pthread_mutex_unlock(&emulator->lock);
+		return NXT_STS_NO_SPACE;
+	}
+
+	file = &(emulator->files[index]);
+	memset(file->name, 0, sizeof(file->name));
+	strcpy(file->name, filename);
+	file->kind = FILE_NORMAL;
+	file->data = malloc(length > 0 ? length : 1);
+	memcpy(file->data, data, length);
+	file->size = length;
+	file->length = length;
+	file->used = true;
+
+	pthread_mutex_unlock(&emulator->lock);
+
+	return NXT_STS_SUCCESS;
+}
+
+// LINK
+
+// Opens a pseudo-terminal, standing in for a Bluetooth serial device.
+static int open_pty(nxtEmulator* emulator)
+{
+	struct termios	port_settings;
+
+	emulator->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (emulator->master < 0 || grantpt(emulator->master) != 0 || unlockpt(emulator->master) != 0 || ptsname_r(emulator->master, emulator->device, sizeof(emulator->device)) != 0)
+	{
+		return false;
+	}
+	emulator->slave = open(emulator->device, O_RDWR | O_NOCTTY);
+	if (emulator->slave < 0)
+	{
+		return false;
+	}
+	tcgetattr(emulator->slave, &port_settings);
+	cfmakeraw(&port_settings);
+	tcsetattr(emulator->slave, TCSANOW, &port_settings);
+	fcntl(emulator->master, F_SETFL, O_NONBLOCK);
+
+	return true;
+}
+
+// Listens on unix:path or tcp:[host:]port (the loopback interface if no host
+// is given, and any free port for port 0), and names the result in the form
+// that nxtConnect takes.
+static int open_listener(nxtEmulator* emulator, const char* address)
+{
+	struct sockaddr_un	local;
+	struct sockaddr_in	internet;
+	socklen_t	length;
+	const char*	port;
+	char	host[64];
+	int	enabled;
+
+	if (strncmp(address, "unix:", 5) == 0)
+	{
+		if (strlen(address + 5) >= sizeof(local.sun_path))
+		{
+			return false;
+		}
+		memset(&local, 0, sizeof(local));
+		local.sun_family = AF_UNIX;
+		strcpy(local.sun_path, address + 5);
+		unlink(local.sun_path);
+
+		emulator->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (emulator->listener < 0 || bind(emulator->listener, (struct sockaddr*) &local, sizeof(local)) != 0 || listen(emulator->listener, 1) != 0)
+		{
+			return false;
+		}
+		snprintf(emulator->device, sizeof(emulator->device), "unix:%s", local.sun_path);
+
+		return true;
+	}
+
+	if (strncmp(address, "tcp:", 4) != 0)
+	{
+		return false;
+	}
+	address += 4;
+	strcpy(host, "127.0.0.1");
+	port = strrchr(address, ':');
+	if (port == NULL)
+	{
+		port = address;
+	}
+	else
+	{
+		if (port - address >= (int) sizeof(host))
+		{
+			return false;
+		}
+		memcpy(host, address, port - address);
+		host[port - address] = 0;
+		port += 1;
+	}
+
+	memset(&internet, 0, sizeof(internet));
+	internet.sin_family = AF_INET;
+	internet.sin_port = htons(atoi(port));
+	if (inet_pton(AF_INET, host, &internet.sin_addr) != 1)
+	{
+		return false;
+	}
+
+	emulator->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (emulator->listener < 0)
+	{
+		return false;
+	}
+	enabled = 1;
+	setsockopt(emulator->listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+	length = sizeof(internet);
+	if (bind(emulator->listener, (struct sockaddr*) &internet, sizeof(internet)) != 0 || listen(emulator->listener, 1) != 0 || getsockname(emulator->listener, (struct sockaddr*) &internet, &length) != 0)
+	{
+		return false;
+	}
+	snprintf(emulator->device, sizeof(emulator->device), "tcp:%s:%u", host, ntohs(internet.sin_port));
+
+	return true;
+}
+
+// EMULATOR THREAD
+
+static void* run(void* argument)
+{
+	nxtEmulator*	emulator;
+	struct pollfd	descriptors[3];
+	struct timespec	timeout;
+	struct timespec*	wait;
+	uint64_t	now;
+
+	emulator = argument;
+
+	descriptors[0].events = POLLIN;
+	descriptors[1].fd = emulator->wake[0];
+	descriptors[1].events = POLLIN;
+	descriptors[2].fd = emulator->listener;
+	descriptors[2].events = POLLIN;
+
+	while (true)
+	{
+		// wait until the next response is due, with nanosecond resolution
+		now = now_ns();
+		wait = NULL;
+		if (emulator->responses_head != NULL)
+		{
+			wait = &timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = 0;
+			if (emulator->responses_head->due > now)
+			{
+				timeout.tv_sec = (emulator->responses_head->due - now) / 1000000000;
+				timeout.tv_nsec = (emulator->responses_head->due - now) % 1000000000;
+			}
+		}
+
+		// poll() ignores the client slot while there is no client
+		descriptors[0].fd = emulator->master;
+		if (ppoll(descriptors, 3, wait, NULL) < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if (descriptors[1].revents != 0)
+		{
+			break;
+		}
+
+		now = now_ns();
+		if ((descriptors[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+		{
+			receive_requests(emulator, now);
+		}
+		if ((descriptors[2].revents & POLLIN) != 0)
+		{
+			accept_client(emulator);
+		}
+		send_due_responses(emulator, now_ns());
+	}
+
+	return NULL;
+}
+
+// Like a real NXT, a listening emulator talks to one client at a time; others
+// are turned away until it disconnects.
+static void accept_client(nxtEmulator* emulator)
+{
+	int	client;
+	int	enabled;
+
+	client = accept4(emulator->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client < 0)
+	{
+		return;
+	}
+	if (emulator->master >= 0)
+	{
+		close(client);
+		return;
+	}
+
+	enabled = 1;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+	emulator->master = client;
+}
+
+// Forgets the connected client, along with anything still owed to it.
+static void drop_client(nxtEmulator* emulator)
+{
+	emuResponse*	response;
+
+	close(emulator->master);
+	emulator->master = -1;
+	emulator->input_length = 0;
+
+	while (emulator->responses_head != NULL)
+	{
+		response = emulator->responses_head;
+		emulator->responses_head = response->next;
+		free(response);
+	}
+	emulator->responses_tail = NULL;
+}
+
+static void receive_requests(nxtEmulator* emulator, uint64_t now)
+{
+	ssize_t	received;
+	int	length;
+
+	received = read(emulator->master, emulator->input + emulator->input_length, NXT_FRAME_BUFFER_SIZE - emulator->input_length);
+	if (received <= 0)
+	{
+		if (emulator->listener >= 0 && (received == 0 || (errno != EAGAIN && errno != EINTR)))
+		{
+			drop_client(emulator);
+		}
+		return;
+	}
+	emulator->input_length += received;
+
+	while (emulator->input_length >= NXT_FRAME_HEADER_LENGTH)
+	{
+		length = codec_read_length(emulator->input);
+		if (emulator->input_length < NXT_FRAME_HEADER_LENGTH + length)
+		{
+			break;
+		}
+
+		// the request reaches the brick once it has crossed the uplink
+		if (emulator->uplink_free < now)
+		{
+			emulator->uplink_free = now;
+		}
+		emulator->uplink_free += transfer_time(emulator, NXT_FRAME_HEADER_LENGTH + length);
+
+		handle_request(emulator, emulator->input + NXT_FRAME_HEADER_LENGTH, length, emulator->uplink_free);
+
+		emulator->input_length -= NXT_FRAME_HEADER_LENGTH + length;
+		memmove(emulator->input, emulator->input + NXT_FRAME_HEADER_LENGTH + length, emulator->input_length);
+	}
+}
+
+static void handle_request(nxtEmulator* emulator, uint8_t* body, int length, uint64_t arrival)
+{
+	nxtCursor	request;
+	nxtCursor	reply;
+	emuResponse*	response;
+	emuHandler	handler;
+	uint64_t	due;
+	int	status;
+
+	if (length < 2)
+	{
+		return;
+	}
+
+	request.data = body;
+	request.position = 2;
+	request.limit = length;
+	reply.data = emulator->reply + NXT_FRAME_HEADER_LENGTH;
+	reply.position = 3;
+	reply.limit = NXT_FRAME_MAX_LENGTH;
+
+	pthread_mutex_lock(&emulator->lock);
+	update_motors(emulator);
+	handler = mHandlers[body[1]];
+	if ((body[0] & 0x7F) > 0x01)
+	{
+		status = NXT_STS_INSANE_PACKET;
+	}
+	else if (handler == NULL || (body[1] < 0x80) != ((body[0] & 0x7F) == 0x00))
+	{
+		status = NXT_STS_UNKNOWN_OPCODE;
+	}
+	else
+	{
+		status = handler(emulator, &request, &reply);
+	}
+	pthread_mutex_unlock(&emulator->lock);
+
+	if ((body[0] & 0x80) != 0)
+	{
+		// no response requested
+		return;
+	}
+	if (emulator->link.loss > 0 && (int) (rand_r(&emulator->link.seed) % 100) < emulator->link.loss)
+	{
+		return;
+	}
+
+	reply.data[0] = 0x02;
+	reply.data[1] = body[1];
+	reply.data[2] = status;
+	codec_write_length(emulator->reply, reply.position);
+
+	due = arrival + (uint64_t) emulator->link.latency * 1000;
+	if (emulator->link.jitter > 0)
+	{
+		due += (uint64_t) (rand_r(&emulator->link.seed) % emulator->link.jitter) * 1000;
+	}
+	if (due < emulator->downlink_free)
+	{
+		// responses leave the brick in order
+		due = emulator->downlink_free;
+	}
+	due += transfer_time(emulator, NXT_FRAME_HEADER_LENGTH + reply.position);
+	emulator->downlink_free = due;
+
+	response = malloc(sizeof(emuResponse) + NXT_FRAME_HEADER_LENGTH + reply.position);
+	response->due = due;
+	response->length = NXT_FRAME_HEADER_LENGTH + reply.position;
+	response->next = NULL;
+	memcpy(response->data, emulator->reply, response->length);
+
+	if (emulator->responses_tail == NULL)
+	{
+		emulator->responses_head = response;
+	}
+	else
+	{
+		emulator->responses_tail->next = response;
+	}
+	emulator->responses_tail = response;
+}
+
+static void send_due_responses(nxtEmulator* emulator, uint64_t now)
+{
+	emuResponse*	response;
+	struct pollfd	descriptor;
+	ssize_t	written;
+	int	offset;
+
+	while (emulator->responses_head != NULL && emulator->responses_head->due <= now)
+	{
+		response = emulator->responses_head;
+
+		offset = 0;
+		while (offset < response->length)
+		{
+			if (emulator->listener >= 0)
+			{
+				written = send(emulator->master, response->data + offset, response->length - offset, MSG_NOSIGNAL);
+			}
+			else
+			{
+				written = write(emulator->master, response->data + offset, response->length - offset);
+			}
+			if (written < 0)
+			{
+				if (errno != EAGAIN && errno != EINTR)
+				{
+					break;
+				}
+				descriptor.fd = emulator->master;
+				descriptor.events = POLLOUT;
+				poll(&descriptor, 1, 100);
+				continue;
+			}
+			offset += written;
+		}
+
+		emulator->responses_head = response->next;
+		if (emulator->responses_head == NULL)
+		{
+			emulator->responses_tail = NULL;
+		}
+		free(response);
+	}
+}
+
+static uint64_t transfer_time(nxtEmulator* emulator, int length)
+{
+	if (emulator->link.bandwidth <= 0)
+	{
+		return 0;
+	}
+
+	return (uint64_t) length * 1000000000 / emulator->link.bandwidth;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// BRICK STATE
+
+static void update_motors(nxtEmulator* emulator)
+{
+	emuMotor*	motor;
+	uint64_t	now;
+	double	elapsed;
+	double	degrees;
+	int	port;
+
+	now = now_ns();
+	elapsed = (now - emulator->motors_updated) / 1e9;
+	emulator->motors_updated = now;
+
+	port = 0;
+	while (port < EMU_PORTS_OUTPUT)
+	{
+		motor = &(emulator->motors[port]);
+		if ((motor->mode & 0x01) != 0 && motor->run_state != 0x00)
+		{
+			degrees = motor->power * EMU_DEGREES_PER_SECOND * elapsed;
+			if (motor->tacho_limit != 0)
+			{
+				if (fabs(degrees) >= motor->remaining)
+				{
+					degrees = degrees < 0 ? -motor->remaining : motor->remaining;
+					motor->run_state = 0x00;
+				}
+				motor->remaining -= fabs(degrees);
+			}
+
+			motor->position += degrees;
+			motor->tacho_count += (int32_t) motor->position;
+			motor->block_tacho_count += (int32_t) motor->position;
+			motor->rotation_count += (int32_t) motor->position;
+			motor->position -= (int32_t) motor->position;
+		}
+
+		port += 1;
+	}
+}
+
+// Simulated sensors follow a slow sine wave, offset per port, unless fixed.
+static void sensor_values(nxtEmulator* emulator, int port, uint16_t* raw, uint16_t* normalized, int16_t* scaled)
+{
+	emuSensor*	sensor;
+	double	seconds;
+
+	sensor = &(emulator->sensors[port]);
+
+	if (sensor->fixed == true)
+	{
+		*raw = sensor->raw;
+	}
+	else
+	{
+		seconds = (now_ns() - emulator->started) / 1e9;
+		*raw = 512 + 300 * sin(seconds * M_PI + port);
+	}
+	*normalized = *raw;
+
+	switch (sensor->mode & 0xE0)
+	{
+		case 0x20:	// boolean
+			*scaled = *raw < 512 ? 1 : 0;
+			break;
+		case 0x80:	// percentage of full scale
+			*scaled = (1023 - *raw) * 100 / 1023;
+			break;
+		default:	// raw
+			*scaled = *raw;
+			break;
+	}
+	*scaled -= sensor->scaled_offset;
+}
+
+static int find_file(nxtEmulator* emulator, const char* name)
+{
+	int	index;
+
+	index = 0;
+	while (index < EMU_FILES)
+	{
+		if (emulator->files[index].used == true && strcasecmp(emulator->files[index].name, name) == 0)
+		{
+			return index;
+		}
+
+		index += 1;
+	}
+
+	return -1;
+}
+
+static int file_is_open(nxtEmulator* emulator, int file)
+{
+	int	handle;
+
+	handle = 0;
+	while (handle < EMU_HANDLES)
+	{
+		if ((emulator->handles[handle].mode == HANDLE_READ || emulator->handles[handle].mode == HANDLE_WRITE) && emulator->handles[handle].file == file)
+		{
+			return true;
+		}
+
+		handle += 1;
+	}
+
+	return false;
+}
+
+static uint32_t free_flash(nxtEmulator* emulator)
+{
+	uint32_t	used;
+	int	index;
+
+	used = 0;
+	index = 0;
+	while (index < EMU_FILES)
+	{
+		if (emulator->files[index].used == true)
+		{
+			used += emulator->files[index].size;
+		}
+
+		index += 1;
+	}
+
+	return EMU_FLASH_SIZE - used;
+}
+
+static int allocate_handle(nxtEmulator* emulator)
+{
+	int	handle;
+
+	handle = 0;
+	while (handle < EMU_HANDLES)
+	{
+		if (emulator->handles[handle].mode == HANDLE_FREE)
+		{
+			return handle;
+		}
+
+		handle += 1;
+	}
+
+	return -1;
+}
+
+static int take_filename(nxtCursor* request, char* filename)
+{
+	if (codec_remaining(request) < 20)
+	{
+		return false;
+	}
+
+	codec_take_bytes(request, filename, 20);
+	filename[19] = 0;
+
+	return filename[0] != 0;
+}
+
+static int open_for_writing(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply, emuFileKind kind)
+{
+	char	filename[20];
+	uint32_t	size;
+	emuFile*	file;
+	int	index;
+	int	handle;
+
+	if (take_filename(request, filename) == false || codec_remaining(request) < 4)
+	{
+		codec_put_ubyte(reply, 0);
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	size = codec_take_ulong(request);
+
+	if (find_file(emulator, filename) >= 0)
+	{
+		codec_put_ubyte(reply, 0);
+		return NXT_STS_FILE_EXISTS;
+	}
+	if (size > free_flash(emulator))
+	{
+		codec_put_ubyte(reply, 0);
+		return NXT_STS_NO_SPACE;
+	}
+	handle = allocate_handle(emulator);
+	index = 0;
+	while (index < EMU_FILES && emulator->files[index].used == true)
+	{
+		index += 1;
+	}
+	if (handle < 0 || index == EMU_FILES)
+	{
+		codec_put_ubyte(reply, 0);
+		return NXT_STS_NO_MORE_HANDLES;
+	}
+
+	file = &(emulator->files[index]);
+	memset(file->name, 0, sizeof(file->name));
+	strcpy(file->name, filename);
+	file->kind = kind;
+	file->data = malloc(size > 0 ? size : 1);
+	file->size = size;
+	file->length = 0;
+	file->used = true;
+
+	emulator->handles[handle].mode = HANDLE_WRITE;
+	emulator->handles[handle].file = index;
+	emulator->handles[handle].position = 0;
+
+	codec_put_ubyte(reply, handle);
+
+	return NXT_STS_SUCCESS;
+}
+
+// Advances a search handle to the next file matching its pattern and writes the
+// filename and size, or sets status to NXT_STS_FILE_NOT_FOUND.
+static void put_find_result(nxtEmulator* emulator, nxtCursor* reply, int handle, int* status)
+{
+	emuHandle*	search;
+	emuFile*	file;
+
+	search = &(emulator->handles[handle]);
+	while (search->file < EMU_FILES)
+	{
+		file = &(emulator->files[search->file]);
+		search->file += 1;
+
+		if (file->used == true && fnmatch(search->pattern, file->name, FNM_CASEFOLD) == 0)
+		{
+			codec_put_ubyte(reply, handle);
+			codec_put_bytes(reply, file->name, 20);
+			codec_put_ulong(reply, file->length);
+			*status = NXT_STS_SUCCESS;
+			return;
+		}
+	}
+
+	search->mode = HANDLE_FREE;
+	codec_put_ubyte(reply, handle);
+	codec_put_zeros(reply, 24);
+	*status = NXT_STS_FILE_NOT_FOUND;
+}
+
+// DIRECT COMMANDS
+
+static int handle_startprogram(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	filename[20];
+
+	if (take_filename(request, filename) == false)
+	{
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	if (find_file(emulator, filename) < 0)
+	{
+		return NXT_STS_FILE_NOT_FOUND;
+	}
+
+	memcpy(emulator->program, filename, 20);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_stopprogram(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	if (emulator->program[0] == 0)
+	{
+		return NXT_STS_NO_ACTIVE_PROGRAM;
+	}
+
+	memset(emulator->program, 0, 20);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_playsoundfile(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	filename[20];
+
+	if (codec_remaining(request) < 1)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+	codec_take_ubyte(request);
+	if (take_filename(request, filename) == false)
+	{
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	if (find_file(emulator, filename) < 0)
+	{
+		return NXT_STS_FILE_NOT_FOUND;
+	}
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_playtone(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	if (codec_remaining(request) < 4)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_setoutputstate(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuMotor	state;
+	int	port;
+	int	index;
+
+	if (codec_remaining(request) < 10)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+
+	port = codec_take_ubyte(request);
+	state.power = codec_take_ubyte(request);
+	state.mode = codec_take_ubyte(request);
+	state.regulation_mode = codec_take_ubyte(request);
+	state.turn_ratio = codec_take_ubyte(request);
+	state.run_state = codec_take_ubyte(request);
+	state.tacho_limit = codec_take_ulong(request);
+
+	if (port != 0xFF && port >= EMU_PORTS_OUTPUT)
+	{
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+	if (state.power < -100 || state.power > 100)
+	{
+		return NXT_STS_OUT_OF_RANGE_VALUE;
+	}
+
+	index = 0;
+	while (index < EMU_PORTS_OUTPUT)
+	{
+		if (port == 0xFF || port == index)
+		{
+			emulator->motors[index].power = state.power;
+			emulator->motors[index].mode = state.mode;
+			emulator->motors[index].regulation_mode = state.regulation_mode;
+			emulator->motors[index].turn_ratio = state.turn_ratio;
+			emulator->motors[index].run_state = state.run_state;
+			emulator->motors[index].tacho_limit = state.tacho_limit;
+			emulator->motors[index].remaining = state.tacho_limit;
+		}
+
+		index += 1;
+	}
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_setinputmode(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	int	port;
+
+	if (codec_remaining(request) < 3)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+
+	port = codec_take_ubyte(request);
+	if (port >= EMU_PORTS_INPUT)
+	{
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+
+	emulator->sensors[port].type = codec_take_ubyte(request);
+	emulator->sensors[port].mode = codec_take_ubyte(request);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_getoutputstate(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuMotor*	motor;
+	int	port;
+
+	port = codec_remaining(request) >= 1 ? codec_take_ubyte(request) : 0xFF;
+	if (port >= EMU_PORTS_OUTPUT)
+	{
+		codec_put_ubyte(reply, port);
+		codec_put_zeros(reply, 21);
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+
+	motor = &(emulator->motors[port]);
+	codec_put_ubyte(reply, port);
+	codec_put_ubyte(reply, motor->power);
+	codec_put_ubyte(reply, motor->mode);
+	codec_put_ubyte(reply, motor->regulation_mode);
+	codec_put_ubyte(reply, motor->turn_ratio);
+	codec_put_ubyte(reply, motor->run_state);
+	codec_put_ulong(reply, motor->tacho_limit);
+	codec_put_ulong(reply, motor->tacho_count);
+	codec_put_ulong(reply, motor->block_tacho_count);
+	codec_put_ulong(reply, motor->rotation_count);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_getinputvalues(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	uint16_t	raw;
+	uint16_t	normalized;
+	int16_t	scaled;
+	int	port;
+
+	port = codec_remaining(request) >= 1 ? codec_take_ubyte(request) : 0xFF;
+	if (port >= EMU_PORTS_INPUT)
+	{
+		codec_put_ubyte(reply, port);
+		codec_put_zeros(reply, 12);
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+
+	sensor_values(emulator, port, &raw, &normalized, &scaled);
+
+	codec_put_ubyte(reply, port);
+	codec_put_ubyte(reply, true);
+	codec_put_ubyte(reply, false);
+	codec_put_ubyte(reply, emulator->sensors[port].type);
+	codec_put_ubyte(reply, emulator->sensors[port].mode);
+	codec_put_uword(reply, raw);
+	codec_put_uword(reply, normalized);
+	codec_put_uword(reply, scaled);
+	codec_put_uword(reply, scaled);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_resetinputscaledvalue(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	uint16_t	raw;
+	uint16_t	normalized;
+	int16_t	scaled;
+	int	port;
+
+	if (codec_remaining(request) < 1)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+	port = codec_take_ubyte(request);
+	if (port >= EMU_PORTS_INPUT)
+	{
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+
+	emulator->sensors[port].scaled_offset = 0;
+	sensor_values(emulator, port, &raw, &normalized, &scaled);
+	emulator->sensors[port].scaled_offset = scaled;
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_messagewrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuMessage*	message;
+	int	inbox;
+	int	length;
+
+	if (codec_remaining(request) < 2)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+	inbox = codec_take_ubyte(request);
+	length = codec_take_ubyte(request);
+	if (inbox >= EMU_MAILBOXES)
+	{
+		return NXT_STS_ILLEGAL_MAILBOX_QUEUE;
+	}
+	if (length > EMU_MESSAGE_LENGTH || codec_remaining(request) < length)
+	{
+		return NXT_STS_ILLEGAL_SIZE;
+	}
+
+	if (emulator->mailbox_counts[inbox] == EMU_MAILBOX_DEPTH)
+	{
+		// a full queue drops its oldest message
+		memmove(&(emulator->mailboxes[inbox][0]), &(emulator->mailboxes[inbox][1]), sizeof(emuMessage) * (EMU_MAILBOX_DEPTH - 1));
+		emulator->mailbox_counts[inbox] -= 1;
+	}
+	message = &(emulator->mailboxes[inbox][emulator->mailbox_counts[inbox]]);
+	message->length = length;
+	codec_take_bytes(request, message->data, length);
+	emulator->mailbox_counts[inbox] += 1;
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_resetmotorposition(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	int	port;
+	int	relative;
+
+	if (codec_remaining(request) < 2)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+	port = codec_take_ubyte(request);
+	relative = codec_take_ubyte(request);
+	if (port >= EMU_PORTS_OUTPUT)
+	{
+		return NXT_STS_BAD_INPUT_OUTPUT;
+	}
+
+	if (relative != 0)
+	{
+		emulator->motors[port].block_tacho_count = 0;
+	}
+	else
+	{
+		emulator->motors[port].rotation_count = 0;
+	}
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_getbatterylevel(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_uword(reply, EMU_BATTERY_LEVEL);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_stopsoundplayback(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_keepalive(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_ulong(reply, EMU_SLEEP_TIME);
+
+	return NXT_STS_SUCCESS;
+}
+
+// No digital sensors are emulated, so low-speed (I2C) transactions fail.
+static int handle_lsgetstatus(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_ubyte(reply, 0);
+
+	return NXT_STS_COMMUNICATION_BUS_ERROR;
+}
+
+static int handle_lswrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	return NXT_STS_COMMUNICATION_BUS_ERROR;
+}
+
+static int handle_lsread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_zeros(reply, 17);
+
+	return NXT_STS_COMMUNICATION_BUS_ERROR;
+}
+
+static int handle_getcurrentprogramname(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_bytes(reply, emulator->program, 20);
+
+	if (emulator->program[0] == 0)
+	{
+		return NXT_STS_NO_ACTIVE_PROGRAM;
+	}
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_messageread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuMessage	message;
+	int	remote_inbox;
+	int	local_inbox;
+	int	remove;
+	int	inbox;
+
+	if (codec_remaining(request) < 3)
+	{
+		codec_put_zeros(reply, 2 + EMU_MESSAGE_LENGTH);
+		return NXT_STS_INSANE_PACKET;
+	}
+	remote_inbox = codec_take_ubyte(request);
+	local_inbox = codec_take_ubyte(request);
+	remove = codec_take_ubyte(request);
+
+	// remote inboxes 10-19 mirror inboxes 0-9
+	inbox = remote_inbox % EMU_MAILBOXES;
+	codec_put_ubyte(reply, local_inbox);
+	if (remote_inbox >= 2 * EMU_MAILBOXES)
+	{
+		codec_put_zeros(reply, 1 + EMU_MESSAGE_LENGTH);
+		return NXT_STS_ILLEGAL_MAILBOX_QUEUE;
+	}
+	if (emulator->mailbox_counts[inbox] == 0)
+	{
+		codec_put_zeros(reply, 1 + EMU_MESSAGE_LENGTH);
+		return NXT_STS_MAILBOX_QUEUE_EMPTY;
+	}
+
+	message = emulator->mailboxes[inbox][0];
+	if (remove != 0)
+	{
+		emulator->mailbox_counts[inbox] -= 1;
+		memmove(&(emulator->mailboxes[inbox][0]), &(emulator->mailboxes[inbox][1]), sizeof(emuMessage) * emulator->mailbox_counts[inbox]);
+	}
+
+	codec_put_ubyte(reply, message.length);
+	codec_put_bytes(reply, message.data, message.length);
+	codec_put_zeros(reply, EMU_MESSAGE_LENGTH - message.length);
+
+	return NXT_STS_SUCCESS;
+}
+
+// SYSTEM COMMANDS
+
+static int handle_openread(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	filename[20];
+	int	file;
+	int	handle;
+
+	if (take_filename(request, filename) == false)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	file = find_file(emulator, filename);
+	if (file < 0)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_FILE_NOT_FOUND;
+	}
+	if (file_is_open(emulator, file) == true)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_FILE_BUSY;
+	}
+	handle = allocate_handle(emulator);
+	if (handle < 0)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_NO_MORE_HANDLES;
+	}
+
+	emulator->handles[handle].mode = HANDLE_READ;
+	emulator->handles[handle].file = file;
+	emulator->handles[handle].position = 0;
+
+	codec_put_ubyte(reply, handle);
+	codec_put_ulong(reply, emulator->files[file].length);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_openwrite(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	return open_for_writing(emulator, request, reply, FILE_NORMAL);
+}
+
+static int handle_read(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuHandle*	handle;
+	emuFile*	file;
+	uint32_t	available;
+	int	index;
+	int	length;
+	int	status;
+
+	if (codec_remaining(request) < 3)
+	{
+		codec_put_zeros(reply, 3);
+		return NXT_STS_INSANE_PACKET;
+	}
+	index = codec_take_ubyte(request);
+	length = codec_take_uword(request);
+
+	if (index >= EMU_HANDLES || emulator->handles[index].mode != HANDLE_READ)
+	{
+		codec_put_ubyte(reply, index);
+		codec_put_uword(reply, 0);
+		return NXT_STS_ILLEGAL_HANDLE;
+	}
+	handle = &(emulator->handles[index]);
+	file = &(emulator->files[handle->file]);
+
+	status = NXT_STS_SUCCESS;
+	available = file->length - handle->position;
+	if (length > available)
+	{
+		length = available;
+		status = NXT_STS_EOF;
+	}
+	if (length > NXT_FRAME_MAX_LENGTH - 6)
+	{
+		length = NXT_FRAME_MAX_LENGTH - 6;
+	}
+
+	codec_put_ubyte(reply, index);
+	codec_put_uword(reply, length);
+	codec_put_bytes(reply, file->data + handle->position, length);
+	handle->position += length;
+
+	return status;
+}
+
+static int handle_write(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuHandle*	handle;
+	emuFile*	file;
+	int	index;
+	int	length;
+	int	status;
+
+	if (codec_remaining(request) < 1)
+	{
+		codec_put_zeros(reply, 3);
+		return NXT_STS_INSANE_PACKET;
+	}
+	index = codec_take_ubyte(request);
+	length = codec_remaining(request);
+
+	if (index >= EMU_HANDLES || emulator->handles[index].mode != HANDLE_WRITE)
+	{
+		codec_put_ubyte(reply, index);
+		codec_put_uword(reply, 0);
+		return NXT_STS_ILLEGAL_HANDLE;
+	}
+	handle = &(emulator->handles[index]);
+	file = &(emulator->files[handle->file]);
+
+	status = NXT_STS_SUCCESS;
+	if (file->length + length > file->size)
+	{
+		length = file->size - file->length;
+		status = NXT_STS_FILE_FULL;
+	}
+
+	codec_take_bytes(request, file->data + file->length, length);
+	file->length += length;
+
+	codec_put_ubyte(reply, index);
+	codec_put_uword(reply, length);
+
+	return status;
+}
+
+static int handle_close(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	emuHandle*	handle;
+	emuFile*	file;
+	int	index;
+
+	if (codec_remaining(request) < 1)
+	{
+		codec_put_ubyte(reply, 0);
+		return NXT_STS_INSANE_PACKET;
+	}
+	index = codec_take_ubyte(request);
+	codec_put_ubyte(reply, index);
+
+	if (index >= EMU_HANDLES || emulator->handles[index].mode == HANDLE_FREE)
+	{
+		return NXT_STS_HANDLE_ALREADY_CLOSED;
+	}
+	handle = &(emulator->handles[index]);
+
+	if (handle->mode == HANDLE_WRITE)
+	{
+		file = &(emulator->files[handle->file]);
+		if (file->kind == FILE_DATA)
+		{
+			// data files only keep what was actually written
+			file->size = file->length;
+		}
+		else if (file->length < file->size)
+		{
+			memset(file->data + file->length, 0, file->size - file->length);
+			file->length = file->size;
+		}
+	}
+	handle->mode = HANDLE_FREE;
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_delete(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	filename[20];
+	int	file;
+
+	if (take_filename(request, filename) == false)
+	{
+		codec_put_zeros(reply, 20);
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	codec_put_bytes(reply, filename, 20);
+
+	file = find_file(emulator, filename);
+	if (file < 0)
+	{
+		return NXT_STS_FILE_NOT_FOUND;
+	}
+	if (file_is_open(emulator, file) == true)
+	{
+		return NXT_STS_FILE_BUSY;
+	}
+
+	free(emulator->files[file].data);
+	memset(&(emulator->files[file]), 0, sizeof(emuFile));
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_findfirst(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	pattern[20];
+	int	handle;
+	int	status;
+
+	if (take_filename(request, pattern) == false)
+	{
+		codec_put_zeros(reply, 25);
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	handle = allocate_handle(emulator);
+	if (handle < 0)
+	{
+		codec_put_zeros(reply, 25);
+		return NXT_STS_NO_MORE_HANDLES;
+	}
+
+	emulator->handles[handle].mode = HANDLE_FIND;
+	emulator->handles[handle].file = 0;
+	memcpy(emulator->handles[handle].pattern, pattern, 20);
+
+	put_find_result(emulator, reply, handle, &status);
+
+	return status;
+}
+
+static int handle_findnext(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	int	handle;
+	int	status;
+
+	if (codec_remaining(request) < 1)
+	{
+		codec_put_zeros(reply, 25);
+		return NXT_STS_INSANE_PACKET;
+	}
+	handle = codec_take_ubyte(request);
+	if (handle >= EMU_HANDLES || emulator->handles[handle].mode != HANDLE_FIND)
+	{
+		codec_put_ubyte(reply, handle);
+		codec_put_zeros(reply, 24);
+		return NXT_STS_ILLEGAL_HANDLE;
+	}
+
+	put_find_result(emulator, reply, handle, &status);
+
+	return status;
+}
+
+static int handle_getfirmwareversion(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	codec_put_ubyte(reply, 124);	// protocol 1.124
+	codec_put_ubyte(reply, 1);
+	codec_put_ubyte(reply, 31);	// firmware 1.31
+	codec_put_ubyte(reply, 1);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_openwritelinear(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	return open_for_writing(emulator, request, reply, FILE_LINEAR);
+}
+
+static int handle_openwritedata(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	return open_for_writing(emulator, request, reply, FILE_DATA);
+}
+
+static int handle_openappenddata(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	char	filename[20];
+	emuFile*	file;
+	uint32_t	extra;
+	int	index;
+	int	handle;
+
+	if (take_filename(request, filename) == false)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_ILLEGAL_FILENAME;
+	}
+	index = find_file(emulator, filename);
+	if (index < 0)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_FILE_NOT_FOUND;
+	}
+	file = &(emulator->files[index]);
+	if (file->kind != FILE_DATA)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_APPEND_NOT_POSSIBLE;
+	}
+	if (file_is_open(emulator, index) == true)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_FILE_BUSY;
+	}
+	handle = allocate_handle(emulator);
+	if (handle < 0)
+	{
+		codec_put_zeros(reply, 5);
+		return NXT_STS_NO_MORE_HANDLES;
+	}
+
+	// appending grows the file by whatever flash is still free
+	extra = free_flash(emulator);
+	file->data = realloc(file->data, file->size + extra + 1);
+	file->size += extra;
+
+	emulator->handles[handle].mode = HANDLE_WRITE;
+	emulator->handles[handle].file = index;
+	emulator->handles[handle].position = file->length;
+
+	codec_put_ubyte(reply, handle);
+	codec_put_ulong(reply, file->size - file->length);
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_setbrickname(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	if (codec_remaining(request) < 16)
+	{
+		return NXT_STS_INSANE_PACKET;
+	}
+
+	codec_take_bytes(request, emulator->brick_name, 16);
+	emulator->brick_name[15] = 0;
+
+	return NXT_STS_SUCCESS;
+}
+
+static int handle_getdeviceinfo(nxtEmulator* emulator, nxtCursor* request, nxtCursor* reply)
+{
+	uint8_t	address[7] = { 0x00, 0x16, 0x53, 0x00, 0x00, 0x00, 0x00 };
+	int	terminal;
+
+	// every emulated brick has its own address, taken from its pseudo-terminal
+	terminal = atoi(strrchr(emulator->device, '/') + 1);
+	address[4] = terminal >> 8;
+	address[5] = terminal;
+
+	codec_put_bytes(reply, emulator->brick_name, 15);
+	codec_put_bytes(reply, address, 7);
+	codec_put_ulong(reply, 0);
+	codec_put_ulong(reply, free_flash(emulator));
+
+	return NXT_STS_SUCCESS;
+}
@@ -0,0 +1,125 @@
+// Runs an emulated NXT on a pseudo-terminal, or listening on a Unix-domain or
+// TCP socket, until interrupted, so that applications and benchmarks can use
+// libnxtbt without a real brick. The device to pass to nxtConnect is printed
+// on startup.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nxtemu.h"
+
+static int add_file(nxtEmulator* emulator, const char* path);
+
+int main(int argc, char* argv[])
+{
+	nxtEmulator*	emulator;
+	nxtEmulatorLink	link;
+	sigset_t	signals;
+	int	signal_number;
+	int	option;
+	int	file_index;
+
+	memset(&link, 0, sizeof(link));
+	link.seed = 1;
+
+	while ((option = getopt(argc, argv, "l:j:b:d:s:a:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'l':
+				link.latency = atoi(optarg);
+				break;
+			case 'j':
+				link.jitter = atoi(optarg);
+				break;
+			case 'b':
+				link.bandwidth = atoi(optarg);
+				break;
+			case 'd':
+				link.loss = atoi(optarg);
+				break;
+			case 's':
+				link.seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'a':
+				link.address = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-l latency_us] [-j jitter_us] [-b bytes_per_second] [-d loss_percent] [-s seed] [-a unix:path | tcp:[host:]port] [file...]\n", argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+
+	// block the signals before the emulator thread starts so that only sigwait sees them
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	emulator = nxtEmuCreate(&link);
+	if (emulator == NULL)
+	{
+		perror("nxtemu");
+		return 1;
+	}
+
+	file_index = optind;
+	while (file_index < argc)
+	{
+		if (add_file(emulator, argv[file_index]) == false)
+		{
+			fprintf(stderr, "nxtemu: cannot add %s\n", argv[file_index]);
+		}
+		file_index += 1;
+	}
+
+	printf("%s\n", nxtEmuGetDevice(emulator));
+	fflush(stdout);
+
+	sigwait(&signals, &signal_number);
+
+	nxtEmuDestroy(emulator);
+
+	return 0;
+}
+
+// Preloads a local file into the emulated flash under its base name.
+static int add_file(nxtEmulator* emulator, const char* path)
+{
+	FILE*	file;
+	uint8_t*	data;
+	const char*	name;
+	long	length;
+	int	status;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return 0;
+	}
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc(length > 0 ? length : 1);
+	if (fread(data, 1, length, file) != (size_t) length)
+	{
+		free(data);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+
+	name = strrchr(path, '/');
+	name = name == NULL ? path : name + 1;
+	status = nxtEmuAddFile(emulator, name, data, length);
+	free(data);
+
+	return status == 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _nxtemu_h_
+#define _nxtemu_h_
+
+#include <stdint.h>
+
+typedef struct nxtEmulator nxtEmulator;
+
+// Characteristics of the emulated Bluetooth link. Every response is delayed by
+// latency plus a random amount of up to jitter, packets in each direction are
+// serialised at bandwidth bytes per second (0 for unlimited), and loss percent
+// of the responses are never sent. The emulator is reached through a
+// pseudo-terminal unless address asks it to listen on unix:path or
+// tcp:[host:]port instead.
+typedef struct
+{
+	int	latency;	// microseconds
+	int	jitter;	// microseconds
+	int	bandwidth;	// bytes per second
+	int	loss;	// percent
+	unsigned int	seed;	// seed for the jitter and the losses
+	const char*	address;	// NULL for a pseudo-terminal
+} nxtEmulatorLink;
+
+nxtEmulator* nxtEmuCreate(const nxtEmulatorLink* link);
+void nxtEmuDestroy(nxtEmulator* emulator);
+const char* nxtEmuGetDevice(nxtEmulator* emulator);
+void nxtEmuSetInput(nxtEmulator* emulator, int port, uint16_t raw);
+int nxtEmuAddFile(nxtEmulator* emulator, const char* filename, const uint8_t* data, uint32_t length);
+
+#endif
@@ -0,0 +1,543 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "codec.h"
+
+static int add_boolean(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_ubyte(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_sbyte(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_uword(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_sword(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_ulong(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_slong(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_bytes(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_string(nxtCursor* cursor, const nxtParameter* parameter);
+static int add_filename(nxtCursor* cursor, const nxtParameter* parameter);
+
+static int get_boolean(nxtCursor* cursor, nxtResponse* response);
+static int get_ubyte(nxtCursor* cursor, nxtResponse* response);
+static int get_sbyte(nxtCursor* cursor, nxtResponse* response);
+static int get_uword(nxtCursor* cursor, nxtResponse* response);
+static int get_sword(nxtCursor* cursor, nxtResponse* response);
+static int get_ulong(nxtCursor* cursor, nxtResponse* response);
+static int get_slong(nxtCursor* cursor, nxtResponse* response);
+static int get_bytes(nxtCursor* cursor, nxtResponse* response);
+static int get_string(nxtCursor* cursor, nxtResponse* response);
+static int get_filename(nxtCursor* cursor, nxtResponse* response);
+static int get_buffer(nxtCursor* cursor, nxtResponse* response);
+
+// Encodes a complete packet (length prefix and body) into frame, which must hold
+// NXT_FRAME_BUFFER_SIZE bytes. Returns the body length or a negative nxtLibError.
+int codec_encode_command(uint8_t* frame, nxtCommand command, bool reply, nxtParameter parameters[], int parameter_count)
+{
+	nxtCursor	cursor;
+	int	parameter_index;
+
+	cursor.data = frame + NXT_FRAME_HEADER_LENGTH;
+	cursor.position = 0;
+	cursor.limit = NXT_FRAME_MAX_LENGTH;
+
+	if (command < 0x80)
+	{
+		codec_put_ubyte(&cursor, reply ? 0x00 : 0x80);
+	}
+	else
+	{
+		codec_put_ubyte(&cursor, reply ? 0x01 : 0x81);
+	}
+	codec_put_ubyte(&cursor, command);
+
+	parameter_index = 0;
+	while (parameter_index < parameter_count)
+	{
+		#define add(type)\
+		if (add_ ## type(&cursor, &(parameters[parameter_index])) == false)\
+		{\
+			return NXT_LIBERR_PARAMETER_CANNOT_ADD;\
+		}
+
+		switch (parameters[parameter_index].type)
+		{
+			case NXT_TYPE_BOOLEAN:
+				add(boolean)
+				break;
+			case NXT_TYPE_UBYTE:
+				add(ubyte)
+				break;
+			case NXT_TYPE_SBYTE:
+				add(sbyte)
+				break;
+			case NXT_TYPE_UWORD:
+				add(uword)
+				break;
+			case NXT_TYPE_SWORD:
+				add(sword)
+				break;
+			case NXT_TYPE_ULONG:
+				add(ulong)
+				break;
+			case NXT_TYPE_SLONG:
+				add(slong)
+				break;
+			case NXT_TYPE_BYTES:
+			case NXT_TYPE_BUFFER:
+				add(bytes)
+				break;
+			case NXT_TYPE_STRING:
+				add(string)
+				break;
+			case NXT_TYPE_FILENAME:
+				add(filename)
+				break;
+		}
+
+		#undef add
+
+		parameter_index += 1;
+	}
+
+	codec_write_length(frame, cursor.position);
+
+	return cursor.position;
+}
+
+// Decodes a response packet body in a single pass. Returns the number of
+// responses filled in or a negative nxtLibError.
+int codec_decode_response(uint8_t* body, int length, nxtCommand command, nxtResponse responses[], int response_count)
+{
+	nxtCursor	cursor;
+	int	response_index;
+
+	if (length < 2)
+	{
+		return NXT_LIBERR_RESPONSE_TOO_SHORT;
+	}
+	if (body[0] != 0x02)
+	{
+		return NXT_LIBERR_RESPONSE_HEADER_INCORRECT;
+	}
+	if (body[1] != command)
+	{
+		return NXT_LIBERR_RESPONSE_COMMAND_MISMATCH;
+	}
+
+	cursor.data = body;
+	cursor.position = 2;
+	cursor.limit = length;
+
+	response_index = 0;
+	while (response_index < response_count && codec_remaining(&cursor) > 0)
+	{
+		#define get(type)\
+		if (get_ ## type(&cursor, &(responses[response_index])) == false)\
+		{\
+			return NXT_LIBERR_RESPONSE_TYPE_MISMATCH;\
+		}
+
+		switch (responses[response_index].type)
+		{
+			case NXT_TYPE_BOOLEAN:
+				get(boolean)
+				break;
+			case NXT_TYPE_UBYTE:
+				get(ubyte)
+				break;
+			case NXT_TYPE_SBYTE:
+				get(sbyte)
+				break;
+			case NXT_TYPE_UWORD:
+				get(uword)
+				break;
+			case NXT_TYPE_SWORD:
+				get(sword)
+				break;
+			case NXT_TYPE_ULONG:
+				get(ulong)
+				break;
+			case NXT_TYPE_SLONG:
+				get(slong)
+				break;
+			case NXT_TYPE_BYTES:
+				get(bytes)
+				break;
+			case NXT_TYPE_STRING:
+				get(string)
+				break;
+			case NXT_TYPE_FILENAME:
+				get(filename)
+				break;
+			case NXT_TYPE_BUFFER:
+				get(buffer)
+				break;
+		}
+
+		#undef get
+
+		response_index += 1;
+	}
+
+	if (codec_remaining(&cursor) > 0)
+	{
+		return NXT_LIBERR_RESPONSE_CANNOT_ADD;
+	}
+
+	return response_index;
+}
+
+// PRIVATE FUNCTIONS
+
+static int add_boolean(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	codec_put_ubyte(cursor, parameter->value.boolean);
+
+	return true;
+}
+
+static int add_ubyte(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	codec_put_ubyte(cursor, parameter->value.ubyte);
+
+	return true;
+}
+
+static int add_sbyte(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	codec_put_ubyte(cursor, parameter->value.sbyte);
+
+	return true;
+}
+
+static int add_uword(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 2)
+	{
+		return false;
+	}
+
+	codec_put_uword(cursor, parameter->value.uword);
+
+	return true;
+}
+
+static int add_sword(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 2)
+	{
+		return false;
+	}
+
+	codec_put_uword(cursor, parameter->value.sword);
+
+	return true;
+}
+
+static int add_ulong(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 4)
+	{
+		return false;
+	}
+
+	codec_put_ulong(cursor, parameter->value.ulong);
+
+	return true;
+}
+
+static int add_slong(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (codec_remaining(cursor) < 4)
+	{
+		return false;
+	}
+
+	codec_put_ulong(cursor, parameter->value.slong);
+
+	return true;
+}
+
+static int add_bytes(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	if (parameter->length < 0)
+	{
+		return false;
+	}
+	if (parameter->value.bytes == NULL)
+	{
+		return false;
+	}
+	if (codec_remaining(cursor) < parameter->length)
+	{
+		return false;
+	}
+
+	codec_put_bytes(cursor, parameter->value.bytes, parameter->length);
+
+	return true;
+}
+
+static int add_string(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	int	string_length;
+
+	if (parameter->value.string == NULL)
+	{
+		return false;
+	}
+
+	string_length = strlen(parameter->value.string);
+
+	if (parameter->length >= 0)
+	{
+		if (string_length > parameter->length - 1)
+		{
+			return false;
+		}
+		if (codec_remaining(cursor) < parameter->length)
+		{
+			return false;
+		}
+
+		codec_put_bytes(cursor, parameter->value.string, string_length);
+		codec_put_zeros(cursor, parameter->length - string_length);
+	}
+	else
+	{
+		if (codec_remaining(cursor) < string_length + 1)
+		{
+			return false;
+		}
+
+		codec_put_bytes(cursor, parameter->value.string, string_length + 1);
+	}
+
+	return true;
+}
+
+static int add_filename(nxtCursor* cursor, const nxtParameter* parameter)
+{
+	int	filename_length;
+
+	if (parameter->value.filename == NULL)
+	{
+		return false;
+	}
+
+	filename_length = strlen(parameter->value.filename);
+	if (filename_length > 19)
+	{
+		return false;
+	}
+	if (codec_remaining(cursor) < 20)
+	{
+		return false;
+	}
+
+	codec_put_bytes(cursor, parameter->value.filename, filename_length);
+	codec_put_zeros(cursor, 20 - filename_length);
+
+	return true;
+}
+
+static int get_boolean(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	switch (codec_take_ubyte(cursor))
+	{
+		case true:
+			response->value.boolean = true;
+			return true;
+		case false:
+			response->value.boolean = false;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static int get_ubyte(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	response->value.ubyte = codec_take_ubyte(cursor);
+
+	return true;
+}
+
+static int get_sbyte(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 1)
+	{
+		return false;
+	}
+
+	response->value.sbyte = codec_take_ubyte(cursor);
+
+	return true;
+}
+
+static int get_uword(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 2)
+	{
+		return false;
+	}
+
+	response->value.uword = codec_take_uword(cursor);
+
+	return true;
+}
+
+static int get_sword(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 2)
+	{
+		return false;
+	}
+
+	response->value.sword = codec_take_uword(cursor);
+
+	return true;
+}
+
+static int get_ulong(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 4)
+	{
+		return false;
+	}
+
+	response->value.ulong = codec_take_ulong(cursor);
+
+	return true;
+}
+
+static int get_slong(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 4)
+	{
+		return false;
+	}
+
+	response->value.slong = codec_take_ulong(cursor);
+
+	return true;
+}
+
+static int get_bytes(nxtCursor* cursor, nxtResponse* response)
+{
+	int	length;
+
+	if (response->length >= 0)
+	{
+		if (codec_remaining(cursor) < response->length)
+		{
+			return false;
+		}
+		length = response->length;
+	}
+	else
+	{
+		length = codec_remaining(cursor);
+	}
+
+	response->value.bytes = malloc(length);
+	response->length = length;
+	codec_take_bytes(cursor, response->value.bytes, length);
+
+	return true;
+}
+
+static int get_string(nxtCursor* cursor, nxtResponse* response)
+{
+	uint8_t*	terminator;
+	int	string_length;
+
+	terminator = memchr(cursor->data + cursor->position, 0, codec_remaining(cursor));
+	if (terminator == NULL)
+	{
+		return false;
+	}
+	string_length = terminator - (cursor->data + cursor->position);
+
+	if (response->length >= 0)
+	{
+		if (string_length > response->length - 1)
+		{
+			return false;
+		}
+		if (codec_remaining(cursor) < response->length)
+		{
+			return false;
+		}
+
+		response->value.string = malloc(response->length);
+		codec_take_bytes(cursor, response->value.string, response->length);
+	}
+	else
+	{
+		response->value.string = malloc(string_length + 1);
+		codec_take_bytes(cursor, response->value.string, string_length + 1);
+	}
+
+	return true;
+}
+
+static int get_filename(nxtCursor* cursor, nxtResponse* response)
+{
+	if (codec_remaining(cursor) < 20)
+	{
+		return false;
+	}
+	if (memchr(cursor->data + cursor->position, 0, 20) == NULL)
+	{
+		return false;
+	}
+
+	response->value.filename = malloc(20);
+	codec_take_bytes(cursor, response->value.filename, 20);
+
+	return true;
+}
+
+// Copies the rest of the packet into the caller's array instead of allocating
+// one, so that large transfers can be received in place.
+static int get_buffer(nxtCursor* cursor, nxtResponse* response)
+{
+	if (response->value.bytes == NULL)
+	{
+		return false;
+	}
+	if (codec_remaining(cursor) > response->length)
+	{
+		return false;
+	}
+
+	response->length = codec_remaining(cursor);
+	codec_take_bytes(cursor, response->value.bytes, response->length);
+
+	return true;
+}
@@ -0,0 +1,116 @@
+#ifndef _codec_h_
+#define _codec_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+
+#include "libnxtbt.h"
+
+#define NXT_FRAME_HEADER_LENGTH 2	// little-endian length prefix in front of every packet
+#define NXT_FRAME_MAX_LENGTH 65535	// largest packet body the length prefix can describe
+#define NXT_FRAME_BUFFER_SIZE (NXT_FRAME_HEADER_LENGTH + NXT_FRAME_MAX_LENGTH)
+
+// A cursor over a packet body. When encoding, position is the write offset and
+// limit is the capacity; when decoding, position is the read offset and limit
+// is the number of bytes received.
+typedef struct
+{
+	uint8_t*	data;
+	int	position;
+	int	limit;
+} nxtCursor;
+
+int codec_encode_command(uint8_t* frame, nxtCommand command, bool reply, nxtParameter parameters[], int parameter_count);
+int codec_decode_response(uint8_t* body, int length, nxtCommand command, nxtResponse responses[], int response_count);
+
+static inline int codec_remaining(const nxtCursor* cursor)
+{
+	return cursor->limit - cursor->position;
+}
+
+static inline void codec_put_ubyte(nxtCursor* cursor, uint8_t value)
+{
+	cursor->data[cursor->position] = value;
+	cursor->position += 1;
+}
+
+static inline void codec_put_uword(nxtCursor* cursor, uint16_t value)
+{
+	uint16_t	little_endian;
+
+	little_endian = htole16(value);
+	memcpy(cursor->data + cursor->position, &little_endian, 2);
+	cursor->position += 2;
+}
+
+static inline void codec_put_ulong(nxtCursor* cursor, uint32_t value)
+{
+	uint32_t	little_endian;
+
+	little_endian = htole32(value);
+	memcpy(cursor->data + cursor->position, &little_endian, 4);
+	cursor->position += 4;
+}
+
+static inline void codec_put_bytes(nxtCursor* cursor, const void* bytes, int length)
+{
+	memcpy(cursor->data + cursor->position, bytes, length);
+	cursor->position += length;
+}
+
+static inline void codec_put_zeros(nxtCursor* cursor, int length)
+{
+	memset(cursor->data + cursor->position, 0, length);
+	cursor->position += length;
+}
+
+static inline uint8_t codec_take_ubyte(nxtCursor* cursor)
+{
+	uint8_t	value;
+
+	value = cursor->data[cursor->position];
+	cursor->position += 1;
+
+	return value;
+}
+
+static inline uint16_t codec_take_uword(nxtCursor* cursor)
+{
+	uint16_t	little_endian;
+
+	memcpy(&little_endian, cursor->data + cursor->position, 2);
+	cursor->position += 2;
+
+	return le16toh(little_endian);
+}
+
+static inline uint32_t codec_take_ulong(nxtCursor* cursor)
+{
+	uint32_t	little_endian;
+
+	memcpy(&little_endian, cursor->data + cursor->position, 4);
+	cursor->position += 4;
+
+	return le32toh(little_endian);
+}
+
+static inline void codec_take_bytes(nxtCursor* cursor, void* bytes, int length)
+{
+	memcpy(bytes, cursor->data + cursor->position, length);
+	cursor->position += length;
+}
+
+static inline void codec_write_length(uint8_t* frame, int length)
+{
+	frame[0] = length & 0xFF;
+	frame[1] = (length & 0xFF00) >> 8;
+}
+
+static inline int codec_read_length(const uint8_t* frame)
+{
+	return frame[0] | (frame[1] << 8);
+}
+
+#endif
@@ -0,0 +1,792 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "template.h"
+#include "commands.h"
+
+#define COMMAND_COUNT 33
+
+// parameter structures, laid out exactly as in the packets
+typedef struct __attribute__((packed))
+{
+	uint8_t	port;
+} commandPort;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	handle;
+} commandHandle;
+
+typedef struct __attribute__((packed))
+{
+	char	filename[NXT_FILENAME_LENGTH];
+} commandFilename;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	loop;
+	char	filename[NXT_FILENAME_LENGTH];
+} commandPlaySoundFile;
+
+typedef struct __attribute__((packed))
+{
+	uint16_t	frequency;
+	uint16_t	duration;
+} commandPlayTone;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	port;
+	uint8_t	sensor_type;
+	uint8_t	sensor_mode;
+} commandSetInputMode;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	inbox;
+	uint8_t	length;
+	char	message[NXT_MESSAGE_LENGTH];
+} commandMessageWrite;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	port;
+	uint8_t	relative;
+} commandResetMotorPosition;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	port;
+	uint8_t	tx_length;
+	uint8_t	rx_length;
+	uint8_t	data[NXT_LS_DATA_LENGTH];
+} commandLSWrite;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	remote_inbox;
+	uint8_t	local_inbox;
+	uint8_t	remove;
+} commandMessageRead;
+
+typedef struct __attribute__((packed))
+{
+	char	filename[NXT_FILENAME_LENGTH];
+	uint32_t	size;
+} commandOpenWrite;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	handle;
+	uint16_t	length;
+} commandRead;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	handle;
+	uint8_t	data[NXT_WRITE_DATA_MAX];
+	uint16_t	length;	// not sent; the NXT takes the length of the data from the packet
+} commandWrite;
+
+typedef struct __attribute__((packed))
+{
+	char	name[NXT_BRICK_NAME_LENGTH];
+} commandSetBrickName;
+
+// The layout of every command and its reply. Each packet is the fields listed
+// here one after another; only the last field may be of variable length, in
+// which case the tail gives the integer holding its length.
+typedef struct
+{
+	nxtCommand	command;
+	int	parameter_count;
+	nxtField	parameters[NXT_TEMPLATE_FIELDS_MAX];
+	templateTail	parameter_tail;
+	int	response_count;
+	nxtField	responses[NXT_TEMPLATE_FIELDS_MAX];
+	templateTail	response_tail;
+} commandDescriptor;
+
+#define FIELD(type, structure, member) { type, 0, offsetof(structure, member) }
+#define ARRAY(type, structure, member) { type, sizeof(((structure*) 0)->member), offsetof(structure, member) }
+#define TAIL(structure, member) { offsetof(structure, member), sizeof(((structure*) 0)->member) }
+#define FIXED { 0, 0 }
+#define STATUS 1, { FIELD(NXT_TYPE_UBYTE, nxtStatusReply, status) }, FIXED
+
+static const commandDescriptor	mDescriptors[COMMAND_COUNT] =
+{
+	{
+		NXT_CMD_STARTPROGRAM,
+		1, { FIELD(NXT_TYPE_FILENAME, commandFilename, filename) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_STOPPROGRAM,
+		0, { }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_PLAYSOUNDFILE,
+		2, { FIELD(NXT_TYPE_BOOLEAN, commandPlaySoundFile, loop), FIELD(NXT_TYPE_FILENAME, commandPlaySoundFile, filename) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_PLAYTONE,
+		2, { FIELD(NXT_TYPE_UWORD, commandPlayTone, frequency), FIELD(NXT_TYPE_UWORD, commandPlayTone, duration) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_SETOUTPUTSTATE,
+		7,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtOutputState, port),
+			FIELD(NXT_TYPE_SBYTE, nxtOutputState, power),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputState, mode),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputState, regulation_mode),
+			FIELD(NXT_TYPE_SBYTE, nxtOutputState, turn_ratio),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputState, run_state),
+			FIELD(NXT_TYPE_ULONG, nxtOutputState, tacho_limit),
+		},
+		FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_SETINPUTMODE,
+		3, { FIELD(NXT_TYPE_UBYTE, commandSetInputMode, port), FIELD(NXT_TYPE_UBYTE, commandSetInputMode, sensor_type), FIELD(NXT_TYPE_UBYTE, commandSetInputMode, sensor_mode) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_GETOUTPUTSTATE,
+		1, { FIELD(NXT_TYPE_UBYTE, commandPort, port) }, FIXED,
+		11,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtOutputStateReply, status),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputStateReply, port),
+			FIELD(NXT_TYPE_SBYTE, nxtOutputStateReply, power),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputStateReply, mode),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputStateReply, regulation_mode),
+			FIELD(NXT_TYPE_SBYTE, nxtOutputStateReply, turn_ratio),
+			FIELD(NXT_TYPE_UBYTE, nxtOutputStateReply, run_state),
+			FIELD(NXT_TYPE_ULONG, nxtOutputStateReply, tacho_limit),
+			FIELD(NXT_TYPE_SLONG, nxtOutputStateReply, tacho_count),
+			FIELD(NXT_TYPE_SLONG, nxtOutputStateReply, block_tacho_count),
+			FIELD(NXT_TYPE_SLONG, nxtOutputStateReply, rotation_count),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_GETINPUTVALUES,
+		1, { FIELD(NXT_TYPE_UBYTE, commandPort, port) }, FIXED,
+		10,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtInputValues, status),
+			FIELD(NXT_TYPE_UBYTE, nxtInputValues, port),
+			FIELD(NXT_TYPE_BOOLEAN, nxtInputValues, valid),
+			FIELD(NXT_TYPE_BOOLEAN, nxtInputValues, calibrated),
+			FIELD(NXT_TYPE_UBYTE, nxtInputValues, sensor_type),
+			FIELD(NXT_TYPE_UBYTE, nxtInputValues, sensor_mode),
+			FIELD(NXT_TYPE_UWORD, nxtInputValues, raw_value),
+			FIELD(NXT_TYPE_UWORD, nxtInputValues, normalized_value),
+			FIELD(NXT_TYPE_SWORD, nxtInputValues, scaled_value),
+			FIELD(NXT_TYPE_SWORD, nxtInputValues, calibrated_value),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_RESETINPUTSCALEDVALUE,
+		1, { FIELD(NXT_TYPE_UBYTE, commandPort, port) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_MESSAGEWRITE,
+		3, { FIELD(NXT_TYPE_UBYTE, commandMessageWrite, inbox), FIELD(NXT_TYPE_UBYTE, commandMessageWrite, length), ARRAY(NXT_TYPE_BYTES, commandMessageWrite, message) }, TAIL(commandMessageWrite, length),
+		STATUS,
+	},
+	{
+		NXT_CMD_RESETMOTORPOSITION,
+		2, { FIELD(NXT_TYPE_UBYTE, commandResetMotorPosition, port), FIELD(NXT_TYPE_BOOLEAN, commandResetMotorPosition, relative) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_GETBATTERYLEVEL,
+		0, { }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtBatteryLevel, status), FIELD(NXT_TYPE_UWORD, nxtBatteryLevel, millivolts) }, FIXED,
+	},
+	{
+		NXT_CMD_STOPSOUNDPLAYBACK,
+		0, { }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_KEEPALIVE,
+		0, { }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtKeepAliveReply, status), FIELD(NXT_TYPE_ULONG, nxtKeepAliveReply, sleep_time) }, FIXED,
+	},
+	{
+		NXT_CMD_LSGETSTATUS,
+		1, { FIELD(NXT_TYPE_UBYTE, commandPort, port) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtLSStatus, status), FIELD(NXT_TYPE_UBYTE, nxtLSStatus, bytes_ready) }, FIXED,
+	},
+	{
+		NXT_CMD_LSWRITE,
+		4,
+		{
+			FIELD(NXT_TYPE_UBYTE, commandLSWrite, port),
+			FIELD(NXT_TYPE_UBYTE, commandLSWrite, tx_length),
+			FIELD(NXT_TYPE_UBYTE, commandLSWrite, rx_length),
+			ARRAY(NXT_TYPE_BYTES, commandLSWrite, data),
+		},
+		TAIL(commandLSWrite, tx_length),
+		STATUS,
+	},
+	{
+		NXT_CMD_LSREAD,
+		1, { FIELD(NXT_TYPE_UBYTE, commandPort, port) }, FIXED,
+		3, { FIELD(NXT_TYPE_UBYTE, nxtLSData, status), FIELD(NXT_TYPE_UBYTE, nxtLSData, bytes_read), ARRAY(NXT_TYPE_BYTES, nxtLSData, data) }, FIXED,
+	},
+	{
+		NXT_CMD_GETCURRENTPROGRAMNAME,
+		0, { }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtFilenameReply, status), FIELD(NXT_TYPE_FILENAME, nxtFilenameReply, filename) }, FIXED,
+	},
+	{
+		NXT_CMD_MESSAGEREAD,
+		3, { FIELD(NXT_TYPE_UBYTE, commandMessageRead, remote_inbox), FIELD(NXT_TYPE_UBYTE, commandMessageRead, local_inbox), FIELD(NXT_TYPE_BOOLEAN, commandMessageRead, remove) }, FIXED,
+		4,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtMessage, status),
+			FIELD(NXT_TYPE_UBYTE, nxtMessage, local_inbox),
+			FIELD(NXT_TYPE_UBYTE, nxtMessage, length),
+			ARRAY(NXT_TYPE_BYTES, nxtMessage, message),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_OPENREAD,
+		1, { FIELD(NXT_TYPE_FILENAME, commandFilename, filename) }, FIXED,
+		3, { FIELD(NXT_TYPE_UBYTE, nxtOpenReadReply, status), FIELD(NXT_TYPE_UBYTE, nxtOpenReadReply, handle), FIELD(NXT_TYPE_ULONG, nxtOpenReadReply, size) }, FIXED,
+	},
+	{
+		NXT_CMD_OPENWRITE,
+		2, { FIELD(NXT_TYPE_FILENAME, commandOpenWrite, filename), FIELD(NXT_TYPE_ULONG, commandOpenWrite, size) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtHandleReply, status), FIELD(NXT_TYPE_UBYTE, nxtHandleReply, handle) }, FIXED,
+	},
+	{
+		NXT_CMD_READ,
+		2, { FIELD(NXT_TYPE_UBYTE, commandRead, handle), FIELD(NXT_TYPE_UWORD, commandRead, length) }, FIXED,
+		4,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtReadData, status),
+			FIELD(NXT_TYPE_UBYTE, nxtReadData, handle),
+			FIELD(NXT_TYPE_UWORD, nxtReadData, length),
+			ARRAY(NXT_TYPE_BYTES, nxtReadData, data),
+		},
+		TAIL(nxtReadData, length),
+	},
+	{
+		NXT_CMD_WRITE,
+		2, { FIELD(NXT_TYPE_UBYTE, commandWrite, handle), ARRAY(NXT_TYPE_BYTES, commandWrite, data) }, TAIL(commandWrite, length),
+		3, { FIELD(NXT_TYPE_UBYTE, nxtWriteReply, status), FIELD(NXT_TYPE_UBYTE, nxtWriteReply, handle), FIELD(NXT_TYPE_UWORD, nxtWriteReply, length) }, FIXED,
+	},
+	{
+		NXT_CMD_CLOSE,
+		1, { FIELD(NXT_TYPE_UBYTE, commandHandle, handle) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtHandleReply, status), FIELD(NXT_TYPE_UBYTE, nxtHandleReply, handle) }, FIXED,
+	},
+	{
+		NXT_CMD_DELETE,
+		1, { FIELD(NXT_TYPE_FILENAME, commandFilename, filename) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtFilenameReply, status), FIELD(NXT_TYPE_FILENAME, nxtFilenameReply, filename) }, FIXED,
+	},
+	{
+		NXT_CMD_FINDFIRST,
+		1, { FIELD(NXT_TYPE_FILENAME, commandFilename, filename) }, FIXED,
+		4,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtFileInfo, status),
+			FIELD(NXT_TYPE_UBYTE, nxtFileInfo, handle),
+			FIELD(NXT_TYPE_FILENAME, nxtFileInfo, filename),
+			FIELD(NXT_TYPE_ULONG, nxtFileInfo, size),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_FINDNEXT,
+		1, { FIELD(NXT_TYPE_UBYTE, commandHandle, handle) }, FIXED,
+		4,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtFileInfo, status),
+			FIELD(NXT_TYPE_UBYTE, nxtFileInfo, handle),
+			FIELD(NXT_TYPE_FILENAME, nxtFileInfo, filename),
+			FIELD(NXT_TYPE_ULONG, nxtFileInfo, size),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_GETFIRMWAREVERSION,
+		0, { }, FIXED,
+		5,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtFirmwareVersion, status),
+			FIELD(NXT_TYPE_UBYTE, nxtFirmwareVersion, protocol_minor),
+			FIELD(NXT_TYPE_UBYTE, nxtFirmwareVersion, protocol_major),
+			FIELD(NXT_TYPE_UBYTE, nxtFirmwareVersion, firmware_minor),
+			FIELD(NXT_TYPE_UBYTE, nxtFirmwareVersion, firmware_major),
+		},
+		FIXED,
+	},
+	{
+		NXT_CMD_OPENWRITELINEAR,
+		2, { FIELD(NXT_TYPE_FILENAME, commandOpenWrite, filename), FIELD(NXT_TYPE_ULONG, commandOpenWrite, size) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtHandleReply, status), FIELD(NXT_TYPE_UBYTE, nxtHandleReply, handle) }, FIXED,
+	},
+	{
+		NXT_CMD_OPENWRITEDATA,
+		2, { FIELD(NXT_TYPE_FILENAME, commandOpenWrite, filename), FIELD(NXT_TYPE_ULONG, commandOpenWrite, size) }, FIXED,
+		2, { FIELD(NXT_TYPE_UBYTE, nxtHandleReply, status), FIELD(NXT_TYPE_UBYTE, nxtHandleReply, handle) }, FIXED,
+	},
+	{
+		NXT_CMD_OPENAPPENDDATA,
+		1, { FIELD(NXT_TYPE_FILENAME, commandFilename, filename) }, FIXED,
+		3, { FIELD(NXT_TYPE_UBYTE, nxtOpenAppendReply, status), FIELD(NXT_TYPE_UBYTE, nxtOpenAppendReply, handle), FIELD(NXT_TYPE_ULONG, nxtOpenAppendReply, available) }, FIXED,
+	},
+	{
+		NXT_CMD_SETBRICKNAME,
+		1, { ARRAY(NXT_TYPE_STRING, commandSetBrickName, name) }, FIXED,
+		STATUS,
+	},
+	{
+		NXT_CMD_GETDEVICEINFO,
+		0, { }, FIXED,
+		5,
+		{
+			FIELD(NXT_TYPE_UBYTE, nxtDeviceInfo, status),
+			ARRAY(NXT_TYPE_STRING, nxtDeviceInfo, name),
+			ARRAY(NXT_TYPE_BYTES, nxtDeviceInfo, address),
+			FIELD(NXT_TYPE_ULONG, nxtDeviceInfo, signal_strength),
+			FIELD(NXT_TYPE_ULONG, nxtDeviceInfo, free_flash),
+		},
+		FIXED,
+	},
+};
+
+#undef FIELD
+#undef ARRAY
+#undef TAIL
+#undef FIXED
+#undef STATUS
+
+static nxtTemplate	mTemplates[COMMAND_COUNT];
+static int8_t	mTemplateIndex[256];	// index into mTemplates by command, or -1
+static pthread_once_t	mTemplatesCompiled = PTHREAD_ONCE_INIT;
+
+static int do_command(nxtConnection* connection, nxtCommand command, const void* parameters, void* reply);
+static void compile_templates();
+static int copy_string(char* destination, const char* source, int size);
+
+// PUBLIC FUNCTIONS
+// (each of these sends the command without asking for a response if reply is NULL)
+
+int nxtStartProgram(nxtConnection* connection, const char* filename, nxtStatusReply* reply)
+{
+	commandFilename	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_STARTPROGRAM, &parameters, reply);
+}
+
+int nxtStopProgram(nxtConnection* connection, nxtStatusReply* reply)
+{
+	return do_command(connection, NXT_CMD_STOPPROGRAM, NULL, reply);
+}
+
+int nxtPlaySoundFile(nxtConnection* connection, int loop, const char* filename, nxtStatusReply* reply)
+{
+	commandPlaySoundFile	parameters;
+
+	parameters.loop = loop != 0;
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_PLAYSOUNDFILE, &parameters, reply);
+}
+
+int nxtPlayTone(nxtConnection* connection, uint16_t frequency, uint16_t duration, nxtStatusReply* reply)
+{
+	commandPlayTone	parameters;
+
+	parameters.frequency = frequency;
+	parameters.duration = duration;
+
+	return do_command(connection, NXT_CMD_PLAYTONE, &parameters, reply);
+}
+
+int nxtSetOutputState(nxtConnection* connection, const nxtOutputState* state, nxtStatusReply* reply)
+{
+	return do_command(connection, NXT_CMD_SETOUTPUTSTATE, state, reply);
+}
+
+int nxtSetInputMode(nxtConnection* connection, uint8_t port, uint8_t sensor_type, uint8_t sensor_mode, nxtStatusReply* reply)
+{
+	commandSetInputMode	parameters;
+
+	parameters.port = port;
+	parameters.sensor_type = sensor_type;
+	parameters.sensor_mode = sensor_mode;
+
+	return do_command(connection, NXT_CMD_SETINPUTMODE, &parameters, reply);
+}
+
+int nxtGetOutputState(nxtConnection* connection, uint8_t port, nxtOutputStateReply* reply)
+{
+	commandPort	parameters;
+
+	parameters.port = port;
+
+	return do_command(connection, NXT_CMD_GETOUTPUTSTATE, &parameters, reply);
+}
+
+int nxtGetInputValues(nxtConnection* connection, uint8_t port, nxtInputValues* reply)
+{
+	commandPort	parameters;
+
+	parameters.port = port;
+
+	return do_command(connection, NXT_CMD_GETINPUTVALUES, &parameters, reply);
+}
+
+int nxtResetInputScaledValue(nxtConnection* connection, uint8_t port, nxtStatusReply* reply)
+{
+	commandPort	parameters;
+
+	parameters.port = port;
+
+	return do_command(connection, NXT_CMD_RESETINPUTSCALEDVALUE, &parameters, reply);
+}
+
+int nxtMessageWrite(nxtConnection* connection, uint8_t inbox, const char* message, nxtStatusReply* reply)
+{
+	commandMessageWrite	parameters;
+
+	parameters.inbox = inbox;
+	if (copy_string(parameters.message, message, NXT_MESSAGE_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	parameters.length = strlen(parameters.message) + 1;
+
+	return do_command(connection, NXT_CMD_MESSAGEWRITE, &parameters, reply);
+}
+
+int nxtResetMotorPosition(nxtConnection* connection, uint8_t port, int relative, nxtStatusReply* reply)
+{
+	commandResetMotorPosition	parameters;
+
+	parameters.port = port;
+	parameters.relative = relative != 0;
+
+	return do_command(connection, NXT_CMD_RESETMOTORPOSITION, &parameters, reply);
+}
+
+int nxtGetBatteryLevel(nxtConnection* connection, nxtBatteryLevel* reply)
+{
+	return do_command(connection, NXT_CMD_GETBATTERYLEVEL, NULL, reply);
+}
+
+int nxtStopSoundPlayback(nxtConnection* connection, nxtStatusReply* reply)
+{
+	return do_command(connection, NXT_CMD_STOPSOUNDPLAYBACK, NULL, reply);
+}
+
+int nxtKeepAlive(nxtConnection* connection, nxtKeepAliveReply* reply)
+{
+	return do_command(connection, NXT_CMD_KEEPALIVE, NULL, reply);
+}
+
+int nxtLSGetStatus(nxtConnection* connection, uint8_t port, nxtLSStatus* reply)
+{
+	commandPort	parameters;
+
+	parameters.port = port;
+
+	return do_command(connection, NXT_CMD_LSGETSTATUS, &parameters, reply);
+}
+
+int nxtLSWrite(nxtConnection* connection, uint8_t port, const uint8_t* data, int tx_length, int rx_length, nxtStatusReply* reply)
+{
+	commandLSWrite	parameters;
+
+	if (tx_length < 0 || tx_length > NXT_LS_DATA_LENGTH || rx_length < 0 || rx_length > NXT_LS_DATA_LENGTH)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	parameters.port = port;
+	parameters.tx_length = tx_length;
+	parameters.rx_length = rx_length;
+	memcpy(parameters.data, data, tx_length);
+
+	return do_command(connection, NXT_CMD_LSWRITE, &parameters, reply);
+}
+
+int nxtLSRead(nxtConnection* connection, uint8_t port, nxtLSData* reply)
+{
+	commandPort	parameters;
+
+	parameters.port = port;
+
+	return do_command(connection, NXT_CMD_LSREAD, &parameters, reply);
+}
+
+int nxtGetCurrentProgramName(nxtConnection* connection, nxtFilenameReply* reply)
+{
+	return do_command(connection, NXT_CMD_GETCURRENTPROGRAMNAME, NULL, reply);
+}
+
+int nxtMessageRead(nxtConnection* connection, uint8_t remote_inbox, uint8_t local_inbox, int remove, nxtMessage* reply)
+{
+	commandMessageRead	parameters;
+
+	parameters.remote_inbox = remote_inbox;
+	parameters.local_inbox = local_inbox;
+	parameters.remove = remove != 0;
+
+	return do_command(connection, NXT_CMD_MESSAGEREAD, &parameters, reply);
+}
+
+int nxtOpenRead(nxtConnection* connection, const char* filename, nxtOpenReadReply* reply)
+{
+	commandFilename	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_OPENREAD, &parameters, reply);
+}
+
+int nxtOpenWrite(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply)
+{
+	commandOpenWrite	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	parameters.size = size;
+
+	return do_command(connection, NXT_CMD_OPENWRITE, &parameters, reply);
+}
+
+int nxtRead(nxtConnection* connection, uint8_t handle, int length, nxtReadData* reply)
+{
+	commandRead	parameters;
+
+	if (length < 0 || length > NXT_READ_DATA_MAX)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	parameters.handle = handle;
+	parameters.length = length;
+
+	return do_command(connection, NXT_CMD_READ, &parameters, reply);
+}
+
+int nxtWrite(nxtConnection* connection, uint8_t handle, const uint8_t* data, int length, nxtWriteReply* reply)
+{
+	commandWrite	parameters;
+
+	if (length < 0 || length > NXT_WRITE_DATA_MAX)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	parameters.handle = handle;
+	parameters.length = length;
+	memcpy(parameters.data, data, length);
+
+	return do_command(connection, NXT_CMD_WRITE, &parameters, reply);
+}
+
+int nxtCloseHandle(nxtConnection* connection, uint8_t handle, nxtHandleReply* reply)
+{
+	commandHandle	parameters;
+
+	parameters.handle = handle;
+
+	return do_command(connection, NXT_CMD_CLOSE, &parameters, reply);
+}
+
+int nxtDelete(nxtConnection* connection, const char* filename, nxtFilenameReply* reply)
+{
+	commandFilename	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_DELETE, &parameters, reply);
+}
+
+int nxtFindFirst(nxtConnection* connection, const char* pattern, nxtFileInfo* reply)
+{
+	commandFilename	parameters;
+
+	if (copy_string(parameters.filename, pattern, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_FINDFIRST, &parameters, reply);
+}
+
+int nxtFindNext(nxtConnection* connection, uint8_t handle, nxtFileInfo* reply)
+{
+	commandHandle	parameters;
+
+	parameters.handle = handle;
+
+	return do_command(connection, NXT_CMD_FINDNEXT, &parameters, reply);
+}
+
+int nxtGetFirmwareVersion(nxtConnection* connection, nxtFirmwareVersion* reply)
+{
+	return do_command(connection, NXT_CMD_GETFIRMWAREVERSION, NULL, reply);
+}
+
+int nxtOpenWriteLinear(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply)
+{
+	commandOpenWrite	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	parameters.size = size;
+
+	return do_command(connection, NXT_CMD_OPENWRITELINEAR, &parameters, reply);
+}
+
+int nxtOpenWriteData(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply)
+{
+	commandOpenWrite	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	parameters.size = size;
+
+	return do_command(connection, NXT_CMD_OPENWRITEDATA, &parameters, reply);
+}
+
+int nxtOpenAppendData(nxtConnection* connection, const char* filename, nxtOpenAppendReply* reply)
+{
+	commandFilename	parameters;
+
+	if (copy_string(parameters.filename, filename, NXT_FILENAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_OPENAPPENDDATA, &parameters, reply);
+}
+
+int nxtSetBrickName(nxtConnection* connection, const char* name, nxtStatusReply* reply)
+{
+	commandSetBrickName	parameters;
+
+	if (copy_string(parameters.name, name, NXT_BRICK_NAME_LENGTH) == false)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	return do_command(connection, NXT_CMD_SETBRICKNAME, &parameters, reply);
+}
+
+int nxtGetDeviceInfo(nxtConnection* connection, nxtDeviceInfo* reply)
+{
+	return do_command(connection, NXT_CMD_GETDEVICEINFO, NULL, reply);
+}
+
+// LIBRARY FUNCTIONS
+
+// Returns the template for a command, compiled from mDescriptors, or NULL if
+// the command is not known.
+const nxtTemplate* commands_template(nxtCommand command)
+{
+	pthread_once(&mTemplatesCompiled, compile_templates);
+
+	if (command < 0 || command > 255 || mTemplateIndex[command] < 0)
+	{
+		return NULL;
+	}
+
+	return &(mTemplates[mTemplateIndex[command]]);
+}
+
+// PRIVATE FUNCTIONS
+
+static int do_command(nxtConnection* connection, nxtCommand command, const void* parameters, void* reply)
+{
+	if (reply == NULL)
+	{
+		return nxtConnSendTemplate(connection, commands_template(command), parameters);
+	}
+
+	return nxtConnDoTemplate(connection, commands_template(command), parameters, reply);
+}
+
+static void compile_templates()
+{
+	const commandDescriptor*	descriptor;
+	int	index;
+
+	memset(mTemplateIndex, -1, sizeof(mTemplateIndex));
+
+	index = 0;
+	while (index < COMMAND_COUNT)
+	{
+		descriptor = &(mDescriptors[index]);
+		template_compile(&(mTemplates[index]), descriptor->command, descriptor->parameters, descriptor->parameter_count, descriptor->parameter_tail, descriptor->responses, descriptor->response_count, descriptor->response_tail);
+		mTemplateIndex[descriptor->command] = index;
+		index += 1;
+	}
+}
+
+// Copies a string into a fixed-length field, padding it with zeros. Returns
+// false if it does not fit (with its terminating zero).
+static int copy_string(char* destination, const char* source, int size)
+{
+	int	length;
+
+	if (source == NULL)
+	{
+		return false;
+	}
+
+	length = strnlen(source, size);
+	if (length == size)
+	{
+		return false;
+	}
+
+	memcpy(destination, source, length);
+	memset(destination + length, 0, size - length);
+
+	return true;
+}
@@ -0,0 +1,8 @@
+#ifndef _commands_h_
+#define _commands_h_
+
+#include "libnxtbt.h"
+
+const nxtTemplate* commands_template(nxtCommand command);
+
+#endif
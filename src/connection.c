@@ -0,0 +1,1453 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+#include "connection.h"
+#include "stats.h"
+#include "template.h"
+#include "directory.h"
+#include "transport.h"
+
+#define OUTPUT_BUFFER_SIZE (2 * NXT_FRAME_BUFFER_SIZE)
+#define SCHEDULER_UNIT 720720	// virtual time of one request, divisible by every weight up to 16
+
+static int send_frame(nxtConnection* connection, nxtCommand command, int length);
+static int append_frame(nxtConnection* connection, nxtCommand command, int length);
+static int make_room(nxtConnection* connection);
+static void enqueue_request(nxtConnection* connection, nxtRequest* request);
+static void dispatch_pending(nxtConnection* connection);
+static int select_class(nxtConnection* connection);
+static nxtRequest* complete_oldest(nxtConnection* connection);
+static int is_oldest(nxtConnection* connection, nxtRequest* request);
+static int complete_frame(nxtConnection* connection);
+static int is_reply_to(nxtConnection* connection, int index, const uint8_t* body, int length);
+static void finish_request(nxtConnection* connection, nxtRequest* request, int result);
+static void fail_in_flight(nxtConnection* connection, int result);
+static void expire_in_flight(nxtConnection* connection);
+static int claim_orphan(nxtConnection* connection, uint8_t command);
+static int is_quarantined(nxtConnection* connection);
+static void wait_for_orphans(nxtConnection* connection);
+static void run_completions(nxtConnection* connection);
+static int is_in_flight(nxtConnection* connection, nxtRequest* request);
+static int is_pending(nxtConnection* connection, nxtRequest* request);
+static int append_output(nxtConnection* connection, int length);
+static int flush_output(nxtConnection* connection, bool block);
+static int fill_input(nxtConnection* connection, bool block, uint64_t deadline);
+static int wait_port(nxtConnection* connection, short events, uint64_t deadline);
+static int wait_reader(nxtConnection* connection, uint64_t deadline);
+static int input_frame_length(nxtConnection* connection);
+static nxtClass default_class(int command);
+
+// PUBLIC FUNCTIONS
+
+nxtConnection* nxtConnect(const char* device)
+{
+	nxtConnection*	connection;
+	pthread_condattr_t	attributes;
+	const char*	address;
+	int	index;
+
+	connection = calloc(1, sizeof(nxtConnection));
+	if (connection == NULL)
+	{
+		return NULL;
+	}
+
+	// the port is always non-blocking; synchronous calls wait for it with poll()
+	connection->transport = transport_find(device, &address);
+	connection->port = connection->transport->open(address);
+	if (connection->port < 0)
+	{
+		free(connection);
+		return NULL;
+	}
+
+	connection->frame = malloc(NXT_FRAME_BUFFER_SIZE);
+	connection->input = malloc(NXT_FRAME_BUFFER_SIZE);
+	connection->output = malloc(OUTPUT_BUFFER_SIZE);
+	connection->stats = calloc(1, sizeof(statsCounters));
+	connection->directory = directory_create();
+	connection->keepalive = keepalive_create();
+	if (connection->frame == NULL || connection->input == NULL || connection->output == NULL || connection->stats == NULL || connection->directory == NULL || connection->keepalive == NULL)
+	{
+		connection->transport->close(connection->port);
+		free(connection->frame);
+		free(connection->input);
+		free(connection->output);
+		free(connection->stats);
+		directory_destroy(connection->directory);
+		keepalive_destroy(connection->keepalive);
+		free(connection);
+		return NULL;
+	}
+
+	pthread_mutex_init(&connection->lock, NULL);
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&connection->input_ready, &attributes);
+	pthread_condattr_destroy(&attributes);
+	connection->pipeline_depth = NXT_PIPELINE_DEPTH_DEFAULT;
+	connection->scheduling = NXT_SCHED_FIFO;
+	index = 0;
+	while (index < 256)
+	{
+		connection->classes[index] = default_class(index);
+		index += 1;
+	}
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		connection->weights[index] = 1 << (NXT_CLASSES - 1 - index);
+		index += 1;
+	}
+
+	return connection;
+}
+
+void nxtDisconnect(nxtConnection* connection)
+{
+	if (connection == NULL)
+	{
+		return;
+	}
+
+	nxtConnStopKeepAlive(connection);
+
+	connection->transport->close(connection->port);
+	pthread_cond_destroy(&connection->input_ready);
+	pthread_mutex_destroy(&connection->lock);
+	free(connection->frame);
+	free(connection->input);
+	free(connection->output);
+	free(connection->stats);
+	directory_destroy(connection->directory);
+	keepalive_destroy(connection->keepalive);
+	free(connection);
+}
+
+int nxtConnDoCommand(nxtConnection* connection, nxtCommand command, nxtParameter parameters[], nxtResponse responses[], int parameter_count, int response_count)
+{
+	nxtRequest	request;
+
+	request.command = command;
+	request.parameters = parameters;
+	request.responses = responses;
+	request.parameter_count = parameter_count;
+	request.response_count = response_count;
+	request.callback = NULL;
+	request.command_template = NULL;
+
+	nxtConnSubmit(connection, &request);
+
+	return nxtConnWait(connection, &request);
+}
+
+int nxtConnSendCommand(nxtConnection* connection, nxtCommand command, nxtParameter parameters[], int parameter_count)
+{
+	uint64_t	start;
+	int	length;
+	int	result;
+
+	pthread_mutex_lock(&connection->lock);
+
+	result = make_room(connection);
+	if (result == 0)
+	{
+		start = stats_now();
+		length = codec_encode_command(connection->frame, command, false, parameters, parameter_count);
+		stats_record_phase(connection->stats, NXT_PHASE_ENCODE, stats_now() - start);
+		result = send_frame(connection, command, length);
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	return result;
+}
+
+// Sends the commands in requests[] without asking for replies, packed into as
+// few writes as the output buffer allows. Stops at the first command that
+// cannot be encoded, but the ones before it are still written. Returns 0 or a
+// negative nxtLibError.
+int nxtConnSendCommands(nxtConnection* connection, nxtRequest requests[], int request_count)
+{
+	uint64_t	start;
+	int	request_index;
+	int	length;
+	int	result;
+
+	pthread_mutex_lock(&connection->lock);
+
+	result = 0;
+	request_index = 0;
+	while (result == 0 && request_index < request_count)
+	{
+		result = make_room(connection);
+		if (result == 0)
+		{
+			start = stats_now();
+			length = codec_encode_command(connection->frame, requests[request_index].command, false, requests[request_index].parameters, requests[request_index].parameter_count);
+			stats_record_phase(connection->stats, NXT_PHASE_ENCODE, stats_now() - start);
+			result = append_frame(connection, requests[request_index].command, length);
+		}
+		request_index += 1;
+	}
+
+	length = flush_output(connection, true);
+	if (length < 0 && request_index > 0)
+	{
+		stats_record_result(connection->stats, requests[request_index - 1].command, length);
+		if (result == 0)
+		{
+			result = length;
+		}
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	return result;
+}
+
+int nxtConnSetPipelineDepth(nxtConnection* connection, int depth)
+{
+	if (depth < 1 || depth > NXT_PIPELINE_DEPTH_MAX)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+
+	pthread_mutex_lock(&connection->lock);
+	connection->pipeline_depth = depth;
+	dispatch_pending(connection);
+	pthread_mutex_unlock(&connection->lock);
+
+	return 0;
+}
+
+// Limits how long a write may stall and how long a reply may take, for every
+// command, in nanoseconds (0 to wait for ever). A request whose reply has not
+// arrived timeout nanoseconds after it was written fails with
+// NXT_LIBERR_TIMEOUT.
+void nxtConnSetTimeout(nxtConnection* connection, uint64_t timeout)
+{
+	int	command;
+
+	pthread_mutex_lock(&connection->lock);
+	connection->timeout = timeout;
+	command = 0;
+	while (command < 256)
+	{
+		connection->timeouts[command] = timeout;
+		command += 1;
+	}
+	pthread_mutex_unlock(&connection->lock);
+}
+
+// Limits how long the reply to one command may take, overriding
+// nxtConnSetTimeout until it is called again.
+void nxtConnSetCommandTimeout(nxtConnection* connection, nxtCommand command, uint64_t timeout)
+{
+	pthread_mutex_lock(&connection->lock);
+	connection->timeouts[command & 0xFF] = timeout;
+	pthread_mutex_unlock(&connection->lock);
+}
+
+// Chooses the order in which requests waiting for room in the pipeline are
+// sent. NXT_SCHED_FIFO, the default, keeps the order of submission.
+// NXT_SCHED_PRIORITY always sends the most urgent class first, so a steady
+// stream of control commands can hold back file transfers indefinitely.
+// NXT_SCHED_WEIGHTED shares the pipeline between the waiting classes in
+// proportion to weights[], one per nxtClass from 1 to 16 (8, 4, 2 and 1 by
+// default); pass NULL to keep the current weights. Returns 0 or
+// NXT_LIBERR_GENERAL.
+int nxtConnSetScheduling(nxtConnection* connection, nxtScheduling scheduling, const int weights[])
+{
+	int	index;
+
+	if (scheduling < NXT_SCHED_FIFO || scheduling > NXT_SCHED_WEIGHTED)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+	index = 0;
+	while (weights != NULL && index < NXT_CLASSES)
+	{
+		if (weights[index] < 1 || weights[index] > 16)
+		{
+			return NXT_LIBERR_GENERAL;
+		}
+		index += 1;
+	}
+
+	pthread_mutex_lock(&connection->lock);
+	connection->scheduling = scheduling;
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		if (weights != NULL)
+		{
+			connection->weights[index] = weights[index];
+		}
+		connection->class_time[index] = 0;
+		index += 1;
+	}
+	connection->virtual_time = 0;
+	pthread_mutex_unlock(&connection->lock);
+
+	return 0;
+}
+
+// Moves a command to another class. Requests already waiting keep their
+// place. Returns 0 or NXT_LIBERR_GENERAL.
+int nxtConnSetCommandClass(nxtConnection* connection, nxtCommand command, nxtClass command_class)
+{
+	if (command_class < NXT_CLASS_CONTROL || command_class >= NXT_CLASSES)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+
+	pthread_mutex_lock(&connection->lock);
+	connection->classes[command & 0xFF] = command_class;
+	pthread_mutex_unlock(&connection->lock);
+
+	return 0;
+}
+
+int nxtConnSubmit(nxtConnection* connection, nxtRequest* request)
+{
+	int	submitted;
+
+	request->callback = NULL;
+	request->command_template = NULL;
+
+	pthread_mutex_lock(&connection->lock);
+
+	enqueue_request(connection, request);
+	dispatch_pending(connection);
+	while (is_pending(connection, request) == true)
+	{
+		complete_oldest(connection);
+		dispatch_pending(connection);
+	}
+	flush_output(connection, true);
+	submitted = is_in_flight(connection, request);
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	if (submitted == false)
+	{
+		return request->result;
+	}
+
+	return 0;
+}
+
+nxtRequest* nxtConnComplete(nxtConnection* connection)
+{
+	nxtRequest*	request;
+
+	pthread_mutex_lock(&connection->lock);
+
+	request = complete_oldest(connection);
+	dispatch_pending(connection);
+	flush_output(connection, true);
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	return request;
+}
+
+int nxtConnWait(nxtConnection* connection, nxtRequest* request)
+{
+	pthread_mutex_lock(&connection->lock);
+
+	while (is_in_flight(connection, request) == true || is_pending(connection, request) == true)
+	{
+		complete_oldest(connection);
+		dispatch_pending(connection);
+		flush_output(connection, true);
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	return request->result;
+}
+
+int nxtConnDoCommands(nxtConnection* connection, nxtRequest requests[], int request_count)
+{
+	int	request_index;
+
+	pthread_mutex_lock(&connection->lock);
+
+	request_index = 0;
+	while (request_index < request_count)
+	{
+		requests[request_index].callback = NULL;
+		requests[request_index].command_template = NULL;
+		enqueue_request(connection, &(requests[request_index]));
+		request_index += 1;
+	}
+	dispatch_pending(connection);
+	flush_output(connection, true);
+
+	while (connection->pending_count > 0 || connection->in_flight_count > 0)
+	{
+		complete_oldest(connection);
+		dispatch_pending(connection);
+		flush_output(connection, true);
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	request_index = 0;
+	while (request_index < request_count)
+	{
+		if (requests[request_index].result < 0)
+		{
+			return requests[request_index].result;
+		}
+
+		request_index += 1;
+	}
+
+	return 0;
+}
+
+int nxtConnGetFd(nxtConnection* connection)
+{
+	return connection->port;
+}
+
+short nxtConnPollEvents(nxtConnection* connection)
+{
+	short	events;
+
+	events = 0;
+
+	pthread_mutex_lock(&connection->lock);
+	if (connection->in_flight_count > 0 || is_quarantined(connection) == true)
+	{
+		events |= POLLIN;
+	}
+	if (connection->output_length > connection->output_offset)
+	{
+		events |= POLLOUT;
+	}
+	pthread_mutex_unlock(&connection->lock);
+
+	return events;
+}
+
+// Returns when the oldest request in flight times out, or when requests held
+// back after a timeout may be sent, in CLOCK_MONOTONIC nanoseconds, or 0 if
+// there is no such time. nxtConnProcess should be called by then even if the
+// descriptor has not become ready.
+uint64_t nxtConnGetDeadline(nxtConnection* connection)
+{
+	uint64_t	deadline;
+
+	deadline = 0;
+
+	pthread_mutex_lock(&connection->lock);
+	if (connection->in_flight_count > 0)
+	{
+		deadline = connection->in_flight_deadline[connection->in_flight_head];
+	}
+	else if (connection->pending_count > 0 && is_quarantined(connection) == true)
+	{
+		deadline = connection->quarantine;
+	}
+	pthread_mutex_unlock(&connection->lock);
+
+	return deadline;
+}
+
+int nxtConnQueue(nxtConnection* connection, nxtRequest* request, nxtCompletion callback, void* user_data)
+{
+	int	result;
+
+	request->callback = callback;
+	request->user_data = user_data;
+	request->command_template = NULL;
+
+	pthread_mutex_lock(&connection->lock);
+
+	enqueue_request(connection, request);
+	dispatch_pending(connection);
+	result = flush_output(connection, false);
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	return result < 0 ? result : 0;
+}
+
+int nxtConnProcess(nxtConnection* connection)
+{
+	uint64_t	now;
+	int	completed;
+	int	progress;
+	int	result;
+
+	completed = 0;
+
+	pthread_mutex_lock(&connection->lock);
+
+	// keep going until nothing more can be read or written without blocking
+	do
+	{
+		progress = 0;
+
+		result = flush_output(connection, false);
+		if (result < 0)
+		{
+			break;
+		}
+		progress += result;
+
+		result = fill_input(connection, false, 0);
+		if (result < 0)
+		{
+			break;
+		}
+		progress += result;
+
+		while (input_frame_length(connection) >= 0)
+		{
+			complete_frame(connection);
+			completed += 1;
+		}
+		dispatch_pending(connection);
+	}
+	while (progress > 0);
+
+	if (result < 0)
+	{
+		fail_in_flight(connection, result);
+	}
+	else
+	{
+		now = stats_now();
+		if (connection->in_flight_count > 0 && connection->in_flight_deadline[connection->in_flight_head] != 0 && connection->in_flight_deadline[connection->in_flight_head] <= now)
+		{
+			completed += connection->in_flight_count;
+			expire_in_flight(connection);
+		}
+		dispatch_pending(connection);
+		flush_output(connection, false);
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	if (result < 0)
+	{
+		return result;
+	}
+
+	return completed;
+}
+
+int nxtConnDoTemplate(nxtConnection* connection, const nxtTemplate* command_template, const void* parameters, void* responses)
+{
+	nxtRequest	request;
+
+	// a write error is reported by nxtConnWait, which also makes sure that the
+	// request is no longer in flight when it goes out of scope
+	nxtConnQueueTemplate(connection, &request, command_template, parameters, responses, NULL, NULL);
+
+	return nxtConnWait(connection, &request);
+}
+
+int nxtConnSendTemplate(nxtConnection* connection, const nxtTemplate* command_template, const void* parameters)
+{
+	uint64_t	start;
+	int	length;
+	int	result;
+
+	pthread_mutex_lock(&connection->lock);
+
+	result = make_room(connection);
+	if (result == 0)
+	{
+		start = stats_now();
+		length = template_encode(command_template, connection->frame, false, parameters);
+		stats_record_phase(connection->stats, NXT_PHASE_ENCODE, stats_now() - start);
+		result = send_frame(connection, command_template->command, length);
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	return result;
+}
+
+int nxtConnQueueTemplate(nxtConnection* connection, nxtRequest* request, const nxtTemplate* command_template, const void* parameters, void* responses, nxtCompletion callback, void* user_data)
+{
+	int	result;
+
+	request->command = command_template->command;
+	request->parameters = NULL;
+	request->responses = NULL;
+	request->parameter_count = 0;
+	request->response_count = 0;
+	request->callback = callback;
+	request->user_data = user_data;
+	request->command_template = command_template;
+	request->template_parameters = parameters;
+	request->template_responses = responses;
+
+	pthread_mutex_lock(&connection->lock);
+
+	enqueue_request(connection, request);
+	dispatch_pending(connection);
+	result = flush_output(connection, false);
+
+	pthread_mutex_unlock(&connection->lock);
+
+	run_completions(connection);
+
+	return result < 0 ? result : 0;
+}
+
+// LIBRARY FUNCTIONS
+
+// Sends count no-reply packets of one command, with the parameters in
+// parameters[0] to parameters[count - 1], in as few writes as possible.
+// Returns 0 or a negative nxtLibError.
+int connection_send_templates(nxtConnection* connection, const nxtTemplate* command_template, const void* const parameters[], int count)
+{
+	uint64_t	start;
+	int	index;
+	int	length;
+	int	result;
+
+	pthread_mutex_lock(&connection->lock);
+
+	result = 0;
+	index = 0;
+	while (result == 0 && index < count)
+	{
+		result = make_room(connection);
+		if (result == 0)
+		{
+			start = stats_now();
+			length = template_encode(command_template, connection->frame, false, parameters[index]);
+			stats_record_phase(connection->stats, NXT_PHASE_ENCODE, stats_now() - start);
+			result = append_frame(connection, command_template->command, length);
+		}
+		index += 1;
+	}
+
+	// whatever was appended before an error is written all the same
+	length = flush_output(connection, true);
+	if (length < 0)
+	{
+		stats_record_result(connection->stats, command_template->command, length);
+		if (result == 0)
+		{
+			result = length;
+		}
+	}
+
+	pthread_mutex_unlock(&connection->lock);
+
+	return result;
+}
+
+// PRIVATE FUNCTIONS
+// (all of these except run_completions must be called with the connection
+// locked; flush_output, fill_input and the functions that call them unlock it
+// while they wait, so the state they were called in may have changed when
+// they return)
+
+// Writes the no-reply packet in the frame buffer (or the encoding error in
+// length) and waits until it has been written. Returns 0 or a negative
+// nxtLibError.
+static int send_frame(nxtConnection* connection, nxtCommand command, int length)
+{
+	int	result;
+
+	result = append_frame(connection, command, length);
+	if (result < 0)
+	{
+		return result;
+	}
+	result = flush_output(connection, true);
+	if (result < 0)
+	{
+		stats_record_result(connection->stats, command, result);
+		return result;
+	}
+
+	return 0;
+}
+
+// Adds the no-reply packet in the frame buffer to the output buffer, which
+// make_room must have been called for. Returns 0 or a negative nxtLibError.
+static int append_frame(nxtConnection* connection, nxtCommand command, int length)
+{
+	if (length < 0)
+	{
+		stats_record_send(connection->stats, command, 0);
+		stats_record_result(connection->stats, command, length);
+		return length;
+	}
+	stats_record_send(connection->stats, command, NXT_FRAME_HEADER_LENGTH + length);
+	directory_note_command(connection->directory, command);
+	keepalive_note_send(connection->keepalive, stats_now());
+	append_output(connection, length);
+
+	return 0;
+}
+
+// Writes out the output buffer until a packet of any size fits after what is
+// left in it. Called before encoding into the frame buffer, since another
+// thread may encode into it while flush_output waits.
+static int make_room(nxtConnection* connection)
+{
+	int	result;
+
+	while (connection->output_length - connection->output_offset > OUTPUT_BUFFER_SIZE - NXT_FRAME_BUFFER_SIZE)
+	{
+		result = flush_output(connection, true);
+		if (result < 0)
+		{
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+static void enqueue_request(nxtConnection* connection, nxtRequest* request)
+{
+	int	command_class;
+
+	request->result = NXT_LIBERR_RESPONSE_MISSING;
+	request->next = NULL;
+	request->queued = stats_now();
+	if (request->queued <= connection->last_queued)
+	{
+		request->queued = connection->last_queued + 1;
+	}
+	connection->last_queued = request->queued;
+
+	command_class = connection->classes[request->command & 0xFF];
+	if (connection->pending_tail[command_class] == NULL)
+	{
+		connection->pending_head[command_class] = request;
+		// a class that has been idle does not get to make up for lost time
+		if (connection->class_time[command_class] < connection->virtual_time)
+		{
+			connection->class_time[command_class] = connection->virtual_time;
+		}
+	}
+	else
+	{
+		connection->pending_tail[command_class]->next = request;
+	}
+	connection->pending_tail[command_class] = request;
+	connection->pending_count += 1;
+}
+
+// Encodes pending requests into the output buffer while there is room in the
+// pipeline and in the buffer.
+static void dispatch_pending(nxtConnection* connection)
+{
+	nxtRequest*	request;
+	uint64_t	start;
+	uint64_t	timeout;
+	int	command_class;
+	int	length;
+	int	slot;
+
+	if (is_quarantined(connection) == true)
+	{
+		return;
+	}
+
+	while (connection->pending_count > 0 && connection->in_flight_count < connection->pipeline_depth)
+	{
+		command_class = select_class(connection);
+		request = connection->pending_head[command_class];
+
+		start = stats_now();
+		if (request->command_template != NULL)
+		{
+			length = template_encode(request->command_template, connection->frame, true, request->template_parameters);
+		}
+		else
+		{
+			length = codec_encode_command(connection->frame, request->command, true, request->parameters, request->parameter_count);
+		}
+		stats_record_phase(connection->stats, NXT_PHASE_ENCODE, stats_now() - start);
+		if (length >= 0 && append_output(connection, length) == false)
+		{
+			// the output buffer is full; try again once it has been written
+			return;
+		}
+
+		connection->pending_head[command_class] = request->next;
+		if (connection->pending_head[command_class] == NULL)
+		{
+			connection->pending_tail[command_class] = NULL;
+		}
+		connection->pending_count -= 1;
+		connection->virtual_time = connection->class_time[command_class];
+		connection->class_time[command_class] += SCHEDULER_UNIT / connection->weights[command_class];
+		stats_record_queueing(connection->stats, command_class, stats_now() - request->queued);
+
+		if (length < 0)
+		{
+			stats_record_send(connection->stats, request->command, 0);
+			finish_request(connection, request, length);
+			continue;
+		}
+		stats_record_send(connection->stats, request->command, NXT_FRAME_HEADER_LENGTH + length);
+		directory_note_command(connection->directory, request->command);
+
+		slot = (connection->in_flight_head + connection->in_flight_count) % NXT_PIPELINE_DEPTH_MAX;
+		connection->in_flight[slot] = request;
+		connection->in_flight_key[slot] = length >= 3 ? connection->frame[NXT_FRAME_HEADER_LENGTH + 2] : 0;
+		connection->in_flight_sent[slot] = stats_now();
+		keepalive_note_send(connection->keepalive, connection->in_flight_sent[slot]);
+		timeout = connection->timeouts[request->command & 0xFF];
+		if (timeout == 0 && request->command == NXT_CMD_KEEPALIVE)
+		{
+			timeout = keepalive_timeout(connection->keepalive);
+		}
+		connection->in_flight_deadline[slot] = 0;
+		if (timeout != 0)
+		{
+			connection->in_flight_deadline[slot] = connection->in_flight_sent[slot] + timeout;
+		}
+		connection->in_flight_count += 1;
+	}
+}
+
+// Returns the class whose first waiting request is sent next: the one
+// submitted first, the most urgent one, or the one with the earliest virtual
+// time, ties going to the more urgent class. At least one request must be
+// waiting.
+static int select_class(nxtConnection* connection)
+{
+	int	selected;
+	int	index;
+
+	selected = -1;
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		if (connection->pending_head[index] == NULL)
+		{
+			index += 1;
+			continue;
+		}
+		if (selected < 0)
+		{
+			selected = index;
+		}
+		else if (connection->scheduling == NXT_SCHED_FIFO && connection->pending_head[index]->queued < connection->pending_head[selected]->queued)
+		{
+			selected = index;
+		}
+		else if (connection->scheduling == NXT_SCHED_WEIGHTED && connection->class_time[index] < connection->class_time[selected])
+		{
+			selected = index;
+		}
+
+		index += 1;
+	}
+
+	return selected;
+}
+
+// Blocks until the response to the oldest request in flight has been received,
+// or its deadline has passed, and completes it, unless another thread does so
+// first. Returns the request or NULL if nothing was in flight.
+static nxtRequest* complete_oldest(nxtConnection* connection)
+{
+	nxtRequest*	request;
+	int	result;
+
+	if (connection->in_flight_count == 0)
+	{
+		if (connection->pending_count > 0)
+		{
+			wait_for_orphans(connection);
+		}
+		return NULL;
+	}
+	request = connection->in_flight[connection->in_flight_head];
+
+	result = flush_output(connection, true);
+	while (result >= 0 && is_oldest(connection, request) == true && input_frame_length(connection) < 0)
+	{
+		result = fill_input(connection, true, connection->in_flight_deadline[connection->in_flight_head]);
+		if (result == NXT_LIBERR_TIMEOUT && is_oldest(connection, request) == true)
+		{
+			expire_in_flight(connection);
+			return request;
+		}
+	}
+	if (is_oldest(connection, request) == false)
+	{
+		return request;
+	}
+	if (result < 0)
+	{
+		fail_in_flight(connection, result);
+		return request;
+	}
+
+	complete_frame(connection);
+
+	return request;
+}
+
+static int is_oldest(nxtConnection* connection, nxtRequest* request)
+{
+	return connection->in_flight_count > 0 && connection->in_flight[connection->in_flight_head] == request;
+}
+
+// Removes the first complete packet from the input buffer and completes the
+// oldest request in flight with it. The NXT answers in order, so a response
+// that is not for the oldest request means that the responses to the requests
+// before the matching one were lost; those requests are completed with
+// NXT_LIBERR_RESPONSE_MISSING.
+static int complete_frame(nxtConnection* connection)
+{
+	nxtRequest*	request;
+	uint8_t*	body;
+	uint64_t	received;
+	int	length;
+	int	skip;
+	int	result;
+
+	received = stats_now();
+	length = input_frame_length(connection);
+	body = connection->input + NXT_FRAME_HEADER_LENGTH;
+
+	skip = 0;
+	if (length >= 2 && claim_orphan(connection, body[1]) == true)
+	{
+		// the reply to a request that has already timed out
+		skip = connection->in_flight_count + 1;
+	}
+	else if (length >= 2)
+	{
+		while (skip < connection->in_flight_count && is_reply_to(connection, skip, body, length) == false)
+		{
+			skip += 1;
+		}
+		if (skip == connection->in_flight_count)
+		{
+			// unsolicited response: report it against the oldest request
+			skip = 0;
+		}
+	}
+
+	if (skip > connection->in_flight_count)
+	{
+		connection->input_length -= NXT_FRAME_HEADER_LENGTH + length;
+		memmove(connection->input, body + length, connection->input_length);
+		return length;
+	}
+
+	while (skip > 0)
+	{
+		request = connection->in_flight[connection->in_flight_head];
+		connection->in_flight_head = (connection->in_flight_head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		connection->in_flight_count -= 1;
+		finish_request(connection, request, NXT_LIBERR_RESPONSE_MISSING);
+		skip -= 1;
+	}
+
+	if (connection->in_flight_count > 0)
+	{
+		request = connection->in_flight[connection->in_flight_head];
+		stats_record_phase(connection->stats, NXT_PHASE_WAIT, received - connection->in_flight_sent[connection->in_flight_head]);
+		keepalive_note_reply(connection->keepalive, received, received - connection->in_flight_sent[connection->in_flight_head]);
+		stats_record_response(connection->stats, request->command, length >= 3 ? body[2] : -1, NXT_FRAME_HEADER_LENGTH + length);
+		connection->in_flight_head = (connection->in_flight_head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		connection->in_flight_count -= 1;
+
+		if (request->command_template != NULL)
+		{
+			result = template_decode(request->command_template, body, length, request->template_responses);
+		}
+		else
+		{
+			result = codec_decode_response(body, length, request->command, request->responses, request->response_count);
+		}
+		stats_record_phase(connection->stats, NXT_PHASE_DECODE, stats_now() - received);
+		finish_request(connection, request, result);
+	}
+
+	connection->input_length -= NXT_FRAME_HEADER_LENGTH + length;
+	memmove(connection->input, body + length, connection->input_length);
+
+	return length;
+}
+
+// Returns true if the response in body can be the one to the request index
+// places after the oldest in flight. Responses are told apart by their command
+// byte and, for the sensor and motor readings, by the port they echo, so that
+// a lost response does not shift the later ones of a stream of readings of
+// different ports onto the wrong requests.
+static int is_reply_to(nxtConnection* connection, int index, const uint8_t* body, int length)
+{
+	int	slot;
+
+	slot = (connection->in_flight_head + index) % NXT_PIPELINE_DEPTH_MAX;
+	if (connection->in_flight[slot]->command != body[1])
+	{
+		return false;
+	}
+	if ((body[1] == NXT_CMD_GETINPUTVALUES || body[1] == NXT_CMD_GETOUTPUTSTATE) && length >= 4 && body[2] == NXT_STS_SUCCESS)
+	{
+		return body[3] == connection->in_flight_key[slot];
+	}
+
+	return true;
+}
+
+static void finish_request(nxtConnection* connection, nxtRequest* request, int result)
+{
+	request->result = result;
+	stats_record_result(connection->stats, request->command, result);
+	stats_record_latency(connection->stats, request->command, stats_now() - request->queued);
+
+	if (request->callback != NULL)
+	{
+		request->next = NULL;
+		if (connection->completed_tail == NULL)
+		{
+			connection->completed_head = request;
+		}
+		else
+		{
+			connection->completed_tail->next = request;
+		}
+		connection->completed_tail = request;
+	}
+}
+
+static void fail_in_flight(nxtConnection* connection, int result)
+{
+	nxtRequest*	request;
+
+	keepalive_note_failure(connection->keepalive);
+
+	while (connection->in_flight_count > 0)
+	{
+		request = connection->in_flight[connection->in_flight_head];
+		connection->in_flight_head = (connection->in_flight_head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		connection->in_flight_count -= 1;
+		finish_request(connection, request, result);
+	}
+}
+
+// The oldest request has not been answered in time. Its reply may only be
+// late, and the replies to the requests sent after it would come after it, so
+// they all fail. Until their replies have come, or for as long again as the
+// oldest one was given, nothing else is sent, so that a late reply cannot be
+// taken for the reply to a new request.
+static void expire_in_flight(nxtConnection* connection)
+{
+	nxtRequest*	request;
+	uint64_t	timeout;
+
+	timeout = connection->in_flight_deadline[connection->in_flight_head] - connection->in_flight_sent[connection->in_flight_head];
+	connection->quarantine = stats_now() + timeout;
+	connection->orphan_head = 0;
+	connection->orphan_count = 0;
+
+	keepalive_note_failure(connection->keepalive);
+
+	while (connection->in_flight_count > 0)
+	{
+		request = connection->in_flight[connection->in_flight_head];
+		connection->in_flight_head = (connection->in_flight_head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		connection->in_flight_count -= 1;
+		connection->orphans[connection->orphan_count] = request->command;
+		connection->orphan_count += 1;
+		finish_request(connection, request, NXT_LIBERR_TIMEOUT);
+	}
+}
+
+// Returns true if a reply for command is the late reply to a request that has
+// timed out. The NXT answers in order, so an orphan whose reply has not come
+// before a reply for another command was lost.
+static int claim_orphan(nxtConnection* connection, uint8_t command)
+{
+	int	slot;
+
+	while (is_quarantined(connection) == true)
+	{
+		slot = connection->orphan_head;
+		connection->orphan_head += 1;
+		connection->orphan_count -= 1;
+		if (connection->orphans[slot] == command)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int is_quarantined(nxtConnection* connection)
+{
+	if (connection->orphan_count > 0 && stats_now() >= connection->quarantine)
+	{
+		connection->orphan_count = 0;
+	}
+
+	return connection->orphan_count > 0;
+}
+
+// Reads and throws away the late replies that hold up the pending requests.
+static void wait_for_orphans(nxtConnection* connection)
+{
+	int	result;
+
+	while (is_quarantined(connection) == true)
+	{
+		result = fill_input(connection, true, connection->quarantine);
+		if (result < 0)
+		{
+			// a read error is for the pending requests to find out about
+			connection->orphan_count = 0;
+			return;
+		}
+		while (input_frame_length(connection) >= 0)
+		{
+			complete_frame(connection);
+		}
+	}
+}
+
+// Runs the callbacks of completed asynchronous requests. Called without the
+// connection locked so that callbacks may queue further requests.
+static void run_completions(nxtConnection* connection)
+{
+	nxtRequest*	request;
+	nxtRequest*	next;
+
+	pthread_mutex_lock(&connection->lock);
+	request = connection->completed_head;
+	connection->completed_head = NULL;
+	connection->completed_tail = NULL;
+	pthread_mutex_unlock(&connection->lock);
+
+	while (request != NULL)
+	{
+		next = request->next;
+		request->callback(connection, request, request->user_data);
+		request = next;
+	}
+}
+
+static int is_in_flight(nxtConnection* connection, nxtRequest* request)
+{
+	int	index;
+
+	index = 0;
+	while (index < connection->in_flight_count)
+	{
+		if (connection->in_flight[(connection->in_flight_head + index) % NXT_PIPELINE_DEPTH_MAX] == request)
+		{
+			return true;
+		}
+
+		index += 1;
+	}
+
+	return false;
+}
+
+static int is_pending(nxtConnection* connection, nxtRequest* request)
+{
+	nxtRequest*	pending;
+	int	index;
+
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		pending = connection->pending_head[index];
+		while (pending != NULL)
+		{
+			if (pending == request)
+			{
+				return true;
+			}
+
+			pending = pending->next;
+		}
+
+		index += 1;
+	}
+
+	return false;
+}
+
+// Copies the packet in the frame buffer to the end of the output buffer.
+// Returns false if there is not enough room.
+static int append_output(nxtConnection* connection, int length)
+{
+	length += NXT_FRAME_HEADER_LENGTH;
+
+	if (connection->output_offset > 0)
+	{
+		connection->output_length -= connection->output_offset;
+		memmove(connection->output, connection->output + connection->output_offset, connection->output_length);
+		connection->output_offset = 0;
+	}
+	if (connection->output_length + length > OUTPUT_BUFFER_SIZE)
+	{
+		return false;
+	}
+
+	memcpy(connection->output + connection->output_length, connection->frame, length);
+	connection->output_length += length;
+
+	return true;
+}
+
+// Writes as much of the output buffer as possible. If block is set, waits until
+// everything has been written or no progress has been made for the
+// connection's timeout. Returns the number of bytes written or a negative
+// nxtLibError.
+static int flush_output(nxtConnection* connection, bool block)
+{
+	ssize_t	written;
+	uint64_t	start;
+	uint64_t	stalled;
+	int	total;
+
+	total = 0;
+	stalled = 0;
+	while (connection->output_offset < connection->output_length)
+	{
+		start = stats_now();
+		written = connection->transport->write(connection->port, connection->output + connection->output_offset, connection->output_length - connection->output_offset);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				return NXT_LIBERR_IO;
+			}
+			if (block == false)
+			{
+				break;
+			}
+
+			if (stalled == 0 && connection->timeout != 0)
+			{
+				stalled = stats_now() + connection->timeout;
+			}
+			if (wait_port(connection, POLLOUT, stalled) < 0)
+			{
+				return NXT_LIBERR_TIMEOUT;
+			}
+			continue;
+		}
+
+		stats_record_phase(connection->stats, NXT_PHASE_WRITE, stats_now() - start);
+		connection->output_offset += written;
+		total += written;
+	}
+
+	if (connection->output_offset == connection->output_length)
+	{
+		connection->output_offset = 0;
+		connection->output_length = 0;
+	}
+
+	return total;
+}
+
+// Reads whatever is available into the input buffer, waiting for data first
+// if block is set, until deadline (0 for never). Only one thread waits on the
+// port; the others wait for it to read, and return 0 when it has, so that a
+// reply which completes their request wakes them up. Returns the number of
+// bytes read or a negative nxtLibError.
+static int fill_input(nxtConnection* connection, bool block, uint64_t deadline)
+{
+	ssize_t	received;
+	int	result;
+
+	if (connection->input_length == NXT_FRAME_BUFFER_SIZE)
+	{
+		return 0;
+	}
+
+	while (true)
+	{
+		// only the thread waiting on the port reads from it, since it would
+		// not be woken up for data that another thread had taken
+		if (connection->reading == true && block == false)
+		{
+			return 0;
+		}
+		if (connection->reading == true)
+		{
+			return wait_reader(connection, deadline);
+		}
+
+		received = connection->transport->read(connection->port, connection->input + connection->input_length, NXT_FRAME_BUFFER_SIZE - connection->input_length);
+		if (received > 0)
+		{
+			connection->input_length += received;
+			return received;
+		}
+		if (received == 0)
+		{
+			return NXT_LIBERR_IO;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			return NXT_LIBERR_IO;
+		}
+		if (block == false)
+		{
+			return 0;
+		}
+
+		connection->reading = true;
+		result = wait_port(connection, POLLIN, deadline);
+		connection->reading = false;
+		pthread_cond_broadcast(&connection->input_ready);
+		if (result < 0)
+		{
+			return NXT_LIBERR_TIMEOUT;
+		}
+	}
+}
+
+// Waits until the port is ready for events or deadline (0 for never) has
+// passed, with the connection unlocked so that other threads can send in the
+// meantime. Returns 0 or NXT_LIBERR_TIMEOUT.
+static int wait_port(nxtConnection* connection, short events, uint64_t deadline)
+{
+	struct pollfd	port_poll;
+	uint64_t	now;
+	int	timeout;
+
+	timeout = -1;
+	if (deadline != 0)
+	{
+		now = stats_now();
+		if (now >= deadline)
+		{
+			return NXT_LIBERR_TIMEOUT;
+		}
+		// rounded up, so that the deadline has passed when poll() gives up
+		timeout = (deadline - now + 999999) / 1000000;
+	}
+
+	port_poll.fd = connection->port;
+	port_poll.events = events;
+	pthread_mutex_unlock(&connection->lock);
+	poll(&port_poll, 1, timeout);
+	pthread_mutex_lock(&connection->lock);
+
+	return 0;
+}
+
+// Waits until the thread waiting on the port has stopped waiting, or deadline
+// (0 for never) has passed. Returns 0 or NXT_LIBERR_TIMEOUT.
+static int wait_reader(nxtConnection* connection, uint64_t deadline)
+{
+	struct timespec	timeout;
+
+	if (deadline == 0)
+	{
+		pthread_cond_wait(&connection->input_ready, &connection->lock);
+		return 0;
+	}
+	if (stats_now() >= deadline)
+	{
+		return NXT_LIBERR_TIMEOUT;
+	}
+
+	timeout.tv_sec = deadline / 1000000000;
+	timeout.tv_nsec = deadline % 1000000000;
+	pthread_cond_timedwait(&connection->input_ready, &connection->lock, &timeout);
+
+	return 0;
+}
+
+// Returns the body length of the first packet in the input buffer, or -1 if it
+// has not been completely received yet.
+static int input_frame_length(nxtConnection* connection)
+{
+	int	length;
+
+	if (connection->input_length < NXT_FRAME_HEADER_LENGTH)
+	{
+		return -1;
+	}
+
+	length = codec_read_length(connection->input);
+	if (connection->input_length < NXT_FRAME_HEADER_LENGTH + length)
+	{
+		return -1;
+	}
+
+	return length;
+}
+
+// Every system command is bulk traffic; direct commands are classed by what
+// they are used for.
+static nxtClass default_class(int command)
+{
+	if (command >= 0x80)
+	{
+		return NXT_CLASS_BULK;
+	}
+
+	switch (command)
+	{
+		case NXT_CMD_GETOUTPUTSTATE:
+		case NXT_CMD_GETINPUTVALUES:
+		case NXT_CMD_RESETINPUTSCALEDVALUE:
+		case NXT_CMD_GETBATTERYLEVEL:
+		case NXT_CMD_LSGETSTATUS:
+		case NXT_CMD_LSWRITE:
+		case NXT_CMD_LSREAD:
+		case NXT_CMD_GETCURRENTPROGRAMNAME:
+			return NXT_CLASS_SENSOR;
+		case NXT_CMD_MESSAGEWRITE:
+		case NXT_CMD_MESSAGEREAD:
+			return NXT_CLASS_MAILBOX;
+		default:
+			return NXT_CLASS_CONTROL;
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef _connection_h_
+#define _connection_h_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "stats.h"
+#include "directory.h"
+#include "keepalive.h"
+#include "transport.h"
+
+struct nxtConnection
+{
+	const transportBackend*	transport;
+	int	port;	// the transport's descriptor
+	pthread_mutex_t	lock;	// guards everything below; released while waiting on the port
+	pthread_cond_t	input_ready;	// broadcast when the thread waiting for input stops waiting
+	int	reading;	// a thread is waiting for input, and reads it for the others
+	uint8_t*	frame;	// packet being encoded, NXT_FRAME_BUFFER_SIZE bytes
+	uint8_t*	input;	// bytes received but not yet decoded, NXT_FRAME_BUFFER_SIZE bytes
+	int	input_length;
+	uint8_t*	output;	// encoded packets not yet written
+	int	output_offset;
+	int	output_length;
+	int	pipeline_depth;	// maximum number of requests awaiting a response
+	nxtRequest*	in_flight[NXT_PIPELINE_DEPTH_MAX];	// requests awaiting a response, oldest first
+	uint64_t	in_flight_sent[NXT_PIPELINE_DEPTH_MAX];	// when each of them was added to the output buffer
+	uint64_t	in_flight_deadline[NXT_PIPELINE_DEPTH_MAX];	// when each of them times out, or 0 for never
+	uint8_t	in_flight_key[NXT_PIPELINE_DEPTH_MAX];	// the first parameter byte of each of them
+	int	in_flight_head;
+	int	in_flight_count;
+	uint8_t	orphans[NXT_PIPELINE_DEPTH_MAX];	// commands of timed out requests whose replies may still arrive, oldest first
+	int	orphan_head;
+	int	orphan_count;
+	uint64_t	quarantine;	// when the orphans' replies are given up on
+	uint64_t	timeout;	// longest a write may stall, or 0 for ever
+	uint64_t	timeouts[256];	// longest wait for a reply by command byte, or 0 for ever
+	nxtRequest*	pending_head[NXT_CLASSES];	// requests waiting for room in the pipeline, by class
+	nxtRequest*	pending_tail[NXT_CLASSES];
+	int	pending_count;
+	uint64_t	last_queued;	// queued time of the newest request, kept increasing so that it orders them
+	nxtScheduling	scheduling;
+	uint8_t	classes[256];	// nxtClass by command byte
+	int	weights[NXT_CLASSES];
+	uint64_t	class_time[NXT_CLASSES];	// virtual time at which each class is next served
+	uint64_t	virtual_time;	// class_time of the class served last
+	nxtRequest*	completed_head;	// completed requests whose callbacks have not run yet
+	nxtRequest*	completed_tail;
+	statsCounters*	stats;
+	directoryCache*	directory;
+	keepAlive*	keepalive;
+};
+
+int connection_send_templates(nxtConnection* connection, const nxtTemplate* command_template, const void* const parameters[], int count);
+
+#endif
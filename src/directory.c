@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "commands.h"
+#include "connection.h"
+#include "directory.h"
+
+#define DIRECTORY_WINDOW_MAX 8	// FINDNEXT commands in flight once a listing is under way
+
+struct nxtDir
+{
+	nxtConnection*	connection;
+	uint8_t	handle;	// also the parameters of every FINDNEXT
+	nxtRequest	requests[DIRECTORY_WINDOW_MAX];
+	nxtFileInfo	replies[DIRECTORY_WINDOW_MAX];
+	int	head;
+	int	count;
+	int	window;
+	int	searching;	// the NXT still has the search handle open
+	int	first;	// the FINDFIRST reply has not been returned yet
+	int	result;
+	nxtDirEntry	entry;
+	nxtDirEntry*	listing;	// every entry so far, if the cache is to be filled
+	int	listing_count;
+	int	listing_capacity;
+	uint64_t	generation;
+};
+
+static void queue_findnext(nxtDir* dir);
+static void finish_search(nxtDir* dir);
+static void add_to_listing(nxtDir* dir, const nxtFileInfo* info);
+static void store_listing(nxtDir* dir);
+static int cache_lookup(directoryCache* cache, const char* filename, nxtDirEntry* entry);
+
+// PUBLIC FUNCTIONS
+
+// Starts listing the files matching pattern. Returns NULL only if memory cannot
+// be allocated; any other error is returned by nxtDirClose.
+nxtDir* nxtDirOpen(nxtConnection* connection, const char* pattern)
+{
+	nxtDir*	dir;
+	directoryCache*	cache;
+	nxtFileInfo	info;
+	int	result;
+
+	dir = calloc(1, sizeof(nxtDir));
+	if (dir == NULL)
+	{
+		return NULL;
+	}
+	dir->connection = connection;
+	dir->window = 1;
+
+	// only a listing of every file can fill the cache
+	cache = connection->directory;
+	if (atomic_load_explicit(&cache->enabled, memory_order_relaxed) == true && strcmp(pattern, "*.*") == 0)
+	{
+		dir->listing_capacity = 16;
+		dir->listing = malloc(sizeof(nxtDirEntry) * dir->listing_capacity);
+		dir->generation = atomic_load_explicit(&cache->generation, memory_order_relaxed);
+	}
+
+	result = nxtFindFirst(connection, pattern, &info);
+	if (result < 0)
+	{
+		dir->result = result;
+		return dir;
+	}
+	if (result < 1 || info.status != NXT_STS_SUCCESS)
+	{
+		if (result >= 1 && info.status == NXT_STS_FILE_NOT_FOUND)
+		{
+			store_listing(dir);
+		}
+		else
+		{
+			dir->result = NXT_LIBERR_STATUS;
+		}
+		return dir;
+	}
+
+	dir->handle = info.handle;
+	dir->searching = true;
+	dir->first = true;
+	memcpy(dir->entry.filename, info.filename, NXT_FILENAME_LENGTH);
+	dir->entry.size = info.size;
+	add_to_listing(dir, &info);
+
+	queue_findnext(dir);
+
+	return dir;
+}
+
+// Returns the next entry, which is valid until the next call, or NULL once
+// every entry has been returned or an error has occurred.
+const nxtDirEntry* nxtDirRead(nxtDir* dir)
+{
+	nxtFileInfo*	info;
+	int	result;
+
+	if (dir->first == true)
+	{
+		dir->first = false;
+		return &(dir->entry);
+	}
+	if (dir->count == 0)
+	{
+		return NULL;
+	}
+
+	result = nxtConnWait(dir->connection, &(dir->requests[dir->head]));
+	info = &(dir->replies[dir->head]);
+	dir->head = (dir->head + 1) % DIRECTORY_WINDOW_MAX;
+	dir->count -= 1;
+
+	if (result < 1 || info->status != NXT_STS_SUCCESS)
+	{
+		if (result >= 1 && info->status == NXT_STS_FILE_NOT_FOUND)
+		{
+			// the NXT closes the search handle itself at the end
+			dir->searching = false;
+			store_listing(dir);
+		}
+		else
+		{
+			dir->result = result < 0 ? result : NXT_LIBERR_STATUS;
+		}
+		finish_search(dir);
+		return NULL;
+	}
+
+	memcpy(dir->entry.filename, info->filename, NXT_FILENAME_LENGTH);
+	dir->entry.size = info->size;
+	add_to_listing(dir, info);
+
+	// every reply shows that the listing is longer, so more can be asked for at once
+	if (dir->window < DIRECTORY_WINDOW_MAX)
+	{
+		dir->window += 1;
+	}
+	queue_findnext(dir);
+
+	return &(dir->entry);
+}
+
+// Ends a listing, closing the search on the NXT if it was not read to the end.
+// Returns 0 or the negative nxtLibError that ended the listing.
+int nxtDirClose(nxtDir* dir)
+{
+	nxtHandleReply	close_reply;
+	int	result;
+
+	if (dir == NULL)
+	{
+		return 0;
+	}
+
+	finish_search(dir);
+	if (dir->searching == true)
+	{
+		nxtCloseHandle(dir->connection, dir->handle, &close_reply);
+	}
+
+	result = dir->result;
+	free(dir->listing);
+	free(dir);
+
+	return result;
+}
+
+// Looks up a single file, from the cache if it is enabled. Returns 1 if it
+// exists, 0 if it does not or a negative nxtLibError.
+int nxtDirLookup(nxtConnection* connection, const char* filename, nxtDirEntry* entry)
+{
+	nxtDir*	dir;
+	const nxtDirEntry*	found;
+	int	exists;
+	int	result;
+
+	if (strlen(filename) >= NXT_FILENAME_LENGTH)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	exists = cache_lookup(connection->directory, filename, entry);
+	if (exists >= 0)
+	{
+		return exists;
+	}
+
+	// with the cache enabled every file is listed, so that the next lookups
+	// cost nothing; without it only the one file is asked for
+	if (atomic_load_explicit(&connection->directory->enabled, memory_order_relaxed) == true)
+	{
+		dir = nxtDirOpen(connection, "*.*");
+	}
+	else
+	{
+		dir = nxtDirOpen(connection, filename);
+	}
+	if (dir == NULL)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+
+	exists = false;
+	while ((found = nxtDirRead(dir)) != NULL)
+	{
+		if (exists == false && strcasecmp(found->filename, filename) == 0)
+		{
+			*entry = *found;
+			exists = true;
+		}
+	}
+
+	result = nxtDirClose(dir);
+	if (result < 0)
+	{
+		return result;
+	}
+
+	return exists;
+}
+
+void nxtDirSetCache(nxtConnection* connection, int enabled)
+{
+	atomic_store_explicit(&connection->directory->enabled, enabled != false, memory_order_relaxed);
+	nxtDirInvalidate(connection);
+}
+
+// Forgets the cached listing, for when files have been changed other than
+// through this connection.
+void nxtDirInvalidate(nxtConnection* connection)
+{
+	atomic_fetch_add_explicit(&connection->directory->generation, 1, memory_order_relaxed);
+}
+
+// LIBRARY FUNCTIONS
+
+directoryCache* directory_create()
+{
+	directoryCache*	cache;
+
+	cache = calloc(1, sizeof(directoryCache));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return cache;
+}
+
+void directory_destroy(directoryCache* cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->entries);
+	free(cache);
+}
+
+// PRIVATE FUNCTIONS
+
+// Keeps window FINDNEXT commands in flight. The NXT closes the search handle
+// after the last entry, so those sent beyond the end fail harmlessly.
+static void queue_findnext(nxtDir* dir)
+{
+	int	slot;
+
+	while (dir->count < dir->window)
+	{
+		slot = (dir->head + dir->count) % DIRECTORY_WINDOW_MAX;
+		nxtConnQueueTemplate(dir->connection, &(dir->requests[slot]), commands_template(NXT_CMD_FINDNEXT), &(dir->handle), &(dir->replies[slot]), NULL, NULL);
+		dir->count += 1;
+	}
+}
+
+// Waits for every FINDNEXT still in flight, so that none of them refers to the
+// nxtDir once it has gone.
+static void finish_search(nxtDir* dir)
+{
+	nxtFileInfo*	info;
+	int	result;
+
+	while (dir->count > 0)
+	{
+		result = nxtConnWait(dir->connection, &(dir->requests[dir->head]));
+		info = &(dir->replies[dir->head]);
+		if (result >= 1 && info->status == NXT_STS_FILE_NOT_FOUND)
+		{
+			dir->searching = false;
+		}
+		dir->head = (dir->head + 1) % DIRECTORY_WINDOW_MAX;
+		dir->count -= 1;
+	}
+}
+
+static void add_to_listing(nxtDir* dir, const nxtFileInfo* info)
+{
+	nxtDirEntry*	listing;
+
+	if (dir->listing == NULL)
+	{
+		return;
+	}
+
+	if (dir->listing_count == dir->listing_capacity)
+	{
+		listing = realloc(dir->listing, sizeof(nxtDirEntry) * dir->listing_capacity * 2);
+		if (listing == NULL)
+		{
+			free(dir->listing);
+			dir->listing = NULL;
+			return;
+		}
+		dir->listing = listing;
+		dir->listing_capacity *= 2;
+	}
+
+	memcpy(dir->listing[dir->listing_count].filename, info->filename, NXT_FILENAME_LENGTH);
+	dir->listing[dir->listing_count].size = info->size;
+	dir->listing_count += 1;
+}
+
+// Hands a complete listing to the cache, unless the files may have changed
+// since it was started.
+static void store_listing(nxtDir* dir)
+{
+	directoryCache*	cache;
+	nxtDirEntry*	entries;
+
+	if (dir->listing == NULL)
+	{
+		return;
+	}
+
+	cache = dir->connection->directory;
+	pthread_mutex_lock(&cache->lock);
+	if (atomic_load_explicit(&cache->generation, memory_order_relaxed) == dir->generation)
+	{
+		entries = cache->entries;
+		cache->entries = dir->listing;
+		cache->entry_count = dir->listing_count;
+		cache->listed = dir->generation;
+		cache->valid = true;
+		dir->listing = entries;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Returns 1 or 0 if the cache knows whether filename exists, or -1 if it has
+// to be asked for.
+static int cache_lookup(directoryCache* cache, const char* filename, nxtDirEntry* entry)
+{
+	int	index;
+	int	exists;
+
+	if (atomic_load_explicit(&cache->enabled, memory_order_relaxed) == false)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->valid == false || cache->listed != atomic_load_explicit(&cache->generation, memory_order_relaxed))
+	{
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+
+	exists = false;
+	index = 0;
+	while (index < cache->entry_count)
+	{
+		if (strcasecmp(cache->entries[index].filename, filename) == 0)
+		{
+			*entry = cache->entries[index];
+			exists = true;
+			break;
+		}
+		index += 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return exists;
+}
@@ -0,0 +1,47 @@
+#ifndef _directory_h_
+#define _directory_h_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+
+// The complete listing of the files on an NXT as last seen by this connection.
+// It is valid only while generation still has the value it had when the
+// listing was started; every command that may change the files increments
+// generation without taking a lock, so that the connection can do so while it
+// holds its own.
+typedef struct
+{
+	pthread_mutex_t	lock;	// protects everything except enabled and generation
+	atomic_int	enabled;
+	atomic_uint_fast64_t	generation;
+	uint64_t	listed;	// generation when entries was listed
+	int	valid;
+	nxtDirEntry*	entries;
+	int	entry_count;
+} directoryCache;
+
+directoryCache* directory_create();
+void directory_destroy(directoryCache* cache);
+
+static inline void directory_note_command(directoryCache* cache, nxtCommand command)
+{
+	switch (command)
+	{
+		case NXT_CMD_OPENWRITE:
+		case NXT_CMD_OPENWRITELINEAR:
+		case NXT_CMD_OPENWRITEDATA:
+		case NXT_CMD_OPENAPPENDDATA:
+		case NXT_CMD_WRITE:
+		case NXT_CMD_CLOSE:
+		case NXT_CMD_DELETE:
+			atomic_fetch_add_explicit(&cache->generation, 1, memory_order_relaxed);
+			break;
+		default:
+			break;
+	}
+}
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "connection.h"
+#include "keepalive.h"
+#include "stats.h"
+
+#define KEEPALIVE_NEVER_SLEEPS 60000000000ULL	// idle time allowed if the NXT never sleeps, in nanoseconds
+#define KEEPALIVE_RETRY 1000000000ULL	// wait after a failed KEEPALIVE, in nanoseconds
+
+static void* run_keepalive(void* argument);
+static void wait_until(keepAlive* keeper, uint64_t deadline);
+
+// PUBLIC FUNCTIONS
+
+// Keeps the NXT awake by sending NXT_CMD_KEEPALIVE from a thread of its own
+// whenever nothing has been sent for fraction of its sleep timeout. Returns 0
+// or a negative nxtLibError.
+int nxtConnStartKeepAlive(nxtConnection* connection, double fraction)
+{
+	keepAlive*	keeper;
+	int	result;
+
+	if (fraction <= 0 || fraction > 1)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	keeper = connection->keepalive;
+	pthread_mutex_lock(&keeper->lock);
+	keeper->fraction = fraction;
+	result = 0;
+	if (keeper->running == false)
+	{
+		keeper->running = true;
+		if (pthread_create(&keeper->thread, NULL, run_keepalive, connection) != 0)
+		{
+			keeper->running = false;
+			result = NXT_LIBERR_GENERAL;
+		}
+	}
+	pthread_mutex_unlock(&keeper->lock);
+
+	return result;
+}
+
+// Stops sending keep-alives, waiting for one in flight to be answered or to
+// time out, which it does even if no timeout has been set for it.
+void nxtConnStopKeepAlive(nxtConnection* connection)
+{
+	keepAlive*	keeper;
+	int	running;
+
+	keeper = connection->keepalive;
+	pthread_mutex_lock(&keeper->lock);
+	running = keeper->running;
+	keeper->running = false;
+	pthread_cond_signal(&keeper->wake);
+	pthread_mutex_unlock(&keeper->lock);
+
+	if (running == true)
+	{
+		pthread_join(keeper->thread, NULL);
+	}
+}
+
+// Describes the link from what the connection has already seen, without
+// sending anything.
+void nxtConnGetLiveness(nxtConnection* connection, nxtLiveness* liveness)
+{
+	keepAlive*	keeper;
+	uint64_t	now;
+	uint64_t	last_sent;
+	uint64_t	last_received;
+
+	keeper = connection->keepalive;
+	now = stats_now();
+	last_sent = atomic_load_explicit(&keeper->last_sent, memory_order_relaxed);
+	last_received = atomic_load_explicit(&keeper->last_received, memory_order_relaxed);
+
+	liveness->alive = atomic_load_explicit(&keeper->alive, memory_order_relaxed);
+	liveness->idle = last_sent != 0 && now > last_sent ? now - last_sent : 0;
+	liveness->silence = last_received != 0 && now > last_received ? now - last_received : 0;
+	liveness->rtt = atomic_load_explicit(&keeper->rtt, memory_order_relaxed);
+	liveness->sleep_time = atomic_load_explicit(&keeper->sleep_time, memory_order_relaxed);
+}
+
+// LIBRARY FUNCTIONS
+
+keepAlive* keepalive_create()
+{
+	keepAlive*	keeper;
+	pthread_condattr_t	attributes;
+
+	keeper = calloc(1, sizeof(keepAlive));
+	if (keeper == NULL)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_init(&keeper->lock, NULL);
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&keeper->wake, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	return keeper;
+}
+
+// The thread must have been stopped already.
+void keepalive_destroy(keepAlive* keeper)
+{
+	if (keeper == NULL)
+	{
+		return;
+	}
+
+	pthread_cond_destroy(&keeper->wake);
+	pthread_mutex_destroy(&keeper->lock);
+	free(keeper);
+}
+
+// PRIVATE FUNCTIONS
+
+// Any packet resets the NXT's sleep timer, so a keep-alive is only due once
+// the link has been idle for long enough; while other commands are flowing
+// none is sent at all. The first one is sent at once, to learn the timeout.
+static void* run_keepalive(void* argument)
+{
+	nxtConnection*	connection;
+	keepAlive*	keeper;
+	nxtKeepAliveReply	reply;
+	uint64_t	idle_limit;
+	uint64_t	retry_at;
+	uint64_t	due;
+	int	learned;
+	int	result;
+
+	connection = argument;
+	keeper = connection->keepalive;
+	learned = false;
+	retry_at = 0;
+
+	pthread_mutex_lock(&keeper->lock);
+	while (keeper->running == true)
+	{
+		idle_limit = 0;
+		if (learned == true)
+		{
+			idle_limit = atomic_load_explicit(&keeper->sleep_time, memory_order_relaxed) * 1000000ULL * keeper->fraction;
+			if (idle_limit == 0)
+			{
+				idle_limit = KEEPALIVE_NEVER_SLEEPS;
+			}
+		}
+		due = atomic_load_explicit(&keeper->last_sent, memory_order_relaxed) + idle_limit;
+		if (due < retry_at)
+		{
+			due = retry_at;
+		}
+		if (stats_now() < due)
+		{
+			wait_until(keeper, due);
+			continue;
+		}
+
+		pthread_mutex_unlock(&keeper->lock);
+		result = nxtKeepAlive(connection, &reply);
+		pthread_mutex_lock(&keeper->lock);
+
+		if (result >= 2 && reply.status == NXT_STS_SUCCESS)
+		{
+			atomic_store_explicit(&keeper->sleep_time, reply.sleep_time, memory_order_relaxed);
+			learned = true;
+			retry_at = 0;
+		}
+		else
+		{
+			keepalive_note_failure(keeper);
+			retry_at = stats_now() + KEEPALIVE_RETRY;
+		}
+	}
+	pthread_mutex_unlock(&keeper->lock);
+
+	return NULL;
+}
+
+// Called with the lock held.
+static void wait_until(keepAlive* keeper, uint64_t deadline)
+{
+	struct timespec	timeout;
+
+	timeout.tv_sec = deadline / 1000000000;
+	timeout.tv_nsec = deadline % 1000000000;
+	pthread_cond_timedwait(&keeper->wake, &keeper->lock, &timeout);
+}
@@ -0,0 +1,72 @@
+#ifndef _keepalive_h_
+#define _keepalive_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+
+#define KEEPALIVE_TIMEOUT 1000000000ULL	// shortest wait for a keep-alive's reply, in nanoseconds
+#define KEEPALIVE_TIMEOUT_RTTS 8	// round trips a keep-alive's reply may take on a slow link
+
+// What the link has been doing, as seen by this connection, and the thread
+// that keeps it awake. The connection records traffic without taking a lock,
+// so that it can do so while it holds its own.
+typedef struct
+{
+	atomic_uint_fast64_t	last_sent;	// when a packet was last written
+	atomic_uint_fast64_t	last_received;	// when a reply was last read
+	atomic_uint_fast64_t	rtt;	// smoothed round-trip time in nanoseconds
+	atomic_int	alive;
+	atomic_uint	sleep_time;	// the NXT's sleep timeout in milliseconds
+	pthread_mutex_t	lock;	// protects everything below
+	pthread_cond_t	wake;
+	pthread_t	thread;
+	int	running;
+	double	fraction;	// of the sleep timeout the link may be idle for
+} keepAlive;
+
+keepAlive* keepalive_create();
+void keepalive_destroy(keepAlive* keeper);
+
+static inline void keepalive_note_send(keepAlive* keeper, uint64_t now)
+{
+	atomic_store_explicit(&keeper->last_sent, now, memory_order_relaxed);
+}
+
+// Smooths the round-trip time like TCP does, by an eighth of each new sample.
+static inline void keepalive_note_reply(keepAlive* keeper, uint64_t now, uint64_t rtt)
+{
+	uint64_t	smoothed;
+
+	smoothed = atomic_load_explicit(&keeper->rtt, memory_order_relaxed);
+	smoothed = smoothed == 0 ? rtt : smoothed - smoothed / 8 + rtt / 8;
+	atomic_store_explicit(&keeper->rtt, smoothed, memory_order_relaxed);
+	atomic_store_explicit(&keeper->last_received, now, memory_order_relaxed);
+	atomic_store_explicit(&keeper->alive, true, memory_order_relaxed);
+}
+
+// How long the reply to a keep-alive may take if no timeout has been set for
+// NXT_CMD_KEEPALIVE. It is bounded even so, since a keep-alive is how a dead
+// link is found out.
+static inline uint64_t keepalive_timeout(keepAlive* keeper)
+{
+	uint64_t	rtt;
+
+	rtt = atomic_load_explicit(&keeper->rtt, memory_order_relaxed);
+	if (rtt * KEEPALIVE_TIMEOUT_RTTS > KEEPALIVE_TIMEOUT)
+	{
+		return rtt * KEEPALIVE_TIMEOUT_RTTS;
+	}
+
+	return KEEPALIVE_TIMEOUT;
+}
+
+static inline void keepalive_note_failure(keepAlive* keeper)
+{
+	atomic_store_explicit(&keeper->alive, false, memory_order_relaxed);
+}
+
+#endif
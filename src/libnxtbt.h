@@ -16,6 +16,25 @@
 #define NXT_SLONG_MIN -2147483648
 #define NXT_SLONG_MAX 2147483647
 
+#define NXT_PIPELINE_DEPTH_DEFAULT 4
+#define NXT_PIPELINE_DEPTH_MAX 32
+#define NXT_POLLER_STREAMS_MAX 16
+#define NXT_OUTPUT_PORTS 3
+#define NXT_TRIGGERS_MAX 32	// triggers of one subscription, one bit each in the fired mask
+
+#define NXT_STATS_COMMANDS 33	// number of commands in nxtCommand
+#define NXT_STATS_LIBERRORS 64	// nxtLibError values are counted at index -error
+#define NXT_HISTOGRAM_BUCKETS 256
+
+#define NXT_TEMPLATE_FIELDS_MAX 16
+
+#define NXT_FILENAME_LENGTH 20	// 19 characters and a terminating zero
+#define NXT_BRICK_NAME_LENGTH 15	// 14 characters and a terminating zero
+#define NXT_MESSAGE_LENGTH 59	// 58 characters and a terminating zero
+#define NXT_LS_DATA_LENGTH 16
+#define NXT_READ_DATA_MAX 58	// largest READ that fits in a 64 byte Bluetooth packet
+#define NXT_WRITE_DATA_MAX 61	// largest WRITE that fits in a 64 byte Bluetooth packet
+
 typedef enum
 {
 	// Direct commands
@@ -70,6 +89,7 @@ typedef enum
 	NXT_TYPE_BYTES,
 	NXT_TYPE_STRING,
 	NXT_TYPE_FILENAME,
+	NXT_TYPE_BUFFER,
 } nxtType;
 
 typedef union
@@ -144,6 +164,12 @@ typedef enum
 typedef enum
 {
 	NXT_LIBERR_GENERAL = -1,	// unspecified error
+	NXT_LIBERR_NOT_CONNECTED = -2,	// no device is open
+	NXT_LIBERR_IO = -3,	// reading from or writing to the device failed
+	NXT_LIBERR_STATUS = -4,	// the NXT returned an error status
+	NXT_LIBERR_FILE = -5,	// a local file could not be read or written
+	NXT_LIBERR_TOO_LARGE = -6,	// the file does not fit in the buffer supplied
+	NXT_LIBERR_TIMEOUT = -7,	// no response arrived before the deadline
 
 	NXT_LIBERR_PARAMETER_CANNOT_ADD = -16,	// failed to add parameter to buffer
 
@@ -152,11 +178,515 @@ typedef enum
 	NXT_LIBERR_RESPONSE_COMMAND_MISMATCH = -34,	// second response byte does not match command byte
 	NXT_LIBERR_RESPONSE_TYPE_MISMATCH = -35,	// response does not contain data that can be interpreted in the requested type
 	NXT_LIBERR_RESPONSE_CANNOT_ADD = -36,	// failed to add response value to response array
+	NXT_LIBERR_RESPONSE_MISSING = -37,	// no response was received for a pipelined command
 } nxtLibError;
 
+typedef struct nxtConnection nxtConnection;
+
+// Classes of traffic that a connection's scheduler orders pending requests by,
+// most urgent first.
+typedef enum
+{
+	NXT_CLASS_CONTROL,	// motors, sound and program control
+	NXT_CLASS_SENSOR,	// sensor, motor and battery readings
+	NXT_CLASS_MAILBOX,	// mailbox messages
+	NXT_CLASS_BULK,	// file transfers and other system commands
+	NXT_CLASSES,
+} nxtClass;
+
+typedef enum
+{
+	NXT_SCHED_FIFO,	// in the order they were submitted
+	NXT_SCHED_PRIORITY,	// the most urgent class first, always
+	NXT_SCHED_WEIGHTED,	// each class in proportion to its weight
+} nxtScheduling;
+
+typedef struct nxtRequest nxtRequest;
+
+typedef struct nxtTemplate nxtTemplate;
+
+typedef void (*nxtCompletion)(nxtConnection* connection, nxtRequest* request, void* user_data);
+
+struct nxtRequest
+{
+	nxtCommand	command;
+	nxtParameter*	parameters;
+	nxtResponse*	responses;
+	int	parameter_count;
+	int	response_count;
+	int	result;	// set when the request completes, as returned by nxtDoCommand
+	nxtCompletion	callback;	// set by nxtConnQueue
+	void*	user_data;	// set by nxtConnQueue
+	const nxtTemplate*	command_template;	// set by nxtConnQueueTemplate
+	const void*	template_parameters;	// set by nxtConnQueueTemplate
+	void*	template_responses;	// set by nxtConnQueueTemplate
+	nxtRequest*	next;	// used internally by libnxtbt
+	uint64_t	queued;	// used internally by libnxtbt
+};
+
+// One field of a command template: a value of the given type stored at offset
+// bytes into the caller's structure (use offsetof). Values are stored exactly as
+// they appear in the packet, so BOOLEAN, UBYTE and SBYTE fields are 1 byte wide,
+// UWORD and SWORD fields 2 bytes, ULONG and SLONG fields 4 bytes, FILENAME
+// fields 20 bytes and BYTES and STRING fields length bytes.
+typedef struct
+{
+	nxtType	type;
+	int	length;	// NXT_TYPE_BYTES and NXT_TYPE_STRING only
+	int	offset;
+} nxtField;
+
+// Parameters of NXT_CMD_SETOUTPUTSTATE and replies of the typed command
+// functions. These have exactly the layout of the corresponding packets.
+typedef struct __attribute__((packed))
+{
+	uint8_t	port;
+	int8_t	power;
+	uint8_t	mode;
+	uint8_t	regulation_mode;
+	int8_t	turn_ratio;
+	uint8_t	run_state;
+	uint32_t	tacho_limit;
+} nxtOutputState;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+} nxtStatusReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	port;
+	int8_t	power;
+	uint8_t	mode;
+	uint8_t	regulation_mode;
+	int8_t	turn_ratio;
+	uint8_t	run_state;
+	uint32_t	tacho_limit;
+	int32_t	tacho_count;
+	int32_t	block_tacho_count;
+	int32_t	rotation_count;
+} nxtOutputStateReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	port;
+	uint8_t	valid;
+	uint8_t	calibrated;
+	uint8_t	sensor_type;
+	uint8_t	sensor_mode;
+	uint16_t	raw_value;
+	uint16_t	normalized_value;
+	int16_t	scaled_value;
+	int16_t	calibrated_value;
+} nxtInputValues;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint16_t	millivolts;
+} nxtBatteryLevel;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint32_t	sleep_time;	// milliseconds
+} nxtKeepAliveReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	bytes_ready;
+} nxtLSStatus;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	bytes_read;
+	uint8_t	data[NXT_LS_DATA_LENGTH];
+} nxtLSData;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	char	filename[NXT_FILENAME_LENGTH];
+} nxtFilenameReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	local_inbox;
+	uint8_t	length;	// including the terminating zero
+	char	message[NXT_MESSAGE_LENGTH];
+} nxtMessage;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+} nxtHandleReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+	uint32_t	size;
+} nxtOpenReadReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+	uint16_t	length;
+	uint8_t	data[NXT_READ_DATA_MAX];
+} nxtReadData;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+	uint16_t	length;
+} nxtWriteReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+	char	filename[NXT_FILENAME_LENGTH];
+	uint32_t	size;
+} nxtFileInfo;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	protocol_minor;
+	uint8_t	protocol_major;
+	uint8_t	firmware_minor;
+	uint8_t	firmware_major;
+} nxtFirmwareVersion;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	uint8_t	handle;
+	uint32_t	available;
+} nxtOpenAppendReply;
+
+typedef struct __attribute__((packed))
+{
+	uint8_t	status;
+	char	name[NXT_BRICK_NAME_LENGTH];
+	uint8_t	address[7];
+	uint32_t	signal_strength;
+	uint32_t	free_flash;
+} nxtDeviceInfo;
+
+typedef void (*nxtProgress)(uint32_t done, uint32_t total, double bytes_per_second, void* user_data);
+
+// Options and results of a file transfer. Zero initialise it to use the
+// defaults.
+typedef struct
+{
+	int	chunk_size;	// largest READ or WRITE, or 0 for the Bluetooth maximum
+	nxtProgress	progress;	// called after every chunk, or NULL
+	void*	user_data;	// passed to progress
+	uint32_t	size;	// set to the size of the file
+	uint32_t	bytes;	// set to the number of bytes transferred
+	uint64_t	elapsed;	// set to the duration of the transfer in nanoseconds
+	double	bytes_per_second;	// set to the achieved throughput
+	uint8_t	status;	// set to the NXT status if NXT_LIBERR_STATUS is returned
+} nxtTransfer;
+
+// Receives each chunk of a download in order. Returns 0 to continue or a
+// negative nxtLibError to abandon the download.
+typedef int (*nxtSink)(const uint8_t* data, int length, void* user_data);
+
+// Lists the files on the NXT matching a pattern.
+typedef struct nxtDir nxtDir;
+
+typedef struct
+{
+	char	filename[NXT_FILENAME_LENGTH];
+	uint32_t	size;
+} nxtDirEntry;
+
+// Options and results of nxtSyncDirectory. Zero initialise it to use the
+// defaults.
+typedef struct
+{
+	const char*	pattern;	// files that are synchronised, or NULL for all of them
+	int	keep_stale;	// leave files on the NXT that are not in the directory
+	int	dry_run;	// only count what would be done
+	nxtTransfer	transfer;	// options for each upload, and the last upload's results
+	int	uploaded;	// set to the number of files uploaded
+	int	unchanged;	// set to the number of files already on the NXT
+	int	deleted;	// set to the number of files deleted from the NXT
+	int	skipped;	// set to the number of local files whose names are too long
+	uint32_t	bytes;	// set to the number of bytes uploaded
+	char	failed[NXT_FILENAME_LENGTH];	// set to the file being synchronised if an error occurred
+} nxtSync;
+
+// Reads whatever has been appended to files on the NXT since it last looked.
+typedef struct nxtTail nxtTail;
+
+// Receives the data appended to filename, which starts offset bytes into the
+// file. Returns 0 to accept it or a negative nxtLibError to have it passed
+// again on the next poll.
+typedef int (*nxtTailCallback)(const char* filename, const uint8_t* data, uint32_t length, uint32_t offset, void* user_data);
+
+// A reply collected by an nxtPoller.
+typedef struct
+{
+	uint64_t	timestamp;	// CLOCK_MONOTONIC nanoseconds when the reply was decoded
+	uint64_t	latency;	// nanoseconds from when the request was due until then
+	int	result;	// number of values received or a negative nxtLibError
+	union
+	{
+		nxtInputValues	input;	// NXT_CMD_GETINPUTVALUES streams
+		nxtOutputStateReply	output;	// NXT_CMD_GETOUTPUTSTATE streams
+	} value;
+} nxtSample;
+
+typedef struct
+{
+	uint64_t	samples;	// replies stored in the ring
+	uint64_t	overruns;	// replies dropped because the ring was full
+	uint64_t	missed;	// periods skipped because the previous request was still in flight
+	uint64_t	errors;	// requests that failed
+	uint64_t	notifications;	// subscription callbacks called
+	uint32_t	pending;	// samples waiting to be read
+} nxtStreamStats;
+
+// Sends periodic requests over a connection and keeps their replies.
+typedef struct nxtPoller nxtPoller;
+
+// The values in an nxtSample that a trigger can watch.
+typedef enum
+{
+	NXT_FIELD_RAW,	// NXT_CMD_GETINPUTVALUES streams
+	NXT_FIELD_NORMALIZED,
+	NXT_FIELD_SCALED,
+	NXT_FIELD_CALIBRATED,
+	NXT_FIELD_POWER,	// NXT_CMD_GETOUTPUTSTATE streams
+	NXT_FIELD_RUN_STATE,
+	NXT_FIELD_TACHO_COUNT,
+	NXT_FIELD_BLOCK_TACHO_COUNT,
+	NXT_FIELD_ROTATION_COUNT
+} nxtSampleField;
+
+typedef enum
+{
+	NXT_EDGE_NONE = 0,
+	NXT_EDGE_RISING = 1,	// from below the threshold to at or above it
+	NXT_EDGE_FALLING = 2,	// from at or above the threshold to below it
+	NXT_EDGE_BOTH = 3
+} nxtEdge;
+
+// A change in one field of a stream that is worth a notification.
+typedef struct
+{
+	nxtSampleField	field;
+	int32_t	deadband;	// fires when the field moves further than this from where it last fired, or -1 for never
+	int32_t	threshold;	// level at which edges are detected
+	nxtEdge	edges;	// fires when the field crosses threshold in these directions
+} nxtTrigger;
+
+// Called with a sample in which at least one trigger of a subscription fired,
+// as a bit mask of their indices, or with the first valid sample and 0.
+typedef void (*nxtSubscriptionCallback)(int stream, const nxtSample* sample, uint32_t fired, void* user_data);
+
+// Holds back output states and sends only those that change what the NXT is
+// doing.
+typedef struct nxtOutputCache nxtOutputCache;
+
+typedef struct
+{
+	uint64_t	updates;	// port states passed to nxtOutputCacheSet
+	uint64_t	merged;	// replaced by a later state before they were sent
+	uint64_t	unchanged;	// not sent because the NXT already had them
+	uint64_t	frames;	// NXT_CMD_SETOUTPUTSTATE packets sent
+} nxtOutputCacheStats;
+
+// Sends output states at a fixed rate from a thread of its own.
+typedef struct nxtMotorStream nxtMotorStream;
+
+// The output states sent at one tick of an nxtMotorStream.
+typedef struct
+{
+	nxtOutputState	states[NXT_OUTPUT_PORTS];
+	int	count;	// states to send, from 1 to NXT_OUTPUT_PORTS
+} nxtSetpoint;
+
+// Fills in the setpoint for a tick, due at deadline (CLOCK_MONOTONIC
+// nanoseconds). Returns true to send it or false to send nothing.
+typedef int (*nxtSetpointCallback)(uint64_t tick, uint64_t deadline, nxtSetpoint* setpoint, void* user_data);
+
+// The state of the link as seen by a connection.
+typedef struct
+{
+	int	alive;	// the last exchange succeeded
+	uint64_t	idle;	// nanoseconds since a packet was last written
+	uint64_t	silence;	// nanoseconds since a reply was last read
+	uint64_t	rtt;	// smoothed round-trip time in nanoseconds
+	uint32_t	sleep_time;	// the NXT's sleep timeout in milliseconds, 0 if unknown or never
+} nxtLiveness;
+
+// Log-linear histogram of durations in nanoseconds: values below 8 have a
+// bucket each, and every power of two above that is split into 8 buckets.
+typedef struct
+{
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	buckets[NXT_HISTOGRAM_BUCKETS];
+} nxtHistogram;
+
+typedef struct
+{
+	uint64_t	ticks;	// deadlines acted on
+	uint64_t	sent;	// setpoints written
+	uint64_t	underruns;	// ticks without a setpoint
+	uint64_t	missed;	// deadlines that had passed before the previous tick was done
+	uint64_t	errors;	// setpoints that could not be written
+	uint32_t	queued;	// setpoints waiting in the queue
+	nxtHistogram	lateness;	// from each deadline until its setpoint was written
+} nxtMotorStreamStats;
+
+typedef enum
+{
+	NXT_PHASE_ENCODE,	// encoding the packet
+	NXT_PHASE_WRITE,	// each write() to the device
+	NXT_PHASE_WAIT,	// from the packet being queued for writing until its response has been received
+	NXT_PHASE_DECODE,	// decoding the response
+	NXT_PHASES,
+} nxtPhase;
+
+typedef struct
+{
+	nxtCommand	command;
+	uint64_t	calls;
+	uint64_t	bytes_out;
+	uint64_t	bytes_in;
+	uint64_t	errors[NXT_STATS_LIBERRORS];	// indexed by -nxtLibError
+	uint64_t	statuses[256];	// indexed by the nxtStatus returned by the NXT
+	nxtHistogram	latency;	// from submission to completion
+} nxtCommandStats;
+
+typedef struct
+{
+	nxtCommandStats	commands[NXT_STATS_COMMANDS];
+	nxtHistogram	phases[NXT_PHASES];
+	nxtHistogram	queueing[NXT_CLASSES];	// from submission until written, by class
+} nxtStats;
+
 void nxtOpen(const char* device);
 void nxtClose();
 int nxtDoCommand(nxtCommand command, nxtParameter parameters[], nxtResponse responses[], int parameter_count, int response_count);
+int nxtSendCommand(nxtCommand command, nxtParameter parameters[], int parameter_count);
+int nxtSetTimeout(uint64_t timeout);
+nxtConnection* nxtConnect(const char* device);
+void nxtDisconnect(nxtConnection* connection);
+int nxtConnDoCommand(nxtConnection* connection, nxtCommand command, nxtParameter parameters[], nxtResponse responses[], int parameter_count, int response_count);
+int nxtConnSendCommand(nxtConnection* connection, nxtCommand command, nxtParameter parameters[], int parameter_count);
+int nxtConnSendCommands(nxtConnection* connection, nxtRequest requests[], int request_count);
+int nxtConnSetPipelineDepth(nxtConnection* connection, int depth);
+void nxtConnSetTimeout(nxtConnection* connection, uint64_t timeout);
+void nxtConnSetCommandTimeout(nxtConnection* connection, nxtCommand command, uint64_t timeout);
+int nxtConnSetScheduling(nxtConnection* connection, nxtScheduling scheduling, const int weights[]);
+int nxtConnSetCommandClass(nxtConnection* connection, nxtCommand command, nxtClass command_class);
+int nxtConnSubmit(nxtConnection* connection, nxtRequest* request);
+nxtRequest* nxtConnComplete(nxtConnection* connection);
+int nxtConnWait(nxtConnection* connection, nxtRequest* request);
+int nxtConnDoCommands(nxtConnection* connection, nxtRequest requests[], int request_count);
+int nxtConnGetFd(nxtConnection* connection);
+short nxtConnPollEvents(nxtConnection* connection);
+uint64_t nxtConnGetDeadline(nxtConnection* connection);
+int nxtConnQueue(nxtConnection* connection, nxtRequest* request, nxtCompletion callback, void* user_data);
+int nxtConnProcess(nxtConnection* connection);
+nxtTemplate* nxtTemplateCreate(nxtCommand command, const nxtField parameters[], int parameter_count, const nxtField responses[], int response_count);
+void nxtTemplateDestroy(nxtTemplate* command_template);
+int nxtConnDoTemplate(nxtConnection* connection, const nxtTemplate* command_template, const void* parameters, void* responses);
+int nxtConnSendTemplate(nxtConnection* connection, const nxtTemplate* command_template, const void* parameters);
+int nxtConnQueueTemplate(nxtConnection* connection, nxtRequest* request, const nxtTemplate* command_template, const void* parameters, void* responses, nxtCompletion callback, void* user_data);
+int nxtConnStartKeepAlive(nxtConnection* connection, double fraction);
+void nxtConnStopKeepAlive(nxtConnection* connection);
+void nxtConnGetLiveness(nxtConnection* connection, nxtLiveness* liveness);
+int nxtStartProgram(nxtConnection* connection, const char* filename, nxtStatusReply* reply);
+int nxtStopProgram(nxtConnection* connection, nxtStatusReply* reply);
+int nxtPlaySoundFile(nxtConnection* connection, int loop, const char* filename, nxtStatusReply* reply);
+int nxtPlayTone(nxtConnection* connection, uint16_t frequency, uint16_t duration, nxtStatusReply* reply);
+int nxtSetOutputState(nxtConnection* connection, const nxtOutputState* state, nxtStatusReply* reply);
+int nxtSetInputMode(nxtConnection* connection, uint8_t port, uint8_t sensor_type, uint8_t sensor_mode, nxtStatusReply* reply);
+int nxtGetOutputState(nxtConnection* connection, uint8_t port, nxtOutputStateReply* reply);
+int nxtGetInputValues(nxtConnection* connection, uint8_t port, nxtInputValues* reply);
+int nxtResetInputScaledValue(nxtConnection* connection, uint8_t port, nxtStatusReply* reply);
+int nxtMessageWrite(nxtConnection* connection, uint8_t inbox, const char* message, nxtStatusReply* reply);
+int nxtResetMotorPosition(nxtConnection* connection, uint8_t port, int relative, nxtStatusReply* reply);
+int nxtGetBatteryLevel(nxtConnection* connection, nxtBatteryLevel* reply);
+int nxtStopSoundPlayback(nxtConnection* connection, nxtStatusReply* reply);
+int nxtKeepAlive(nxtConnection* connection, nxtKeepAliveReply* reply);
+int nxtLSGetStatus(nxtConnection* connection, uint8_t port, nxtLSStatus* reply);
+int nxtLSWrite(nxtConnection* connection, uint8_t port, const uint8_t* data, int tx_length, int rx_length, nxtStatusReply* reply);
+int nxtLSRead(nxtConnection* connection, uint8_t port, nxtLSData* reply);
+int nxtGetCurrentProgramName(nxtConnection* connection, nxtFilenameReply* reply);
+int nxtMessageRead(nxtConnection* connection, uint8_t remote_inbox, uint8_t local_inbox, int remove, nxtMessage* reply);
+int nxtOpenRead(nxtConnection* connection, const char* filename, nxtOpenReadReply* reply);
+int nxtOpenWrite(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply);
+int nxtRead(nxtConnection* connection, uint8_t handle, int length, nxtReadData* reply);
+int nxtWrite(nxtConnection* connection, uint8_t handle, const uint8_t* data, int length, nxtWriteReply* reply);
+int nxtCloseHandle(nxtConnection* connection, uint8_t handle, nxtHandleReply* reply);
+int nxtDelete(nxtConnection* connection, const char* filename, nxtFilenameReply* reply);
+int nxtFindFirst(nxtConnection* connection, const char* pattern, nxtFileInfo* reply);
+int nxtFindNext(nxtConnection* connection, uint8_t handle, nxtFileInfo* reply);
+int nxtGetFirmwareVersion(nxtConnection* connection, nxtFirmwareVersion* reply);
+int nxtOpenWriteLinear(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply);
+int nxtOpenWriteData(nxtConnection* connection, const char* filename, uint32_t size, nxtHandleReply* reply);
+int nxtOpenAppendData(nxtConnection* connection, const char* filename, nxtOpenAppendReply* reply);
+int nxtSetBrickName(nxtConnection* connection, const char* name, nxtStatusReply* reply);
+int nxtGetDeviceInfo(nxtConnection* connection, nxtDeviceInfo* reply);
+int nxtUploadFile(nxtConnection* connection, const char* path, const char* filename, nxtTransfer* transfer);
+int nxtDownloadFile(nxtConnection* connection, const char* filename, int fd, nxtTransfer* transfer);
+int nxtDownloadBuffer(nxtConnection* connection, const char* filename, uint8_t* buffer, uint32_t capacity, nxtTransfer* transfer);
+int nxtReadStream(nxtConnection* connection, const char* filename, nxtSink sink, void* user_data, nxtTransfer* transfer);
+nxtDir* nxtDirOpen(nxtConnection* connection, const char* pattern);
+const nxtDirEntry* nxtDirRead(nxtDir* dir);
+int nxtDirClose(nxtDir* dir);
+int nxtDirLookup(nxtConnection* connection, const char* filename, nxtDirEntry* entry);
+void nxtDirSetCache(nxtConnection* connection, int enabled);
+void nxtDirInvalidate(nxtConnection* connection);
+int nxtSyncDirectory(nxtConnection* connection, const char* path, const char* manifest, nxtSync* sync);
+nxtTail* nxtTailCreate(nxtConnection* connection, const char* pattern, int record_length, nxtTailCallback callback, void* user_data);
+void nxtTailDestroy(nxtTail* tail);
+int nxtTailPoll(nxtTail* tail);
+uint32_t nxtTailGetOffset(nxtTail* tail, const char* filename);
+int nxtTailSetOffset(nxtTail* tail, const char* filename, uint32_t offset);
+nxtPoller* nxtPollerCreate(nxtConnection* connection);
+void nxtPollerDestroy(nxtPoller* poller);
+int nxtPollerAdd(nxtPoller* poller, nxtCommand command, uint8_t port, double rate, int capacity);
+int nxtPollerStart(nxtPoller* poller);
+void nxtPollerStop(nxtPoller* poller);
+int nxtPollerRead(nxtPoller* poller, int stream, nxtSample samples[], int count);
+int nxtPollerGetStreamStats(nxtPoller* poller, int stream, nxtStreamStats* stats);
+int nxtPollerSubscribe(nxtPoller* poller, int stream, const nxtTrigger triggers[], int trigger_count, uint64_t min_interval, nxtSubscriptionCallback callback, void* user_data);
+nxtOutputCache* nxtOutputCacheCreate(nxtConnection* connection, uint64_t flush_window);
+void nxtOutputCacheDestroy(nxtOutputCache* cache);
+int nxtOutputCacheSet(nxtOutputCache* cache, const nxtOutputState* state);
+int nxtOutputCacheFlush(nxtOutputCache* cache);
+uint64_t nxtOutputCacheGetDeadline(nxtOutputCache* cache);
+void nxtOutputCacheInvalidate(nxtOutputCache* cache);
+void nxtOutputCacheGetStats(nxtOutputCache* cache, nxtOutputCacheStats* stats);
+nxtMotorStream* nxtMotorStreamCreate(nxtConnection* connection, double rate, int capacity);
+void nxtMotorStreamDestroy(nxtMotorStream* stream);
+int nxtMotorStreamSetCallback(nxtMotorStream* stream, nxtSetpointCallback callback, void* user_data);
+int nxtMotorStreamSetRealtime(nxtMotorStream* stream, int priority, int cpu);
+int nxtMotorStreamStart(nxtMotorStream* stream);
+void nxtMotorStreamStop(nxtMotorStream* stream);
+int nxtMotorStreamPush(nxtMotorStream* stream, const nxtSetpoint* setpoint);
+void nxtMotorStreamGetStats(nxtMotorStream* stream, nxtMotorStreamStats* stats);
+int nxtGetStats(nxtConnection* connection, nxtStats* stats);
+void nxtResetStats(nxtConnection* connection);
+uint64_t nxtHistogramPercentile(const nxtHistogram* histogram, double fraction);
 char* nxtStatusString(nxtStatus status);
 char* nxtLibErrorString(nxtLibError liberror);
 
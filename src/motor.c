@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "libnxtbt.h"
+#include "commands.h"
+#include "connection.h"
+#include "ring.h"
+#include "stats.h"
+
+struct nxtMotorStream
+{
+	nxtConnection*	connection;
+	uint64_t	period;
+	ringBuffer	setpoints;	// nxtSetpoint, pushed by the application
+	nxtSetpointCallback	callback;
+	void*	user_data;
+	int	priority;	// SCHED_FIFO priority, or 0 for the default scheduler
+	int	cpu;	// CPU to run on, or -1 for any
+	pthread_t	thread;
+	atomic_int	running;
+	int	timer;	// timerfd that expires at every deadline
+	int	wake;	// eventfd that interrupts the stream thread's wait
+	atomic_uint_fast64_t	ticks;
+	atomic_uint_fast64_t	sent;
+	atomic_uint_fast64_t	underruns;
+	atomic_uint_fast64_t	missed;
+	atomic_uint_fast64_t	errors;
+	statsHistogram	lateness;
+};
+
+static void* run_stream(void* argument);
+static int send_setpoint(nxtMotorStream* stream, const nxtSetpoint* setpoint);
+
+// PUBLIC FUNCTIONS
+
+// Creates a stopped stream that sends a setpoint rate times a second, taking
+// them from a queue of capacity setpoints unless a callback is set.
+nxtMotorStream* nxtMotorStreamCreate(nxtConnection* connection, double rate, int capacity)
+{
+	nxtMotorStream*	stream;
+
+	if (rate <= 0 || capacity < 1)
+	{
+		return NULL;
+	}
+
+	stream = calloc(1, sizeof(nxtMotorStream));
+	if (stream == NULL)
+	{
+		return NULL;
+	}
+
+	if (ring_init(&(stream->setpoints), capacity, sizeof(nxtSetpoint)) == false)
+	{
+		free(stream);
+		return NULL;
+	}
+	stream->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	stream->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stream->timer < 0 || stream->wake < 0)
+	{
+		nxtMotorStreamDestroy(stream);
+		return NULL;
+	}
+
+	stream->connection = connection;
+	stream->period = 1e9 / rate;
+	if (stream->period == 0)
+	{
+		stream->period = 1;
+	}
+	stream->cpu = -1;
+
+	return stream;
+}
+
+void nxtMotorStreamDestroy(nxtMotorStream* stream)
+{
+	if (stream == NULL)
+	{
+		return;
+	}
+
+	nxtMotorStreamStop(stream);
+
+	if (stream->timer >= 0)
+	{
+		close(stream->timer);
+	}
+	if (stream->wake >= 0)
+	{
+		close(stream->wake);
+	}
+	ring_free(&(stream->setpoints));
+	free(stream);
+}
+
+// Has callback fill in the setpoint at every tick instead of taking it from
+// the queue. Only possible while the stream is stopped.
+int nxtMotorStreamSetCallback(nxtMotorStream* stream, nxtSetpointCallback callback, void* user_data)
+{
+	if (atomic_load(&stream->running) == true)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	stream->callback = callback;
+	stream->user_data = user_data;
+
+	return 0;
+}
+
+// Runs the stream thread under SCHED_FIFO at priority (0 for the default
+// scheduler) and on cpu (-1 for any). Only possible while the stream is
+// stopped; whether it is allowed is only known once it starts.
+int nxtMotorStreamSetRealtime(nxtMotorStream* stream, int priority, int cpu)
+{
+	if (atomic_load(&stream->running) == true || priority < 0 || (priority > 0 && (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))) || cpu < -1 || cpu >= CPU_SETSIZE)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	stream->priority = priority;
+	stream->cpu = cpu;
+
+	return 0;
+}
+
+// Starts sending, with the first deadline one period from now. Returns 0 or a
+// negative nxtLibError, which includes not being allowed the real-time
+// settings.
+int nxtMotorStreamStart(nxtMotorStream* stream)
+{
+	pthread_attr_t	attributes;
+	struct sched_param	parameters;
+	cpu_set_t	cpus;
+	int	result;
+
+	if (atomic_load(&stream->running) == true)
+	{
+		return 0;
+	}
+
+	pthread_attr_init(&attributes);
+	if (stream->priority > 0)
+	{
+		memset(&parameters, 0, sizeof(parameters));
+		parameters.sched_priority = stream->priority;
+		pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+		pthread_attr_setschedparam(&attributes, &parameters);
+	}
+	if (stream->cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(stream->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+	}
+
+	atomic_store(&stream->running, true);
+	result = pthread_create(&stream->thread, &attributes, run_stream, stream);
+	pthread_attr_destroy(&attributes);
+	if (result != 0)
+	{
+		atomic_store(&stream->running, false);
+		return NXT_LIBERR_GENERAL;
+	}
+
+	return 0;
+}
+
+void nxtMotorStreamStop(nxtMotorStream* stream)
+{
+	uint64_t	one;
+
+	if (atomic_exchange(&stream->running, false) == false)
+	{
+		return;
+	}
+
+	one = 1;
+	write(stream->wake, &one, sizeof(one));
+	pthread_join(stream->thread, NULL);
+}
+
+// Queues a setpoint for the next tick that has none. Only one thread may push
+// to each stream. Returns true, or false if the queue is full.
+int nxtMotorStreamPush(nxtMotorStream* stream, const nxtSetpoint* setpoint)
+{
+	return ring_push(&(stream->setpoints), setpoint);
+}
+
+void nxtMotorStreamGetStats(nxtMotorStream* stream, nxtMotorStreamStats* stats)
+{
+	stats->ticks = atomic_load_explicit(&stream->ticks, memory_order_relaxed);
+	stats->sent = atomic_load_explicit(&stream->sent, memory_order_relaxed);
+	stats->underruns = atomic_load_explicit(&stream->underruns, memory_order_relaxed);
+	stats->missed = atomic_load_explicit(&stream->missed, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&stream->errors, memory_order_relaxed);
+	stats->queued = ring_count(&(stream->setpoints));
+	stats_copy_histogram(&(stats->lateness), &(stream->lateness));
+}
+
+// PRIVATE FUNCTIONS
+
+// The deadlines are absolute, so the time taken by a tick never delays the
+// ones after it; a tick that overruns the next deadline loses it instead.
+static void* run_stream(void* argument)
+{
+	nxtMotorStream*	stream;
+	nxtSetpoint	setpoint;
+	struct itimerspec	timing;
+	struct pollfd	fds[2];
+	uint64_t	start;
+	uint64_t	tick;
+	uint64_t	deadline;
+	uint64_t	expirations;
+	uint64_t	wakeups;
+	int	available;
+
+	stream = argument;
+
+	start = stats_now() + stream->period;
+	timing.it_value.tv_sec = start / 1000000000;
+	timing.it_value.tv_nsec = start % 1000000000;
+	timing.it_interval.tv_sec = stream->period / 1000000000;
+	timing.it_interval.tv_nsec = stream->period % 1000000000;
+	timerfd_settime(stream->timer, TFD_TIMER_ABSTIME, &timing, NULL);
+
+	tick = 0;
+	while (atomic_load(&stream->running) == true)
+	{
+		fds[0].fd = stream->timer;
+		fds[0].events = POLLIN;
+		fds[1].fd = stream->wake;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) <= 0)
+		{
+			continue;
+		}
+		// a stop left unread would keep the next start from ever blocking
+		if ((fds[1].revents & POLLIN) != 0)
+		{
+			read(stream->wake, &wakeups, sizeof(wakeups));
+		}
+		if ((fds[0].revents & POLLIN) == 0)
+		{
+			continue;
+		}
+		if (read(stream->timer, &expirations, sizeof(expirations)) != sizeof(expirations) || expirations == 0)
+		{
+			continue;
+		}
+
+		// only the latest deadline is worth meeting; the others have gone
+		tick += expirations;
+		deadline = start + (tick - 1) * stream->period;
+		atomic_fetch_add_explicit(&stream->ticks, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&stream->missed, expirations - 1, memory_order_relaxed);
+
+		if (stream->callback != NULL)
+		{
+			memset(&setpoint, 0, sizeof(setpoint));
+			available = stream->callback(tick - 1, deadline, &setpoint, stream->user_data);
+		}
+		else
+		{
+			available = ring_pop(&(stream->setpoints), &setpoint);
+		}
+		if (available == false)
+		{
+			atomic_fetch_add_explicit(&stream->underruns, 1, memory_order_relaxed);
+			continue;
+		}
+
+		if (send_setpoint(stream, &setpoint) < 0)
+		{
+			atomic_fetch_add_explicit(&stream->errors, 1, memory_order_relaxed);
+			continue;
+		}
+		atomic_fetch_add_explicit(&stream->sent, 1, memory_order_relaxed);
+		stats_record_histogram(&(stream->lateness), stats_now() - deadline);
+	}
+
+	memset(&timing, 0, sizeof(timing));
+	timerfd_settime(stream->timer, 0, &timing, NULL);
+
+	return NULL;
+}
+
+// Writes the states of a setpoint together, without asking for replies.
+static int send_setpoint(nxtMotorStream* stream, const nxtSetpoint* setpoint)
+{
+	const void*	parameters[NXT_OUTPUT_PORTS];
+	int	index;
+
+	if (setpoint->count < 1 || setpoint->count > NXT_OUTPUT_PORTS)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	index = 0;
+	while (index < setpoint->count)
+	{
+		parameters[index] = &(setpoint->states[index]);
+		index += 1;
+	}
+
+	return connection_send_templates(stream->connection, commands_template(NXT_CMD_SETOUTPUTSTATE), parameters, setpoint->count);
+}
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "libnxtbt.h"
+#include "commands.h"
+#include "connection.h"
+#include "stats.h"
+
+struct nxtOutputCache
+{
+	nxtConnection*	connection;
+	uint64_t	flush_window;
+	uint64_t	oldest;	// when the oldest pending update was made
+	nxtOutputState	pending[NXT_OUTPUT_PORTS];
+	nxtOutputState	sent[NXT_OUTPUT_PORTS];	// what the NXT was last told
+	int	dirty[NXT_OUTPUT_PORTS];
+	int	known[NXT_OUTPUT_PORTS];	// sent can be trusted
+	nxtOutputCacheStats	stats;
+};
+
+static void set_port(nxtOutputCache* cache, const nxtOutputState* state, uint8_t port);
+static int same_settings(const nxtOutputState* first, const nxtOutputState* second);
+
+// PUBLIC FUNCTIONS
+
+// Creates a cache of the output states set through connection. Updates are
+// held back until nxtOutputCacheFlush, which the caller must make by the time
+// returned by nxtOutputCacheGetDeadline. nxtOutputCacheSet also flushes once
+// the oldest update is flush_window nanoseconds old, but nothing flushes an
+// idle cache on its own.
+nxtOutputCache* nxtOutputCacheCreate(nxtConnection* connection, uint64_t flush_window)
+{
+	nxtOutputCache*	cache;
+
+	cache = calloc(1, sizeof(nxtOutputCache));
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	cache->connection = connection;
+	cache->flush_window = flush_window;
+
+	return cache;
+}
+
+// Flushes whatever is still pending and frees the cache.
+void nxtOutputCacheDestroy(nxtOutputCache* cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	nxtOutputCacheFlush(cache);
+	free(cache);
+}
+
+// Replaces the pending state of state->port, or of every port if it is 0xFF.
+// Returns 0 or a negative nxtLibError from the flush this may cause.
+int nxtOutputCacheSet(nxtOutputCache* cache, const nxtOutputState* state)
+{
+	uint64_t	now;
+	uint8_t	port;
+	int	pending;
+
+	if (state->port >= NXT_OUTPUT_PORTS && state->port != 0xFF)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	pending = cache->dirty[0] || cache->dirty[1] || cache->dirty[2];
+	now = stats_now();
+	if (pending == false)
+	{
+		cache->oldest = now;
+	}
+
+	if (state->port == 0xFF)
+	{
+		port = 0;
+		while (port < NXT_OUTPUT_PORTS)
+		{
+			set_port(cache, state, port);
+			port += 1;
+		}
+	}
+	else
+	{
+		set_port(cache, state, state->port);
+	}
+
+	if (now - cache->oldest >= cache->flush_window)
+	{
+		return nxtOutputCacheFlush(cache);
+	}
+
+	return 0;
+}
+
+// Returns the CLOCK_MONOTONIC time by which nxtOutputCacheFlush must be called
+// for the pending updates to go out within the flush window, or 0 if none are
+// pending.
+uint64_t nxtOutputCacheGetDeadline(nxtOutputCache* cache)
+{
+	if (cache->dirty[0] == false && cache->dirty[1] == false && cache->dirty[2] == false)
+	{
+		return 0;
+	}
+
+	return cache->oldest + cache->flush_window;
+}
+
+// Sends every pending state that the NXT does not already have, without asking
+// for replies, in a single burst. A state that is the same for every port is
+// sent once for port 0xFF. Returns 0 or a negative nxtLibError, in which case
+// the states are still pending.
+int nxtOutputCacheFlush(nxtOutputCache* cache)
+{
+	const void*	parameters[NXT_OUTPUT_PORTS];
+	nxtOutputState	all;
+	int	changed[NXT_OUTPUT_PORTS];
+	int	count;
+	int	port;
+	int	result;
+
+	count = 0;
+	port = 0;
+	while (port < NXT_OUTPUT_PORTS)
+	{
+		changed[port] = false;
+		if (cache->dirty[port] == true)
+		{
+			if (cache->known[port] == true && memcmp(&(cache->pending[port]), &(cache->sent[port]), sizeof(nxtOutputState)) == 0)
+			{
+				cache->dirty[port] = false;
+				cache->stats.unchanged += 1;
+			}
+			else
+			{
+				changed[port] = true;
+				parameters[count] = &(cache->pending[port]);
+				count += 1;
+			}
+		}
+		port += 1;
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	if (count == NXT_OUTPUT_PORTS && same_settings(&(cache->pending[0]), &(cache->pending[1])) == true && same_settings(&(cache->pending[0]), &(cache->pending[2])) == true)
+	{
+		all = cache->pending[0];
+		all.port = 0xFF;
+		parameters[0] = &all;
+		count = 1;
+	}
+
+	result = connection_send_templates(cache->connection, commands_template(NXT_CMD_SETOUTPUTSTATE), parameters, count);
+
+	// after a failed write the NXT may or may not have any of the states
+	port = 0;
+	while (port < NXT_OUTPUT_PORTS)
+	{
+		if (changed[port] == true)
+		{
+			if (result == 0)
+			{
+				cache->sent[port] = cache->pending[port];
+				cache->dirty[port] = false;
+			}
+			cache->known[port] = result == 0;
+		}
+		port += 1;
+	}
+	if (result < 0)
+	{
+		return result;
+	}
+	cache->stats.frames += count;
+
+	return 0;
+}
+
+// Forgets what the NXT was last told, so that the next state of every port is
+// sent even if it is the same. This is needed when the outputs have been set
+// other than through the cache, and to repeat a movement with the same
+// tacho_limit.
+void nxtOutputCacheInvalidate(nxtOutputCache* cache)
+{
+	memset(cache->known, 0, sizeof(cache->known));
+}
+
+void nxtOutputCacheGetStats(nxtOutputCache* cache, nxtOutputCacheStats* stats)
+{
+	*stats = cache->stats;
+}
+
+// PRIVATE FUNCTIONS
+
+static void set_port(nxtOutputCache* cache, const nxtOutputState* state, uint8_t port)
+{
+	cache->stats.updates += 1;
+	if (cache->dirty[port] == true)
+	{
+		cache->stats.merged += 1;
+	}
+
+	cache->pending[port] = *state;
+	cache->pending[port].port = port;
+	cache->dirty[port] = true;
+}
+
+static int same_settings(const nxtOutputState* first, const nxtOutputState* second)
+{
+	nxtOutputState	other;
+
+	other = *second;
+	other.port = first->port;
+
+	return memcmp(first, &other, sizeof(nxtOutputState)) == 0;
+}
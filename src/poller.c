@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "libnxtbt.h"
+#include "commands.h"
+#include "ring.h"
+#include "stats.h"
+
+typedef struct
+{
+	nxtTrigger	trigger;
+	int32_t	reference;	// value when the trigger last fired
+	int32_t	previous;	// value in the previous sample
+} pollerTrigger;
+
+// Subscriptions are only added while the poller is stopped, so the completion
+// callback can evaluate them without locking.
+typedef struct
+{
+	pollerTrigger*	triggers;
+	int	trigger_count;
+	uint64_t	min_interval;
+	nxtSubscriptionCallback	callback;
+	void*	user_data;
+	int	primed;	// a valid sample has been seen
+	uint64_t	notified;	// when the callback was last called
+	uint32_t	pending;	// edges held back by min_interval
+} pollerSubscription;
+
+// One (command, port, rate) stream. The poller thread owns the schedule; the
+// completion callback, which may run on whichever thread reads the reply, owns
+// the reply and the subscriptions and is the single producer of the ring.
+typedef struct
+{
+	nxtPoller*	poller;
+	nxtCommand	command;
+	uint8_t	port;	// also the parameters of every request
+	uint64_t	period;
+	uint64_t	deadline;	// when the next request is due
+	uint64_t	due;	// when the request in flight was due
+	atomic_int	in_flight;
+	nxtRequest	request;
+	union
+	{
+		nxtInputValues	input;
+		nxtOutputStateReply	output;
+	} reply;
+	ringBuffer	samples;
+	atomic_uint_fast64_t	stored;
+	atomic_uint_fast64_t	overruns;
+	atomic_uint_fast64_t	missed;
+	atomic_uint_fast64_t	errors;
+	atomic_uint_fast64_t	notifications;
+	pollerSubscription*	subscriptions;
+	int	subscription_count;
+} pollerStream;
+
+struct nxtPoller
+{
+	nxtConnection*	connection;
+	pollerStream	streams[NXT_POLLER_STREAMS_MAX];
+	int	stream_count;
+	pthread_t	thread;
+	atomic_int	running;
+	int	wake;	// eventfd that interrupts the poller thread's wait
+};
+
+static void* run_poller(void* argument);
+static uint64_t dispatch_due(nxtPoller* poller, int* queued);
+static void complete_sample(nxtConnection* connection, nxtRequest* request, void* user_data);
+static void notify_subscribers(pollerStream* stream, const nxtSample* sample);
+static int sample_field(nxtCommand command, const nxtSample* sample, nxtSampleField field, int32_t* value);
+static void wake_poller(nxtPoller* poller);
+
+// PUBLIC FUNCTIONS
+
+nxtPoller* nxtPollerCreate(nxtConnection* connection)
+{
+	nxtPoller*	poller;
+
+	poller = calloc(1, sizeof(nxtPoller));
+	if (poller == NULL)
+	{
+		return NULL;
+	}
+
+	poller->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (poller->wake < 0)
+	{
+		free(poller);
+		return NULL;
+	}
+	poller->connection = connection;
+
+	return poller;
+}
+
+void nxtPollerDestroy(nxtPoller* poller)
+{
+	pollerStream*	polled;
+	int	stream;
+	int	subscription;
+
+	if (poller == NULL)
+	{
+		return;
+	}
+
+	nxtPollerStop(poller);
+
+	stream = 0;
+	while (stream < poller->stream_count)
+	{
+		polled = &(poller->streams[stream]);
+		subscription = 0;
+		while (subscription < polled->subscription_count)
+		{
+			free(polled->subscriptions[subscription].triggers);
+			subscription += 1;
+		}
+		free(polled->subscriptions);
+		ring_free(&(polled->samples));
+		stream += 1;
+	}
+	close(poller->wake);
+	free(poller);
+}
+
+// Adds a stream of NXT_CMD_GETINPUTVALUES or NXT_CMD_GETOUTPUTSTATE replies for
+// port, requested rate times a second and kept in a ring of capacity samples
+// until they are read, or only passed to subscriptions if capacity is 0.
+// Streams can only be added while the poller is stopped. Returns the stream
+// number or a negative nxtLibError.
+int nxtPollerAdd(nxtPoller* poller, nxtCommand command, uint8_t port, double rate, int capacity)
+{
+	pollerStream*	stream;
+
+	if (command != NXT_CMD_GETINPUTVALUES && command != NXT_CMD_GETOUTPUTSTATE)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	if (rate <= 0 || capacity < 0 || poller->stream_count == NXT_POLLER_STREAMS_MAX || atomic_load(&poller->running) == true)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	stream = &(poller->streams[poller->stream_count]);
+	memset(stream, 0, sizeof(pollerStream));
+	if (capacity > 0 && ring_init(&(stream->samples), capacity, sizeof(nxtSample)) == false)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+	stream->poller = poller;
+	stream->command = command;
+	stream->port = port;
+	stream->period = 1e9 / rate;
+	if (stream->period == 0)
+	{
+		stream->period = 1;
+	}
+
+	poller->stream_count += 1;
+
+	return poller->stream_count - 1;
+}
+
+// Starts polling on a thread of the poller's own. Returns 0 or a negative
+// nxtLibError.
+int nxtPollerStart(nxtPoller* poller)
+{
+	uint64_t	now;
+	int	stream;
+
+	if (atomic_load(&poller->running) == true)
+	{
+		return 0;
+	}
+
+	// every stream starts at once; EDF then spreads them out by their periods
+	now = stats_now();
+	stream = 0;
+	while (stream < poller->stream_count)
+	{
+		poller->streams[stream].deadline = now;
+		stream += 1;
+	}
+
+	atomic_store(&poller->running, true);
+	if (pthread_create(&poller->thread, NULL, run_poller, poller) != 0)
+	{
+		atomic_store(&poller->running, false);
+		return NXT_LIBERR_GENERAL;
+	}
+
+	return 0;
+}
+
+// Stops polling and waits for the requests in flight to complete.
+void nxtPollerStop(nxtPoller* poller)
+{
+	if (atomic_exchange(&poller->running, false) == false)
+	{
+		return;
+	}
+
+	wake_poller(poller);
+	pthread_join(poller->thread, NULL);
+}
+
+// Copies up to count of the oldest samples of stream into samples and removes
+// them from its ring. Only one thread may read each stream. Returns the number
+// of samples copied or a negative nxtLibError.
+int nxtPollerRead(nxtPoller* poller, int stream, nxtSample samples[], int count)
+{
+	int	read;
+
+	if (stream < 0 || stream >= poller->stream_count)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	read = 0;
+	while (read < count && ring_pop(&(poller->streams[stream].samples), &(samples[read])) == true)
+	{
+		read += 1;
+	}
+
+	return read;
+}
+
+int nxtPollerGetStreamStats(nxtPoller* poller, int stream, nxtStreamStats* stats)
+{
+	pollerStream*	polled;
+
+	if (stream < 0 || stream >= poller->stream_count)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	polled = &(poller->streams[stream]);
+
+	stats->samples = atomic_load_explicit(&polled->stored, memory_order_relaxed);
+	stats->overruns = atomic_load_explicit(&polled->overruns, memory_order_relaxed);
+	stats->missed = atomic_load_explicit(&polled->missed, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&polled->errors, memory_order_relaxed);
+	stats->notifications = atomic_load_explicit(&polled->notifications, memory_order_relaxed);
+	stats->pending = ring_count(&polled->samples);
+
+	return 0;
+}
+
+// Calls callback, on the thread that reads the reply, with the samples of
+// stream in which one of triggers fires, but not within min_interval
+// nanoseconds of the last call; edges in between are passed on with the next
+// sample after it. Subscriptions can only be added while the poller is
+// stopped. Returns the subscription number or a negative nxtLibError.
+int nxtPollerSubscribe(nxtPoller* poller, int stream, const nxtTrigger triggers[], int trigger_count, uint64_t min_interval, nxtSubscriptionCallback callback, void* user_data)
+{
+	pollerStream*	polled;
+	pollerSubscription*	subscriptions;
+	pollerSubscription*	subscription;
+	nxtSample	sample;
+	int32_t	value;
+	int	index;
+
+	if (stream < 0 || stream >= poller->stream_count || trigger_count < 1 || trigger_count > NXT_TRIGGERS_MAX || callback == NULL || atomic_load(&poller->running) == true)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+	polled = &(poller->streams[stream]);
+
+	memset(&sample, 0, sizeof(sample));
+	index = 0;
+	while (index < trigger_count)
+	{
+		if (sample_field(polled->command, &sample, triggers[index].field, &value) == false)
+		{
+			return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+		}
+		index += 1;
+	}
+
+	subscriptions = realloc(polled->subscriptions, sizeof(pollerSubscription) * (polled->subscription_count + 1));
+	if (subscriptions == NULL)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+	polled->subscriptions = subscriptions;
+
+	subscription = &(subscriptions[polled->subscription_count]);
+	memset(subscription, 0, sizeof(pollerSubscription));
+	subscription->triggers = calloc(trigger_count, sizeof(pollerTrigger));
+	if (subscription->triggers == NULL)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+	index = 0;
+	while (index < trigger_count)
+	{
+		subscription->triggers[index].trigger = triggers[index];
+		index += 1;
+	}
+	subscription->trigger_count = trigger_count;
+	subscription->min_interval = min_interval;
+	subscription->callback = callback;
+	subscription->user_data = user_data;
+
+	polled->subscription_count += 1;
+
+	return polled->subscription_count - 1;
+}
+
+// PRIVATE FUNCTIONS
+
+// Sends each request when it is due and otherwise sleeps in poll() on the
+// connection, so that replies are read as soon as they arrive.
+static void* run_poller(void* argument)
+{
+	nxtPoller*	poller;
+	struct pollfd	fds[2];
+	struct timespec	timeout;
+	uint64_t	next;
+	uint64_t	now;
+	uint64_t	deadline;
+	uint64_t	wakeups;
+	int	ready;
+	int	queued;
+	int	failed;
+	int	stream;
+
+	poller = argument;
+	failed = false;
+
+	while (atomic_load(&poller->running) == true)
+	{
+		next = dispatch_due(poller, &queued);
+		if (queued > 0)
+		{
+			failed = false;
+		}
+
+		// a request that times out has to be completed even if nothing arrives
+		deadline = nxtConnGetDeadline(poller->connection);
+		if (deadline != 0 && deadline < next)
+		{
+			next = deadline;
+		}
+
+		now = stats_now();
+		next = next > now ? next - now : 0;
+		timeout.tv_sec = next / 1000000000;
+		timeout.tv_nsec = next % 1000000000;
+
+		// after an I/O error the device is left alone until the next request
+		fds[0].fd = failed == true ? -1 : nxtConnGetFd(poller->connection);
+		fds[0].events = nxtConnPollEvents(poller->connection);
+		fds[1].fd = poller->wake;
+		fds[1].events = POLLIN;
+		ready = ppoll(fds, 2, &timeout, NULL);
+		if (ready < 0)
+		{
+			continue;
+		}
+
+		if (ready > 0 && (fds[1].revents & POLLIN) != 0)
+		{
+			read(poller->wake, &wakeups, sizeof(wakeups));
+		}
+		if (((ready > 0 && fds[0].revents != 0) || (deadline != 0 && stats_now() >= deadline)) && nxtConnProcess(poller->connection) < 0)
+		{
+			failed = true;
+		}
+	}
+
+	// the requests belong to the poller, so they must not be left in flight
+	stream = 0;
+	while (stream < poller->stream_count)
+	{
+		if (atomic_load_explicit(&poller->streams[stream].in_flight, memory_order_acquire) == true)
+		{
+			nxtConnWait(poller->connection, &(poller->streams[stream].request));
+		}
+		stream += 1;
+	}
+
+	return NULL;
+}
+
+// Queues every request that is due, earliest deadline first. A stream whose
+// previous request is still in flight waits for it rather than piling up
+// requests, and the periods it loses are counted as missed. Returns the
+// earliest deadline still to come.
+static uint64_t dispatch_due(nxtPoller* poller, int* queued)
+{
+	pollerStream*	stream;
+	pollerStream*	earliest;
+	uint64_t	now;
+	uint64_t	lost;
+	int	index;
+
+	*queued = 0;
+	while (true)
+	{
+		now = stats_now();
+		earliest = NULL;
+		index = 0;
+		while (index < poller->stream_count)
+		{
+			stream = &(poller->streams[index]);
+			if (atomic_load_explicit(&stream->in_flight, memory_order_acquire) == false && (earliest == NULL || stream->deadline < earliest->deadline))
+			{
+				earliest = stream;
+			}
+			index += 1;
+		}
+
+		// with every stream waiting for a reply, only a reply can wake the poller
+		if (earliest == NULL)
+		{
+			return now + 1000000000;
+		}
+		if (earliest->deadline > now)
+		{
+			return earliest->deadline;
+		}
+
+		stream = earliest;
+		stream->due = stream->deadline;
+		stream->deadline += stream->period;
+		if (stream->deadline <= now)
+		{
+			lost = (now - stream->deadline) / stream->period + 1;
+			stream->deadline += lost * stream->period;
+			atomic_fetch_add_explicit(&stream->missed, lost, memory_order_relaxed);
+		}
+
+		atomic_store_explicit(&stream->in_flight, true, memory_order_relaxed);
+		nxtConnQueueTemplate(poller->connection, &stream->request, commands_template(stream->command), &stream->port, &stream->reply, complete_sample, stream);
+		*queued += 1;
+	}
+}
+
+static void complete_sample(nxtConnection* connection, nxtRequest* request, void* user_data)
+{
+	pollerStream*	stream;
+	nxtSample	sample;
+
+	stream = user_data;
+
+	sample.timestamp = stats_now();
+	sample.latency = sample.timestamp - stream->due;
+	sample.result = request->result;
+	memcpy(&sample.value, &stream->reply, sizeof(stream->reply));
+
+	if (request->result < 0)
+	{
+		atomic_fetch_add_explicit(&stream->errors, 1, memory_order_relaxed);
+	}
+	if (stream->samples.slots != NULL)
+	{
+		if (ring_push(&stream->samples, &sample) == true)
+		{
+			atomic_fetch_add_explicit(&stream->stored, 1, memory_order_relaxed);
+		}
+		else
+		{
+			atomic_fetch_add_explicit(&stream->overruns, 1, memory_order_relaxed);
+		}
+	}
+	notify_subscribers(stream, &sample);
+
+	atomic_store_explicit(&stream->in_flight, false, memory_order_release);
+
+	// a reply read by another thread may make a request due that the poller
+	// thread is not waiting for
+	if (pthread_equal(pthread_self(), stream->poller->thread) == false)
+	{
+		wake_poller(stream->poller);
+	}
+}
+
+// Deadbands are measured from where each trigger last fired, so a slow drift
+// still fires once it adds up. A deadband that is crossed while min_interval
+// holds the callback back is checked again against the next sample; an edge is
+// remembered until it can be passed on.
+static void notify_subscribers(pollerStream* stream, const nxtSample* sample)
+{
+	pollerSubscription*	subscription;
+	pollerTrigger*	trigger;
+	int32_t	value;
+	uint32_t	edges;
+	uint32_t	moved;
+	uint32_t	fired;
+	int	index;
+	int	trigger_index;
+
+	if (sample->result < 1)
+	{
+		return;
+	}
+	if (stream->command == NXT_CMD_GETINPUTVALUES && (sample->value.input.status != NXT_STS_SUCCESS || sample->value.input.valid == false))
+	{
+		// a sensor that is still being set up reports values that mean nothing
+		return;
+	}
+	if (stream->command == NXT_CMD_GETOUTPUTSTATE && sample->value.output.status != NXT_STS_SUCCESS)
+	{
+		return;
+	}
+
+	index = 0;
+	while (index < stream->subscription_count)
+	{
+		subscription = &(stream->subscriptions[index]);
+		edges = 0;
+		moved = 0;
+		trigger_index = 0;
+		while (trigger_index < subscription->trigger_count)
+		{
+			trigger = &(subscription->triggers[trigger_index]);
+			sample_field(stream->command, sample, trigger->trigger.field, &value);
+			if (subscription->primed == false)
+			{
+				trigger->reference = value;
+			}
+			else
+			{
+				if ((trigger->trigger.edges & NXT_EDGE_RISING) != 0 && trigger->previous < trigger->trigger.threshold && value >= trigger->trigger.threshold)
+				{
+					edges |= 1u << trigger_index;
+				}
+				if ((trigger->trigger.edges & NXT_EDGE_FALLING) != 0 && trigger->previous >= trigger->trigger.threshold && value < trigger->trigger.threshold)
+				{
+					edges |= 1u << trigger_index;
+				}
+				if (trigger->trigger.deadband >= 0 && llabs((int64_t) value - trigger->reference) > trigger->trigger.deadband)
+				{
+					moved |= 1u << trigger_index;
+				}
+			}
+			trigger->previous = value;
+			trigger_index += 1;
+		}
+
+		fired = subscription->pending | edges | moved;
+		if (subscription->primed == true && fired == 0)
+		{
+			index += 1;
+			continue;
+		}
+		if (subscription->primed == true && sample->timestamp - subscription->notified < subscription->min_interval)
+		{
+			subscription->pending |= edges;
+			index += 1;
+			continue;
+		}
+
+		trigger_index = 0;
+		while (trigger_index < subscription->trigger_count)
+		{
+			if ((fired & (1u << trigger_index)) != 0)
+			{
+				sample_field(stream->command, sample, subscription->triggers[trigger_index].trigger.field, &(subscription->triggers[trigger_index].reference));
+			}
+			trigger_index += 1;
+		}
+		subscription->primed = true;
+		subscription->pending = 0;
+		subscription->notified = sample->timestamp;
+		atomic_fetch_add_explicit(&stream->notifications, 1, memory_order_relaxed);
+		subscription->callback(stream - stream->poller->streams, sample, fired, subscription->user_data);
+		index += 1;
+	}
+}
+
+// Returns false if command has no such field.
+static int sample_field(nxtCommand command, const nxtSample* sample, nxtSampleField field, int32_t* value)
+{
+	if (command == NXT_CMD_GETINPUTVALUES)
+	{
+		switch (field)
+		{
+			case NXT_FIELD_RAW:
+				*value = sample->value.input.raw_value;
+				return true;
+			case NXT_FIELD_NORMALIZED:
+				*value = sample->value.input.normalized_value;
+				return true;
+			case NXT_FIELD_SCALED:
+				*value = sample->value.input.scaled_value;
+				return true;
+			case NXT_FIELD_CALIBRATED:
+				*value = sample->value.input.calibrated_value;
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	switch (field)
+	{
+		case NXT_FIELD_POWER:
+			*value = sample->value.output.power;
+			return true;
+		case NXT_FIELD_RUN_STATE:
+			*value = sample->value.output.run_state;
+			return true;
+		case NXT_FIELD_TACHO_COUNT:
+			*value = sample->value.output.tacho_count;
+			return true;
+		case NXT_FIELD_BLOCK_TACHO_COUNT:
+			*value = sample->value.output.block_tacho_count;
+			return true;
+		case NXT_FIELD_ROTATION_COUNT:
+			*value = sample->value.output.rotation_count;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void wake_poller(nxtPoller* poller)
+{
+	uint64_t	one;
+
+	one = 1;
+	write(poller->wake, &one, sizeof(one));
+}
@@ -0,0 +1,96 @@
+#ifndef _ring_h_
+#define _ring_h_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// A bounded queue of fixed-size slots with one producer and one consumer,
+// which may be different threads. Neither side takes a lock or allocates
+// memory: each only ever writes its own index, and publishes it with release
+// ordering after copying the slot. The indices run freely and are reduced
+// modulo the capacity, which is a power of two.
+typedef struct
+{
+	uint8_t*	slots;
+	size_t	slot_size;
+	uint32_t	mask;
+	_Alignas(64) atomic_uint	head;	// next slot to write, owned by the producer
+	_Alignas(64) atomic_uint	tail;	// next slot to read, owned by the consumer
+} ringBuffer;
+
+// Allocates room for at least capacity slots. Returns false if memory cannot
+// be allocated.
+static inline int ring_init(ringBuffer* ring, uint32_t capacity, size_t slot_size)
+{
+	uint32_t	size;
+
+	size = 1;
+	while (size < capacity)
+	{
+		size *= 2;
+	}
+
+	ring->slots = malloc(size * slot_size);
+	if (ring->slots == NULL)
+	{
+		return false;
+	}
+	ring->slot_size = slot_size;
+	ring->mask = size - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+
+	return true;
+}
+
+static inline void ring_free(ringBuffer* ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+// Called by the producer. Returns false if the ring is full.
+static inline int ring_push(ringBuffer* ring, const void* value)
+{
+	unsigned int	head;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) > ring->mask)
+	{
+		return false;
+	}
+
+	memcpy(ring->slots + (head & ring->mask) * ring->slot_size, value, ring->slot_size);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+// Called by the consumer. Returns false if the ring is empty.
+static inline int ring_pop(ringBuffer* ring, void* value)
+{
+	unsigned int	tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+	{
+		return false;
+	}
+
+	memcpy(value, ring->slots + (tail & ring->mask) * ring->slot_size, ring->slot_size);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+// May be called from either side; the answer is out of date as soon as it is
+// returned.
+static inline uint32_t ring_count(ringBuffer* ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "connection.h"
+#include "stats.h"
+
+#define HISTOGRAM_SUB_BUCKETS 8	// buckets per power of two (12.5% resolution)
+#define HISTOGRAM_SUB_BITS 3
+
+static const nxtCommand	mCommands[NXT_STATS_COMMANDS] =
+{
+	NXT_CMD_STARTPROGRAM,
+	NXT_CMD_STOPPROGRAM,
+	NXT_CMD_PLAYSOUNDFILE,
+	NXT_CMD_PLAYTONE,
+	NXT_CMD_SETOUTPUTSTATE,
+	NXT_CMD_SETINPUTMODE,
+	NXT_CMD_GETOUTPUTSTATE,
+	NXT_CMD_GETINPUTVALUES,
+	NXT_CMD_RESETINPUTSCALEDVALUE,
+	NXT_CMD_MESSAGEWRITE,
+	NXT_CMD_RESETMOTORPOSITION,
+	NXT_CMD_GETBATTERYLEVEL,
+	NXT_CMD_STOPSOUNDPLAYBACK,
+	NXT_CMD_KEEPALIVE,
+	NXT_CMD_LSGETSTATUS,
+	NXT_CMD_LSWRITE,
+	NXT_CMD_LSREAD,
+	NXT_CMD_GETCURRENTPROGRAMNAME,
+	NXT_CMD_MESSAGEREAD,
+	NXT_CMD_OPENREAD,
+	NXT_CMD_OPENWRITE,
+	NXT_CMD_READ,
+	NXT_CMD_WRITE,
+	NXT_CMD_CLOSE,
+	NXT_CMD_DELETE,
+	NXT_CMD_FINDFIRST,
+	NXT_CMD_FINDNEXT,
+	NXT_CMD_GETFIRMWAREVERSION,
+	NXT_CMD_OPENWRITELINEAR,
+	NXT_CMD_OPENWRITEDATA,
+	NXT_CMD_OPENAPPENDDATA,
+	NXT_CMD_SETBRICKNAME,
+	NXT_CMD_GETDEVICEINFO,
+};
+
+static statsCommand* command_counters(statsCounters* stats, nxtCommand command);
+static void record_histogram(statsHistogram* histogram, uint64_t value);
+static void copy_histogram(nxtHistogram* snapshot, statsHistogram* histogram);
+static void clear_histogram(statsHistogram* histogram);
+static int bucket_index(uint64_t value);
+static uint64_t bucket_value(int index);
+
+// PUBLIC FUNCTIONS
+
+int nxtGetStats(nxtConnection* connection, nxtStats* stats)
+{
+	statsCommand*	counters;
+	nxtCommandStats*	snapshot;
+	int	command_index;
+	int	index;
+
+	command_index = 0;
+	while (command_index < NXT_STATS_COMMANDS)
+	{
+		counters = &(connection->stats->commands[command_index]);
+		snapshot = &(stats->commands[command_index]);
+
+		snapshot->command = mCommands[command_index];
+		snapshot->calls = atomic_load_explicit(&counters->calls, memory_order_relaxed);
+		snapshot->bytes_out = atomic_load_explicit(&counters->bytes_out, memory_order_relaxed);
+		snapshot->bytes_in = atomic_load_explicit(&counters->bytes_in, memory_order_relaxed);
+		index = 0;
+		while (index < NXT_STATS_LIBERRORS)
+		{
+			snapshot->errors[index] = atomic_load_explicit(&counters->errors[index], memory_order_relaxed);
+			index += 1;
+		}
+		index = 0;
+		while (index < 256)
+		{
+			snapshot->statuses[index] = atomic_load_explicit(&counters->statuses[index], memory_order_relaxed);
+			index += 1;
+		}
+		copy_histogram(&(snapshot->latency), &(counters->latency));
+
+		command_index += 1;
+	}
+
+	index = 0;
+	while (index < NXT_PHASES)
+	{
+		copy_histogram(&(stats->phases[index]), &(connection->stats->phases[index]));
+		index += 1;
+	}
+
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		copy_histogram(&(stats->queueing[index]), &(connection->stats->queueing[index]));
+		index += 1;
+	}
+
+	return 0;
+}
+
+void nxtResetStats(nxtConnection* connection)
+{
+	statsCommand*	counters;
+	int	command_index;
+	int	index;
+
+	command_index = 0;
+	while (command_index < NXT_STATS_COMMANDS)
+	{
+		counters = &(connection->stats->commands[command_index]);
+
+		atomic_store_explicit(&counters->calls, 0, memory_order_relaxed);
+		atomic_store_explicit(&counters->bytes_out, 0, memory_order_relaxed);
+		atomic_store_explicit(&counters->bytes_in, 0, memory_order_relaxed);
+		index = 0;
+		while (index < NXT_STATS_LIBERRORS)
+		{
+			atomic_store_explicit(&counters->errors[index], 0, memory_order_relaxed);
+			index += 1;
+		}
+		index = 0;
+		while (index < 256)
+		{
+			atomic_store_explicit(&counters->statuses[index], 0, memory_order_relaxed);
+			index += 1;
+		}
+		clear_histogram(&(counters->latency));
+
+		command_index += 1;
+	}
+
+	index = 0;
+	while (index < NXT_PHASES)
+	{
+		clear_histogram(&(connection->stats->phases[index]));
+		index += 1;
+	}
+
+	index = 0;
+	while (index < NXT_CLASSES)
+	{
+		clear_histogram(&(connection->stats->queueing[index]));
+		index += 1;
+	}
+}
+
+// Returns the duration below which the given fraction (0 to 1) of the recorded
+// values fall, to within the resolution of the histogram.
+uint64_t nxtHistogramPercentile(const nxtHistogram* histogram, double fraction)
+{
+	uint64_t	target;
+	uint64_t	seen;
+	int	index;
+
+	if (histogram->count == 0)
+	{
+		return 0;
+	}
+
+	target = fraction * histogram->count;
+	if (target >= histogram->count)
+	{
+		target = histogram->count - 1;
+	}
+
+	seen = 0;
+	index = 0;
+	while (index < NXT_HISTOGRAM_BUCKETS)
+	{
+		seen += histogram->buckets[index];
+		if (seen > target)
+		{
+			return bucket_value(index);
+		}
+
+		index += 1;
+	}
+
+	return bucket_value(NXT_HISTOGRAM_BUCKETS - 1);
+}
+
+// LIBRARY FUNCTIONS
+// (used by connection.c and motor.c to record events)
+
+void stats_record_phase(statsCounters* stats, nxtPhase phase, uint64_t duration)
+{
+	record_histogram(&(stats->phases[phase]), duration);
+}
+
+void stats_record_queueing(statsCounters* stats, nxtClass command_class, uint64_t duration)
+{
+	record_histogram(&(stats->queueing[command_class]), duration);
+}
+
+void stats_record_send(statsCounters* stats, nxtCommand command, int bytes)
+{
+	statsCommand*	counters;
+
+	counters = command_counters(stats, command);
+	if (counters == NULL)
+	{
+		return;
+	}
+
+	atomic_fetch_add_explicit(&counters->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->bytes_out, bytes, memory_order_relaxed);
+}
+
+void stats_record_result(statsCounters* stats, nxtCommand command, int result)
+{
+	statsCommand*	counters;
+
+	counters = command_counters(stats, command);
+	if (counters == NULL || result >= 0 || -result >= NXT_STATS_LIBERRORS)
+	{
+		return;
+	}
+
+	atomic_fetch_add_explicit(&counters->errors[-result], 1, memory_order_relaxed);
+}
+
+void stats_record_response(statsCounters* stats, nxtCommand command, int status, int bytes)
+{
+	statsCommand*	counters;
+
+	counters = command_counters(stats, command);
+	if (counters == NULL)
+	{
+		return;
+	}
+
+	atomic_fetch_add_explicit(&counters->bytes_in, bytes, memory_order_relaxed);
+	if (status >= 0)
+	{
+		atomic_fetch_add_explicit(&counters->statuses[status & 0xFF], 1, memory_order_relaxed);
+	}
+}
+
+void stats_record_latency(statsCounters* stats, nxtCommand command, uint64_t duration)
+{
+	statsCommand*	counters;
+
+	counters = command_counters(stats, command);
+	if (counters == NULL)
+	{
+		return;
+	}
+
+	record_histogram(&(counters->latency), duration);
+}
+
+void stats_record_histogram(statsHistogram* histogram, uint64_t value)
+{
+	record_histogram(histogram, value);
+}
+
+void stats_copy_histogram(nxtHistogram* snapshot, statsHistogram* histogram)
+{
+	copy_histogram(snapshot, histogram);
+}
+
+// PRIVATE FUNCTIONS
+
+// mCommands is sorted, so the search stops at the first larger command.
+static statsCommand* command_counters(statsCounters* stats, nxtCommand command)
+{
+	int	index;
+
+	index = 0;
+	while (index < NXT_STATS_COMMANDS && mCommands[index] <= command)
+	{
+		if (mCommands[index] == command)
+		{
+			return &(stats->commands[index]);
+		}
+
+		index += 1;
+	}
+
+	return NULL;
+}
+
+static void record_histogram(statsHistogram* histogram, uint64_t value)
+{
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->buckets[bucket_index(value)], 1, memory_order_relaxed);
+}
+
+static void copy_histogram(nxtHistogram* snapshot, statsHistogram* histogram)
+{
+	int	index;
+
+	snapshot->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	snapshot->sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+	index = 0;
+	while (index < NXT_HISTOGRAM_BUCKETS)
+	{
+		snapshot->buckets[index] = atomic_load_explicit(&histogram->buckets[index], memory_order_relaxed);
+		index += 1;
+	}
+}
+
+static void clear_histogram(statsHistogram* histogram)
+{
+	int	index;
+
+	atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&histogram->sum, 0, memory_order_relaxed);
+	index = 0;
+	while (index < NXT_HISTOGRAM_BUCKETS)
+	{
+		atomic_store_explicit(&histogram->buckets[index], 0, memory_order_relaxed);
+		index += 1;
+	}
+}
+
+static int bucket_index(uint64_t value)
+{
+	int	exponent;
+	int	index;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+	{
+		return value;
+	}
+
+	exponent = 63 - __builtin_clzll(value);
+	index = (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+	if (index >= NXT_HISTOGRAM_BUCKETS)
+	{
+		index = NXT_HISTOGRAM_BUCKETS - 1;
+	}
+
+	return index;
+}
+
+// Returns the midpoint of the range of values counted by a bucket.
+static uint64_t bucket_value(int index)
+{
+	int	exponent;
+	uint64_t	lower;
+	uint64_t	width;
+
+	if (index < HISTOGRAM_SUB_BUCKETS)
+	{
+		return index;
+	}
+
+	exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	width = (uint64_t) 1 << (exponent - HISTOGRAM_SUB_BITS);
+	lower = (uint64_t) (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << (exponent - HISTOGRAM_SUB_BITS);
+
+	return lower + width / 2;
+}
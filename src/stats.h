@@ -0,0 +1,55 @@
+#ifndef _stats_h_
+#define _stats_h_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "libnxtbt.h"
+
+// Live counterparts of nxtHistogram, nxtCommandStats and nxtStats. They are
+// only ever incremented with relaxed atomic operations, so recording never
+// takes a lock and a snapshot may be taken at any time.
+typedef struct
+{
+	atomic_uint_fast64_t	count;
+	atomic_uint_fast64_t	sum;
+	atomic_uint_fast64_t	buckets[NXT_HISTOGRAM_BUCKETS];
+} statsHistogram;
+
+typedef struct
+{
+	atomic_uint_fast64_t	calls;
+	atomic_uint_fast64_t	bytes_out;
+	atomic_uint_fast64_t	bytes_in;
+	atomic_uint_fast64_t	errors[NXT_STATS_LIBERRORS];
+	atomic_uint_fast64_t	statuses[256];
+	statsHistogram	latency;
+} statsCommand;
+
+typedef struct
+{
+	statsCommand	commands[NXT_STATS_COMMANDS];
+	statsHistogram	phases[NXT_PHASES];
+	statsHistogram	queueing[NXT_CLASSES];
+} statsCounters;
+
+void stats_record_phase(statsCounters* stats, nxtPhase phase, uint64_t duration);
+void stats_record_queueing(statsCounters* stats, nxtClass command_class, uint64_t duration);
+void stats_record_send(statsCounters* stats, nxtCommand command, int bytes);
+void stats_record_result(statsCounters* stats, nxtCommand command, int result);
+void stats_record_response(statsCounters* stats, nxtCommand command, int status, int bytes);
+void stats_record_latency(statsCounters* stats, nxtCommand command, uint64_t duration);
+void stats_record_histogram(statsHistogram* histogram, uint64_t value);
+void stats_copy_histogram(nxtHistogram* snapshot, statsHistogram* histogram);
+
+static inline uint64_t stats_now()
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif
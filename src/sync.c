@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libnxtbt.h"
+
+#define SYNC_FNV_OFFSET 0xCBF29CE484222325ULL
+#define SYNC_FNV_PRIME 0x100000001B3ULL
+
+// One file, as found locally, on the NXT or in the manifest.
+typedef struct
+{
+	char	filename[NXT_FILENAME_LENGTH];
+	uint32_t	size;
+	uint64_t	hash;
+	int	done;	// local: now the same on the NXT; remote: still wanted
+} syncFile;
+
+typedef struct
+{
+	syncFile*	files;
+	int	count;
+	int	capacity;
+} syncList;
+
+static int list_local(const char* path, const char* pattern, syncList* local, nxtSync* sync);
+static int list_remote(nxtConnection* connection, const char* pattern, syncList* remote);
+static int read_manifest(const char* manifest, syncList* entries);
+static int write_manifest(const char* manifest, syncList* local, syncList* known, const char* pattern);
+static int hash_file(const char* path, uint64_t* hash);
+static syncFile* add_file(syncList* list, const char* filename, uint32_t size);
+static syncFile* find_file(syncList* list, const char* filename);
+static void set_failed(nxtSync* sync, const char* filename);
+
+// PUBLIC FUNCTIONS
+
+// Makes the files on the NXT matching sync->pattern the same as the matching
+// files in the local directory at path. manifest names a local file that holds
+// the size and content hash of every file known to be on the NXT already, or
+// is NULL to compare sizes alone.
+int nxtSyncDirectory(nxtConnection* connection, const char* path, const char* manifest, nxtSync* sync)
+{
+	nxtSync	defaults;
+	nxtFilenameReply	delete_reply;
+	syncList	local;
+	syncList	remote;
+	syncList	known;
+	syncFile*	file;
+	syncFile*	on_nxt;
+	syncFile*	entry;
+	const char*	pattern;
+	char*	file_path;
+	int	index;
+	int	result;
+
+	if (sync == NULL)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		sync = &defaults;
+	}
+	sync->uploaded = 0;
+	sync->unchanged = 0;
+	sync->deleted = 0;
+	sync->skipped = 0;
+	sync->bytes = 0;
+	sync->failed[0] = 0;
+	pattern = sync->pattern != NULL ? sync->pattern : "*.*";
+
+	memset(&local, 0, sizeof(local));
+	memset(&remote, 0, sizeof(remote));
+	memset(&known, 0, sizeof(known));
+
+	result = list_local(path, pattern, &local, sync);
+	if (result == 0)
+	{
+		result = list_remote(connection, pattern, &remote);
+	}
+	if (result == 0 && manifest != NULL)
+	{
+		result = read_manifest(manifest, &known);
+	}
+
+	// a file is unchanged only if the NXT has it at the same size and, with a
+	// manifest, the manifest says that it has this content
+	index = 0;
+	while (result == 0 && index < local.count)
+	{
+		file = &(local.files[index]);
+		on_nxt = find_file(&remote, file->filename);
+		if (on_nxt != NULL)
+		{
+			on_nxt->done = true;
+		}
+		entry = find_file(&known, file->filename);
+		if (on_nxt != NULL && on_nxt->size == file->size && (manifest == NULL || (entry != NULL && entry->size == file->size && entry->hash == file->hash)))
+		{
+			file->done = true;
+			sync->unchanged += 1;
+		}
+		index += 1;
+	}
+
+	// stale files go first, to make room for the new ones
+	index = 0;
+	while (result == 0 && sync->keep_stale == false && index < remote.count)
+	{
+		file = &(remote.files[index]);
+		if (file->done == false)
+		{
+			if (sync->dry_run == false)
+			{
+				result = nxtDelete(connection, file->filename, &delete_reply);
+				if (result >= 1 && delete_reply.status != NXT_STS_SUCCESS)
+				{
+					sync->transfer.status = delete_reply.status;
+					result = NXT_LIBERR_STATUS;
+				}
+				if (result < 0)
+				{
+					set_failed(sync, file->filename);
+					break;
+				}
+				result = 0;
+			}
+			sync->deleted += 1;
+		}
+		index += 1;
+	}
+
+	index = 0;
+	while (result == 0 && index < local.count)
+	{
+		file = &(local.files[index]);
+		if (file->done == false)
+		{
+			if (sync->dry_run == false)
+			{
+				if (asprintf(&file_path, "%s/%s", path, file->filename) < 0)
+				{
+					result = NXT_LIBERR_GENERAL;
+					break;
+				}
+				result = nxtUploadFile(connection, file_path, file->filename, &(sync->transfer));
+				free(file_path);
+				if (result < 0)
+				{
+					set_failed(sync, file->filename);
+					break;
+				}
+				sync->bytes += sync->transfer.bytes;
+				file->done = true;
+			}
+			sync->uploaded += 1;
+		}
+		index += 1;
+	}
+
+	// whatever was done before a failure is remembered, so that it is not repeated
+	if (manifest != NULL && sync->dry_run == false && write_manifest(manifest, &local, &known, pattern) == false && result == 0)
+	{
+		result = NXT_LIBERR_FILE;
+	}
+
+	free(local.files);
+	free(remote.files);
+	free(known.files);
+
+	return result;
+}
+
+// PRIVATE FUNCTIONS
+
+// Lists and hashes the regular files in path matching pattern. Names that the
+// NXT cannot hold are counted in sync->skipped.
+static int list_local(const char* path, const char* pattern, syncList* local, nxtSync* sync)
+{
+	DIR*	directory;
+	struct dirent*	dirent;
+	struct stat	file_status;
+	syncFile*	file;
+	char*	file_path;
+	int	result;
+
+	directory = opendir(path);
+	if (directory == NULL)
+	{
+		return NXT_LIBERR_FILE;
+	}
+
+	result = 0;
+	while (result == 0 && (dirent = readdir(directory)) != NULL)
+	{
+		if (dirent->d_name[0] == '.' || fnmatch(pattern, dirent->d_name, FNM_CASEFOLD) != 0)
+		{
+			continue;
+		}
+		if (asprintf(&file_path, "%s/%s", path, dirent->d_name) < 0)
+		{
+			result = NXT_LIBERR_GENERAL;
+			break;
+		}
+		if (stat(file_path, &file_status) < 0 || S_ISREG(file_status.st_mode) == false)
+		{
+			free(file_path);
+			continue;
+		}
+		if (strlen(dirent->d_name) >= NXT_FILENAME_LENGTH || file_status.st_size > UINT32_MAX)
+		{
+			sync->skipped += 1;
+			free(file_path);
+			continue;
+		}
+
+		file = add_file(local, dirent->d_name, file_status.st_size);
+		if (file == NULL)
+		{
+			result = NXT_LIBERR_GENERAL;
+		}
+		else if (hash_file(file_path, &(file->hash)) == false)
+		{
+			set_failed(sync, dirent->d_name);
+			result = NXT_LIBERR_FILE;
+		}
+		free(file_path);
+	}
+	closedir(directory);
+
+	return result;
+}
+
+static int list_remote(nxtConnection* connection, const char* pattern, syncList* remote)
+{
+	nxtDir*	dir;
+	const nxtDirEntry*	entry;
+	int	result;
+	int	closed;
+
+	dir = nxtDirOpen(connection, pattern);
+	if (dir == NULL)
+	{
+		return NXT_LIBERR_GENERAL;
+	}
+
+	result = 0;
+	while ((entry = nxtDirRead(dir)) != NULL)
+	{
+		if (result == 0 && add_file(remote, entry->filename, entry->size) == NULL)
+		{
+			result = NXT_LIBERR_GENERAL;
+		}
+	}
+
+	closed = nxtDirClose(dir);
+
+	return result < 0 ? result : closed;
+}
+
+// The manifest has one line per file: its name, size and FNV-1a hash. A
+// missing manifest is the same as an empty one.
+static int read_manifest(const char* manifest, syncList* entries)
+{
+	FILE*	stream;
+	syncFile*	entry;
+	char	filename[NXT_FILENAME_LENGTH];
+	unsigned long	size;
+	unsigned long long	hash;
+
+	stream = fopen(manifest, "r");
+	if (stream == NULL)
+	{
+		return 0;
+	}
+
+	while (fscanf(stream, "%19s %lu %llx", filename, &size, &hash) == 3)
+	{
+		entry = add_file(entries, filename, size);
+		if (entry == NULL)
+		{
+			fclose(stream);
+			return NXT_LIBERR_GENERAL;
+		}
+		entry->hash = hash;
+	}
+	fclose(stream);
+
+	return 0;
+}
+
+// Replaces the manifest with the local files now known to be on the NXT,
+// keeping the entries for files outside pattern as they were.
+static int write_manifest(const char* manifest, syncList* local, syncList* known, const char* pattern)
+{
+	FILE*	stream;
+	char*	temporary;
+	int	index;
+	int	written;
+
+	if (asprintf(&temporary, "%s.tmp", manifest) < 0)
+	{
+		return false;
+	}
+	stream = fopen(temporary, "w");
+	if (stream == NULL)
+	{
+		free(temporary);
+		return false;
+	}
+
+	written = true;
+	index = 0;
+	while (index < local->count)
+	{
+		if (local->files[index].done == true && fprintf(stream, "%s %lu %016llx\n", local->files[index].filename, (unsigned long) local->files[index].size, (unsigned long long) local->files[index].hash) < 0)
+		{
+			written = false;
+		}
+		index += 1;
+	}
+	index = 0;
+	while (index < known->count)
+	{
+		if (fnmatch(pattern, known->files[index].filename, FNM_CASEFOLD) != 0 && fprintf(stream, "%s %lu %016llx\n", known->files[index].filename, (unsigned long) known->files[index].size, (unsigned long long) known->files[index].hash) < 0)
+		{
+			written = false;
+		}
+		index += 1;
+	}
+	if (fclose(stream) != 0)
+	{
+		written = false;
+	}
+
+	if (written == true && rename(temporary, manifest) < 0)
+	{
+		written = false;
+	}
+	if (written == false)
+	{
+		unlink(temporary);
+	}
+	free(temporary);
+
+	return written;
+}
+
+static int hash_file(const char* path, uint64_t* hash)
+{
+	struct stat	file_status;
+	uint8_t*	data;
+	off_t	position;
+	int	file;
+
+	file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+	if (fstat(file, &file_status) < 0)
+	{
+		close(file);
+		return false;
+	}
+
+	*hash = SYNC_FNV_OFFSET;
+	if (file_status.st_size > 0)
+	{
+		data = mmap(NULL, file_status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED)
+		{
+			close(file);
+			return false;
+		}
+		madvise(data, file_status.st_size, MADV_SEQUENTIAL);
+
+		position = 0;
+		while (position < file_status.st_size)
+		{
+			*hash = (*hash ^ data[position]) * SYNC_FNV_PRIME;
+			position += 1;
+		}
+		munmap(data, file_status.st_size);
+	}
+	close(file);
+
+	return true;
+}
+
+static syncFile* add_file(syncList* list, const char* filename, uint32_t size)
+{
+	syncFile*	files;
+	syncFile*	file;
+
+	if (list->count == list->capacity)
+	{
+		files = realloc(list->files, sizeof(syncFile) * (list->capacity > 0 ? list->capacity * 2 : 16));
+		if (files == NULL)
+		{
+			return NULL;
+		}
+		list->files = files;
+		list->capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+	}
+
+	file = &(list->files[list->count]);
+	memset(file, 0, sizeof(syncFile));
+	strncpy(file->filename, filename, NXT_FILENAME_LENGTH - 1);
+	file->size = size;
+	list->count += 1;
+
+	return file;
+}
+
+// The NXT ignores case in filenames.
+static syncFile* find_file(syncList* list, const char* filename)
+{
+	int	index;
+
+	index = 0;
+	while (index < list->count)
+	{
+		if (strcasecmp(list->files[index].filename, filename) == 0)
+		{
+			return &(list->files[index]);
+		}
+		index += 1;
+	}
+
+	return NULL;
+}
+
+static void set_failed(nxtSync* sync, const char* filename)
+{
+	strncpy(sync->failed, filename, NXT_FILENAME_LENGTH - 1);
+	sync->failed[NXT_FILENAME_LENGTH - 1] = 0;
+}
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "libnxtbt.h"
+
+// What has already been delivered from one file matching the pattern.
+typedef struct
+{
+	char	filename[NXT_FILENAME_LENGTH];
+	uint32_t	offset;	// bytes delivered so far
+	uint32_t	size;	// size reported by the last search
+	int	seen;
+} tailFile;
+
+struct nxtTail
+{
+	nxtConnection*	connection;
+	char	pattern[NXT_FILENAME_LENGTH];
+	int	record_length;
+	nxtTailCallback	callback;
+	void*	user_data;
+	tailFile*	files;
+	int	file_count;
+	int	file_capacity;
+	uint8_t*	buffer;	// the new part of the file being read
+	uint32_t	buffer_capacity;
+};
+
+// Progress through one file while it is being read.
+typedef struct
+{
+	nxtTail*	tail;
+	uint32_t	skip;
+	uint32_t	position;
+	uint32_t	length;
+} tailRead;
+
+static int find_files(nxtTail* tail);
+static int read_file(nxtTail* tail, tailFile* file);
+static int collect(const uint8_t* data, int length, void* user_data);
+static tailFile* find_entry(nxtTail* tail, const char* filename);
+static tailFile* add_entry(nxtTail* tail, const char* filename);
+
+// PUBLIC FUNCTIONS
+
+// Creates a reader for the files on the NXT matching pattern (as accepted by
+// NXT_CMD_FINDFIRST). If record_length is more than 1, only whole records are
+// passed to callback.
+nxtTail* nxtTailCreate(nxtConnection* connection, const char* pattern, int record_length, nxtTailCallback callback, void* user_data)
+{
+	nxtTail*	tail;
+
+	if (strlen(pattern) >= NXT_FILENAME_LENGTH || callback == NULL)
+	{
+		return NULL;
+	}
+
+	tail = calloc(1, sizeof(nxtTail));
+	if (tail == NULL)
+	{
+		return NULL;
+	}
+
+	tail->connection = connection;
+	strcpy(tail->pattern, pattern);
+	tail->record_length = record_length > 1 ? record_length : 1;
+	tail->callback = callback;
+	tail->user_data = user_data;
+
+	return tail;
+}
+
+void nxtTailDestroy(nxtTail* tail)
+{
+	if (tail == NULL)
+	{
+		return;
+	}
+
+	free(tail->files);
+	free(tail->buffer);
+	free(tail);
+}
+
+// Passes everything appended to the matching files since the last poll to the
+// callback. Returns the number of bytes passed or a negative nxtLibError.
+int nxtTailPoll(nxtTail* tail)
+{
+	tailFile*	file;
+	int	index;
+	int	delivered;
+	int	result;
+
+	result = find_files(tail);
+	if (result < 0)
+	{
+		return result;
+	}
+
+	delivered = 0;
+	index = 0;
+	while (index < tail->file_count)
+	{
+		file = &(tail->files[index]);
+		if (file->size >= file->offset + tail->record_length)
+		{
+			result = read_file(tail, file);
+			if (result < 0)
+			{
+				return result;
+			}
+			delivered += result;
+		}
+		index += 1;
+	}
+
+	return delivered;
+}
+
+// Returns the number of bytes of filename already passed to the callback.
+uint32_t nxtTailGetOffset(nxtTail* tail, const char* filename)
+{
+	tailFile*	file;
+
+	file = find_entry(tail, filename);
+
+	return file != NULL ? file->offset : 0;
+}
+
+// Sets the number of bytes of filename already passed to the callback, so that
+// a reader can carry on from where an earlier one stopped.
+int nxtTailSetOffset(nxtTail* tail, const char* filename, uint32_t offset)
+{
+	tailFile*	file;
+
+	if (strlen(filename) >= NXT_FILENAME_LENGTH)
+	{
+		return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+	}
+
+	file = find_entry(tail, filename);
+	if (file == NULL)
+	{
+		file = add_entry(tail, filename);
+		if (file == NULL)
+		{
+			return NXT_LIBERR_GENERAL;
+		}
+		file->seen = false;
+	}
+	file->offset = offset;
+
+	return 0;
+}
+
+// PRIVATE FUNCTIONS
+
+// Records the size of every matching file and forgets files that have gone.
+// A file that is smaller than what has already been delivered has been
+// replaced, so it is read again from the beginning.
+static int find_files(nxtTail* tail)
+{
+	nxtFileInfo	info;
+	nxtHandleReply	close_reply;
+	tailFile*	file;
+	int	index;
+	int	kept;
+	int	result;
+
+	index = 0;
+	while (index < tail->file_count)
+	{
+		tail->files[index].seen = false;
+		index += 1;
+	}
+
+	result = nxtFindFirst(tail->connection, tail->pattern, &info);
+	while (result >= 4 && info.status == NXT_STS_SUCCESS)
+	{
+		file = find_entry(tail, info.filename);
+		if (file == NULL)
+		{
+			file = add_entry(tail, info.filename);
+			if (file == NULL)
+			{
+				nxtCloseHandle(tail->connection, info.handle, &close_reply);
+				return NXT_LIBERR_GENERAL;
+			}
+		}
+		if (info.size < file->offset)
+		{
+			file->offset = 0;
+		}
+		file->size = info.size;
+		file->seen = true;
+
+		result = nxtFindNext(tail->connection, info.handle, &info);
+	}
+	if (result < 0)
+	{
+		return result;
+	}
+
+	// the NXT closes the search handle itself once nothing more is found
+	if (result >= 1 && info.status != NXT_STS_SUCCESS && info.status != NXT_STS_FILE_NOT_FOUND)
+	{
+		return NXT_LIBERR_STATUS;
+	}
+
+	index = 0;
+	kept = 0;
+	while (index < tail->file_count)
+	{
+		if (tail->files[index].seen == true)
+		{
+			tail->files[kept] = tail->files[index];
+			kept += 1;
+		}
+		index += 1;
+	}
+	tail->file_count = kept;
+
+	return 0;
+}
+
+// The NXT cannot read from the middle of a file, so everything before the
+// offset is read and thrown away; only the new part is kept and delivered.
+// Returns the number of bytes delivered or a negative nxtLibError.
+static int read_file(nxtTail* tail, tailFile* file)
+{
+	nxtTransfer	transfer;
+	tailRead	reading;
+	uint32_t	length;
+	uint8_t*	buffer;
+	int	result;
+
+	// the file may grow between the search and the read, so the buffer is
+	// sized from the search and anything beyond it is left for the next poll
+	length = file->size - file->offset;
+	length -= length % tail->record_length;
+	if (length > tail->buffer_capacity)
+	{
+		buffer = realloc(tail->buffer, length);
+		if (buffer == NULL)
+		{
+			return NXT_LIBERR_GENERAL;
+		}
+		tail->buffer = buffer;
+		tail->buffer_capacity = length;
+	}
+
+	reading.tail = tail;
+	reading.skip = file->offset;
+	reading.position = 0;
+	reading.length = length;
+
+	memset(&transfer, 0, sizeof(transfer));
+	result = nxtReadStream(tail->connection, file->filename, collect, &reading, &transfer);
+	if (result == NXT_LIBERR_STATUS && (transfer.status == NXT_STS_FILE_BUSY || transfer.status == NXT_STS_FILE_NOT_FOUND))
+	{
+		// still open for writing, or deleted since the search: try again next time
+		return 0;
+	}
+	if (result < 0)
+	{
+		return result;
+	}
+	if (transfer.size < file->offset + length)
+	{
+		// replaced by a smaller file since the search
+		file->offset = 0;
+		return 0;
+	}
+
+	// the offset only moves on once the callback has accepted the data
+	result = tail->callback(file->filename, tail->buffer, length, file->offset, tail->user_data);
+	if (result < 0)
+	{
+		return result;
+	}
+	file->offset += length;
+
+	return length;
+}
+
+static int collect(const uint8_t* data, int length, void* user_data)
+{
+	tailRead*	reading;
+	uint32_t	start;
+	uint32_t	end;
+
+	reading = user_data;
+	start = reading->position;
+	end = reading->position + length;
+	reading->position = end;
+
+	if (end <= reading->skip || start >= reading->skip + reading->length)
+	{
+		return 0;
+	}
+	if (start < reading->skip)
+	{
+		data += reading->skip - start;
+		start = reading->skip;
+	}
+	if (end > reading->skip + reading->length)
+	{
+		end = reading->skip + reading->length;
+	}
+
+	memcpy(reading->tail->buffer + (start - reading->skip), data, end - start);
+
+	return 0;
+}
+
+static tailFile* find_entry(nxtTail* tail, const char* filename)
+{
+	int	index;
+
+	index = 0;
+	while (index < tail->file_count)
+	{
+		if (strncmp(tail->files[index].filename, filename, NXT_FILENAME_LENGTH) == 0)
+		{
+			return &(tail->files[index]);
+		}
+		index += 1;
+	}
+
+	return NULL;
+}
+
+static tailFile* add_entry(nxtTail* tail, const char* filename)
+{
+	tailFile*	files;
+	tailFile*	file;
+
+	if (tail->file_count == tail->file_capacity)
+	{
+		files = realloc(tail->files, sizeof(tailFile) * (tail->file_capacity > 0 ? tail->file_capacity * 2 : 8));
+		if (files == NULL)
+		{
+			return NULL;
+		}
+		tail->files = files;
+		tail->file_capacity = tail->file_capacity > 0 ? tail->file_capacity * 2 : 8;
+	}
+
+	file = &(tail->files[tail->file_count]);
+	memset(file, 0, sizeof(tailFile));
+	strncpy(file->filename, filename, NXT_FILENAME_LENGTH - 1);
+	tail->file_count += 1;
+
+	return file;
+}
@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include <byteswap.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+#include "template.h"
+
+static int compile_fields(templateField compiled[], const nxtField fields[], int field_count, int position);
+static int tail_length(const templateTail* tail, const uint8_t* values);
+static int field_width(const nxtField* field);
+static void swap_field(uint8_t* value, int swap);
+
+// PUBLIC FUNCTIONS
+
+nxtTemplate* nxtTemplateCreate(nxtCommand command, const nxtField parameters[], int parameter_count, const nxtField responses[], int response_count)
+{
+	nxtTemplate*	command_template;
+	templateTail	fixed;
+
+	command_template = malloc(sizeof(nxtTemplate));
+	if (command_template == NULL)
+	{
+		return NULL;
+	}
+
+	fixed.offset = 0;
+	fixed.width = 0;
+	if (template_compile(command_template, command, parameters, parameter_count, fixed, responses, response_count, fixed) == false)
+	{
+		free(command_template);
+		return NULL;
+	}
+
+	return command_template;
+}
+
+void nxtTemplateDestroy(nxtTemplate* command_template)
+{
+	free(command_template);
+}
+
+// LIBRARY FUNCTIONS
+
+// Fills in command_template from the description of a command. Returns false if
+// a field is invalid.
+int template_compile(nxtTemplate* command_template, nxtCommand command, const nxtField parameters[], int parameter_count, templateTail parameter_tail, const nxtField responses[], int response_count, templateTail response_tail)
+{
+	if (parameter_count < 0 || parameter_count > NXT_TEMPLATE_FIELDS_MAX || response_count < 0 || response_count > NXT_TEMPLATE_FIELDS_MAX)
+	{
+		return false;
+	}
+	if ((parameter_tail.width > 0 && parameter_count == 0) || (response_tail.width > 0 && response_count == 0))
+	{
+		return false;
+	}
+
+	// both packets start with two bytes (command type or 0x02, then the command)
+	command_template->command = command;
+	command_template->parameter_count = parameter_count;
+	command_template->parameter_length = compile_fields(command_template->parameters, parameters, parameter_count, 2);
+	command_template->parameter_tail = parameter_tail;
+	command_template->response_count = response_count;
+	command_template->response_length = compile_fields(command_template->responses, responses, response_count, 2);
+	command_template->response_tail = response_tail;
+	if (command_template->parameter_length < 0 || command_template->parameter_length > NXT_FRAME_MAX_LENGTH || command_template->response_length < 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// Encodes a complete packet (length prefix and body) into frame from the
+// structure at parameters. Returns the body length or a negative nxtLibError.
+int template_encode(const nxtTemplate* command_template, uint8_t* frame, bool reply, const void* parameters)
+{
+	const templateField*	field;
+	uint8_t*	body;
+	int	field_count;
+	int	field_index;
+	int	length;
+
+	body = frame + NXT_FRAME_HEADER_LENGTH;
+
+	body[0] = (command_template->command < 0x80 ? 0x00 : 0x01) | (reply ? 0x00 : 0x80);
+	body[1] = command_template->command;
+
+	field_count = command_template->parameter_count;
+	length = command_template->parameter_length;
+	if (command_template->parameter_tail.width > 0)
+	{
+		field_count -= 1;
+		field = &(command_template->parameters[field_count]);
+		length = tail_length(&(command_template->parameter_tail), parameters);
+		if (length > field->width)
+		{
+			return NXT_LIBERR_PARAMETER_CANNOT_ADD;
+		}
+
+		memcpy(body + field->position, (const uint8_t*) parameters + field->offset, length);
+		length += field->position;
+	}
+
+	field_index = 0;
+	while (field_index < field_count)
+	{
+		field = &(command_template->parameters[field_index]);
+		memcpy(body + field->position, (const uint8_t*) parameters + field->offset, field->width);
+		swap_field(body + field->position, field->swap);
+		field_index += 1;
+	}
+
+	codec_write_length(frame, length);
+
+	return length;
+}
+
+// Decodes a response packet body into the structure at responses. As with
+// codec_decode_response, a short response (such as an error status on its own)
+// fills in as many fields as it contains. Returns the number of fields filled
+// in or a negative nxtLibError.
+int template_decode(const nxtTemplate* command_template, const uint8_t* body, int length, void* responses)
+{
+	const templateField*	field;
+	int	field_count;
+	int	field_index;
+	int	data_length;
+
+	if (length < 2)
+	{
+		return NXT_LIBERR_RESPONSE_TOO_SHORT;
+	}
+	if (body[0] != 0x02)
+	{
+		return NXT_LIBERR_RESPONSE_HEADER_INCORRECT;
+	}
+	if (body[1] != command_template->command)
+	{
+		return NXT_LIBERR_RESPONSE_COMMAND_MISMATCH;
+	}
+	if (length > command_template->response_length)
+	{
+		return NXT_LIBERR_RESPONSE_CANNOT_ADD;
+	}
+
+	field_count = command_template->response_count;
+	if (command_template->response_tail.width > 0)
+	{
+		field_count -= 1;
+	}
+
+	field_index = 0;
+	while (field_index < field_count)
+	{
+		field = &(command_template->responses[field_index]);
+		if (field->position + field->width > length)
+		{
+			break;
+		}
+
+		memcpy((uint8_t*) responses + field->offset, body + field->position, field->width);
+		swap_field((uint8_t*) responses + field->offset, field->swap);
+		field_index += 1;
+	}
+
+	if (field_index < field_count)
+	{
+		if (command_template->responses[field_index].position < length)
+		{
+			// the packet ends part way through a field
+			return NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+		}
+
+		return field_index;
+	}
+
+	if (field_count < command_template->response_count)
+	{
+		// the length of the last field has just been decoded
+		field = &(command_template->responses[field_count]);
+		data_length = tail_length(&(command_template->response_tail), responses);
+		if (data_length > field->width || field->position + data_length < length)
+		{
+			return NXT_LIBERR_RESPONSE_CANNOT_ADD;
+		}
+		if (field->position + data_length > length)
+		{
+			return NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+		}
+
+		memcpy((uint8_t*) responses + field->offset, body + field->position, data_length);
+		field_index += 1;
+	}
+
+	return field_index;
+}
+
+// PRIVATE FUNCTIONS
+
+// Lays out fields one after another from position. Returns the position after
+// the last field or -1 if a field is invalid.
+static int compile_fields(templateField compiled[], const nxtField fields[], int field_count, int position)
+{
+	int	field_index;
+	int	width;
+
+	field_index = 0;
+	while (field_index < field_count)
+	{
+		width = field_width(&(fields[field_index]));
+		if (width <= 0 || fields[field_index].offset < 0)
+		{
+			return -1;
+		}
+
+		compiled[field_index].position = position;
+		compiled[field_index].offset = fields[field_index].offset;
+		compiled[field_index].width = width;
+		compiled[field_index].swap = 0;
+		if (fields[field_index].type == NXT_TYPE_UWORD || fields[field_index].type == NXT_TYPE_SWORD || fields[field_index].type == NXT_TYPE_ULONG || fields[field_index].type == NXT_TYPE_SLONG)
+		{
+			compiled[field_index].swap = width;
+		}
+
+		position += width;
+		field_index += 1;
+	}
+
+	return position;
+}
+
+static int tail_length(const templateTail* tail, const uint8_t* values)
+{
+	uint16_t	length;
+
+	if (tail->width == 1)
+	{
+		return values[tail->offset];
+	}
+
+	memcpy(&length, values + tail->offset, 2);
+
+	return length;
+}
+
+static int field_width(const nxtField* field)
+{
+	switch (field->type)
+	{
+		case NXT_TYPE_BOOLEAN:
+		case NXT_TYPE_UBYTE:
+		case NXT_TYPE_SBYTE:
+			return 1;
+		case NXT_TYPE_UWORD:
+		case NXT_TYPE_SWORD:
+			return 2;
+		case NXT_TYPE_ULONG:
+		case NXT_TYPE_SLONG:
+			return 4;
+		case NXT_TYPE_FILENAME:
+			return 20;
+		case NXT_TYPE_BYTES:
+		case NXT_TYPE_STRING:
+			return field->length;
+		case NXT_TYPE_BUFFER:
+			break;
+	}
+
+	return -1;
+}
+
+// Converts a value between host and packet byte order in place. The packet is
+// little-endian, so this compiles to nothing on little-endian hosts.
+static void swap_field(uint8_t* value, int swap)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+	uint16_t	word;
+	uint32_t	long_word;
+
+	if (swap == 2)
+	{
+		memcpy(&word, value, 2);
+		word = bswap_16(word);
+		memcpy(value, &word, 2);
+	}
+	else if (swap == 4)
+	{
+		memcpy(&long_word, value, 4);
+		long_word = bswap_32(long_word);
+		memcpy(value, &long_word, 4);
+	}
+#endif
+}
@@ -0,0 +1,47 @@
+#ifndef _template_h_
+#define _template_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libnxtbt.h"
+
+// A field resolved to its position in the packet. Offsets into the caller's
+// structure and into the packet are both fixed, so encoding and decoding a
+// field is a single copy (plus a byte swap for words on big-endian hosts).
+typedef struct
+{
+	int	position;	// offset of the value in the packet body
+	int	offset;	// offset of the value in the caller's structure
+	int	width;
+	int	swap;	// width of the integer to byte swap on big-endian hosts, or 0
+} templateField;
+
+// Describes a variable-length last field: the number of bytes actually used is
+// held in an integer of the given width at offset in the caller's structure
+// (which may or may not also be one of the fields), and the width of the field
+// itself is the maximum.
+typedef struct
+{
+	int	offset;
+	int	width;	// 1 or 2, or 0 if the last field has a fixed length
+} templateTail;
+
+struct nxtTemplate
+{
+	nxtCommand	command;
+	int	parameter_length;	// body length of the command packet (at most, if the last field is variable)
+	int	parameter_count;
+	templateField	parameters[NXT_TEMPLATE_FIELDS_MAX];
+	templateTail	parameter_tail;
+	int	response_length;	// body length of a complete response packet (likewise)
+	int	response_count;
+	templateField	responses[NXT_TEMPLATE_FIELDS_MAX];
+	templateTail	response_tail;
+};
+
+int template_compile(nxtTemplate* command_template, nxtCommand command, const nxtField parameters[], int parameter_count, templateTail parameter_tail, const nxtField responses[], int response_count, templateTail response_tail);
+int template_encode(const nxtTemplate* command_template, uint8_t* frame, bool reply, const void* parameters);
+int template_decode(const nxtTemplate* command_template, const uint8_t* body, int length, void* responses);
+
+#endif
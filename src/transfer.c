@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libnxtbt.h"
+#include "codec.h"
+#include "connection.h"
+#include "stats.h"
+
+#define TRANSFER_WINDOW_INITIAL 2	// chunks in flight before the first round trip has been measured
+
+// One READ or WRITE in flight. Its parameters and responses point straight
+// into the data being transferred, so nothing is copied except between the
+// packet and the caller's memory.
+typedef struct
+{
+	nxtRequest	request;
+	nxtParameter	parameters[2];
+	nxtResponse	responses[4];
+	uint64_t	sent;
+	int	length;
+} transferChunk;
+
+// Where a download goes: straight into buffer if it is set, otherwise through
+// a staging area of one chunk per pipeline slot into sink.
+typedef struct
+{
+	uint8_t*	buffer;
+	uint32_t	capacity;
+	nxtSink	sink;
+	void*	user_data;
+} transferDestination;
+
+typedef struct
+{
+	int	fd;
+} transferFile;
+
+static int download(nxtConnection* connection, const char* filename, transferDestination* destination, nxtTransfer* transfer);
+static int download_chunks(nxtConnection* connection, uint8_t handle, uint32_t size, int chunk_size, transferDestination* destination, nxtTransfer* transfer, uint64_t started);
+static int write_to_file(const uint8_t* data, int length, void* user_data);
+static int open_for_upload(nxtConnection* connection, const char* filename, uint32_t size, uint8_t* handle, nxtTransfer* transfer);
+static int upload_chunks(nxtConnection* connection, uint8_t handle, const uint8_t* data, uint32_t size, int chunk_size, nxtTransfer* transfer, uint64_t started);
+static nxtCommand upload_command(const char* filename);
+static int connection_depth(nxtConnection* connection);
+static int adapt_window(int window, int depth, uint64_t rtt, uint64_t* min_rtt);
+static void reset_transfer(nxtTransfer* transfer);
+static void finish_transfer(nxtTransfer* transfer, uint64_t started);
+static void report_progress(nxtTransfer* transfer, uint32_t total, uint64_t started);
+
+// PUBLIC FUNCTIONS
+
+// Uploads the local file at path to the NXT as filename (or the last component
+// of path if filename is NULL), replacing any existing file of that name.
+int nxtUploadFile(nxtConnection* connection, const char* path, const char* filename, nxtTransfer* transfer)
+{
+	nxtTransfer	defaults;
+	nxtHandleReply	close_reply;
+	struct stat	file_status;
+	uint8_t*	data;
+	uint64_t	started;
+	uint8_t	handle;
+	int	chunk_size;
+	int	file;
+	int	result;
+
+	if (transfer == NULL)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		transfer = &defaults;
+	}
+	reset_transfer(transfer);
+
+	chunk_size = transfer->chunk_size > 0 ? transfer->chunk_size : NXT_WRITE_DATA_MAX;
+	if (chunk_size > NXT_FRAME_MAX_LENGTH - 3)
+	{
+		chunk_size = NXT_FRAME_MAX_LENGTH - 3;
+	}
+	if (filename == NULL)
+	{
+		filename = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+	}
+
+	file = open(path, O_RDONLY);
+	if (file < 0)
+	{
+		return NXT_LIBERR_FILE;
+	}
+	if (fstat(file, &file_status) < 0 || file_status.st_size > UINT32_MAX)
+	{
+		close(file);
+		return NXT_LIBERR_FILE;
+	}
+
+	// the file is sent straight from the page cache
+	data = NULL;
+	if (file_status.st_size > 0)
+	{
+		data = mmap(NULL, file_status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED)
+		{
+			close(file);
+			return NXT_LIBERR_FILE;
+		}
+		madvise(data, file_status.st_size, MADV_SEQUENTIAL);
+	}
+	close(file);
+
+	transfer->size = file_status.st_size;
+	started = stats_now();
+
+	result = open_for_upload(connection, filename, file_status.st_size, &handle, transfer);
+	if (result == 0)
+	{
+		result = upload_chunks(connection, handle, data, file_status.st_size, chunk_size, transfer, started);
+
+		// the handle is closed even if the upload failed, so that it is not leaked on the NXT
+		if (nxtCloseHandle(connection, handle, &close_reply) >= 1 && close_reply.status != NXT_STS_SUCCESS && result == 0)
+		{
+			transfer->status = close_reply.status;
+			result = NXT_LIBERR_STATUS;
+		}
+	}
+
+	finish_transfer(transfer, started);
+
+	if (data != NULL)
+	{
+		munmap(data, file_status.st_size);
+	}
+
+	return result;
+}
+
+// Downloads filename from the NXT and writes it to fd from its current offset.
+int nxtDownloadFile(nxtConnection* connection, const char* filename, int fd, nxtTransfer* transfer)
+{
+	transferDestination	destination;
+	transferFile	file;
+
+	file.fd = fd;
+	destination.buffer = NULL;
+	destination.capacity = 0;
+	destination.sink = write_to_file;
+	destination.user_data = &file;
+
+	return download(connection, filename, &destination, transfer);
+}
+
+// Downloads filename from the NXT into buffer, which must hold the whole file.
+// The number of bytes read is left in transfer->bytes.
+int nxtDownloadBuffer(nxtConnection* connection, const char* filename, uint8_t* buffer, uint32_t capacity, nxtTransfer* transfer)
+{
+	transferDestination	destination;
+
+	destination.buffer = buffer;
+	destination.capacity = capacity;
+	destination.sink = NULL;
+	destination.user_data = NULL;
+
+	return download(connection, filename, &destination, transfer);
+}
+
+// Downloads filename from the NXT, passing it to sink a chunk at a time.
+int nxtReadStream(nxtConnection* connection, const char* filename, nxtSink sink, void* user_data, nxtTransfer* transfer)
+{
+	transferDestination	destination;
+
+	destination.buffer = NULL;
+	destination.capacity = 0;
+	destination.sink = sink;
+	destination.user_data = user_data;
+
+	return download(connection, filename, &destination, transfer);
+}
+
+// PRIVATE FUNCTIONS
+
+static int download(nxtConnection* connection, const char* filename, transferDestination* destination, nxtTransfer* transfer)
+{
+	nxtTransfer	defaults;
+	nxtOpenReadReply	open_reply;
+	nxtHandleReply	close_reply;
+	uint64_t	started;
+	int	chunk_size;
+	int	result;
+
+	if (transfer == NULL)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		transfer = &defaults;
+	}
+	reset_transfer(transfer);
+
+	// a READ reply carries 6 bytes besides the data
+	chunk_size = transfer->chunk_size > 0 ? transfer->chunk_size : NXT_READ_DATA_MAX;
+	if (chunk_size > NXT_FRAME_MAX_LENGTH - 6)
+	{
+		chunk_size = NXT_FRAME_MAX_LENGTH - 6;
+	}
+
+	started = stats_now();
+
+	result = nxtOpenRead(connection, filename, &open_reply);
+	if (result < 0)
+	{
+		return result;
+	}
+	if (result >= 1 && open_reply.status != NXT_STS_SUCCESS)
+	{
+		transfer->status = open_reply.status;
+		return NXT_LIBERR_STATUS;
+	}
+	if (result < 3)
+	{
+		return NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+	}
+	transfer->size = open_reply.size;
+
+	if (destination->buffer != NULL && open_reply.size > destination->capacity)
+	{
+		result = NXT_LIBERR_TOO_LARGE;
+	}
+	else
+	{
+		result = download_chunks(connection, open_reply.handle, open_reply.size, chunk_size, destination, transfer, started);
+	}
+
+	// the handle is closed even if the download failed, so that it is not leaked on the NXT
+	if (nxtCloseHandle(connection, open_reply.handle, &close_reply) >= 1 && close_reply.status != NXT_STS_SUCCESS && result == 0)
+	{
+		transfer->status = close_reply.status;
+		result = NXT_LIBERR_STATUS;
+	}
+
+	finish_transfer(transfer, started);
+
+	return result;
+}
+
+// Receives the file in READ commands of chunk_size bytes, with the window
+// adapted as for uploads. Each reply is decoded straight into its place in the
+// caller's buffer, or into a staging slot that is handed to the sink once all
+// the chunks before it have been.
+static int download_chunks(nxtConnection* connection, uint8_t handle, uint32_t size, int chunk_size, transferDestination* destination, nxtTransfer* transfer, uint64_t started)
+{
+	transferChunk	chunks[NXT_PIPELINE_DEPTH_MAX];
+	transferChunk*	chunk;
+	uint8_t*	staging;
+	uint64_t	min_rtt;
+	uint32_t	offset;
+	int	depth;
+	int	window;
+	int	head;
+	int	count;
+	int	result;
+	int	reply_count;
+
+	depth = connection_depth(connection);
+	window = depth < TRANSFER_WINDOW_INITIAL ? depth : TRANSFER_WINDOW_INITIAL;
+	min_rtt = UINT64_MAX;
+
+	// chunks are consumed in order and no more than depth are in flight, so a
+	// slot per pipeline entry is never reused before it has been consumed
+	staging = NULL;
+	if (destination->buffer == NULL && size > 0)
+	{
+		staging = malloc((size_t) depth * chunk_size);
+		if (staging == NULL)
+		{
+			return NXT_LIBERR_GENERAL;
+		}
+	}
+
+	offset = 0;
+	head = 0;
+	count = 0;
+	result = 0;
+
+	while ((result == 0 && offset < size) || count > 0)
+	{
+		while (result == 0 && offset < size && count < window)
+		{
+			chunk = &(chunks[(head + count) % NXT_PIPELINE_DEPTH_MAX]);
+			chunk->length = size - offset > chunk_size ? chunk_size : size - offset;
+
+			chunk->parameters[0].type = NXT_TYPE_UBYTE;
+			chunk->parameters[0].value.ubyte = handle;
+			chunk->parameters[1].type = NXT_TYPE_UWORD;
+			chunk->parameters[1].value.uword = chunk->length;
+			chunk->responses[0].type = NXT_TYPE_UBYTE;
+			chunk->responses[1].type = NXT_TYPE_UBYTE;
+			chunk->responses[2].type = NXT_TYPE_UWORD;
+			chunk->responses[3].type = NXT_TYPE_BUFFER;
+			if (staging != NULL)
+			{
+				chunk->responses[3].value.bytes = staging + ((offset / chunk_size) % depth) * chunk_size;
+			}
+			else
+			{
+				chunk->responses[3].value.bytes = destination->buffer + offset;
+			}
+			chunk->responses[3].length = chunk->length;
+			chunk->request.command = NXT_CMD_READ;
+			chunk->request.parameters = chunk->parameters;
+			chunk->request.responses = chunk->responses;
+			chunk->request.parameter_count = 2;
+			chunk->request.response_count = 4;
+			chunk->sent = stats_now();
+
+			nxtConnSubmit(connection, &(chunk->request));
+			offset += chunk->length;
+			count += 1;
+		}
+
+		chunk = &(chunks[head]);
+		reply_count = nxtConnWait(connection, &(chunk->request));
+		head = (head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		count -= 1;
+		if (result != 0)
+		{
+			// draining the window after a failure
+			continue;
+		}
+
+		if (reply_count < 0)
+		{
+			result = reply_count;
+			continue;
+		}
+		if (reply_count >= 1 && chunk->responses[0].value.ubyte != NXT_STS_SUCCESS)
+		{
+			transfer->status = chunk->responses[0].value.ubyte;
+			result = NXT_LIBERR_STATUS;
+			continue;
+		}
+		if (reply_count < 4 || chunk->responses[3].length != chunk->length)
+		{
+			// the file cannot shrink while it is open, so a short read is malformed
+			result = NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+			continue;
+		}
+
+		if (staging != NULL)
+		{
+			result = destination->sink(chunk->responses[3].value.bytes, chunk->length, destination->user_data);
+			if (result != 0)
+			{
+				continue;
+			}
+		}
+
+		transfer->bytes += chunk->length;
+		report_progress(transfer, size, started);
+		window = adapt_window(window, depth, stats_now() - chunk->sent, &min_rtt);
+	}
+
+	free(staging);
+
+	return result;
+}
+
+static int write_to_file(const uint8_t* data, int length, void* user_data)
+{
+	transferFile*	file;
+	ssize_t	written;
+
+	file = user_data;
+	while (length > 0)
+	{
+		written = write(file->fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return NXT_LIBERR_FILE;
+		}
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+static int open_for_upload(nxtConnection* connection, const char* filename, uint32_t size, uint8_t* handle, nxtTransfer* transfer)
+{
+	nxtHandleReply	reply;
+	nxtFilenameReply	delete_reply;
+	nxtCommand	command;
+	int	attempt;
+	int	result;
+
+	command = upload_command(filename);
+
+	attempt = 0;
+	while (true)
+	{
+		switch (command)
+		{
+			case NXT_CMD_OPENWRITELINEAR:
+				result = nxtOpenWriteLinear(connection, filename, size, &reply);
+				break;
+			case NXT_CMD_OPENWRITEDATA:
+				result = nxtOpenWriteData(connection, filename, size, &reply);
+				break;
+			default:
+				result = nxtOpenWrite(connection, filename, size, &reply);
+				break;
+		}
+		if (result < 0)
+		{
+			return result;
+		}
+		if (result >= 2 && reply.status == NXT_STS_SUCCESS)
+		{
+			*handle = reply.handle;
+			return 0;
+		}
+		if (result < 1 || reply.status == NXT_STS_SUCCESS)
+		{
+			// too short to hold the status, or successful without the handle
+			return NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+		}
+		if (reply.status != NXT_STS_FILE_EXISTS || attempt > 0)
+		{
+			transfer->status = reply.status;
+			return NXT_LIBERR_STATUS;
+		}
+
+		// the NXT cannot overwrite a file, so replace it
+		nxtDelete(connection, filename, &delete_reply);
+		attempt += 1;
+	}
+}
+
+// Sends the data in WRITE commands of chunk_size bytes, keeping a window of
+// them in flight. The window is adjusted after every reply in the same way as
+// TCP Vegas: the difference between the window and the number of chunks that
+// the fastest round trip seen so far would sustain is the number of chunks
+// queued in the link, which should be kept between one and two. Any more only
+// adds latency; any fewer leaves the link idle between replies.
+static int upload_chunks(nxtConnection* connection, uint8_t handle, const uint8_t* data, uint32_t size, int chunk_size, nxtTransfer* transfer, uint64_t started)
+{
+	transferChunk	chunks[NXT_PIPELINE_DEPTH_MAX];
+	transferChunk*	chunk;
+	uint64_t	min_rtt;
+	uint32_t	offset;
+	int	depth;
+	int	window;
+	int	head;
+	int	count;
+	int	result;
+	int	reply_count;
+
+	depth = connection_depth(connection);
+	window = depth < TRANSFER_WINDOW_INITIAL ? depth : TRANSFER_WINDOW_INITIAL;
+	min_rtt = UINT64_MAX;
+	offset = 0;
+	head = 0;
+	count = 0;
+	result = 0;
+
+	while ((result == 0 && offset < size) || count > 0)
+	{
+		while (result == 0 && offset < size && count < window)
+		{
+			chunk = &(chunks[(head + count) % NXT_PIPELINE_DEPTH_MAX]);
+			chunk->length = size - offset > chunk_size ? chunk_size : size - offset;
+
+			chunk->parameters[0].type = NXT_TYPE_UBYTE;
+			chunk->parameters[0].value.ubyte = handle;
+			chunk->parameters[1].type = NXT_TYPE_BYTES;
+			chunk->parameters[1].value.bytes = (uint8_t*) data + offset;
+			chunk->parameters[1].length = chunk->length;
+			chunk->responses[0].type = NXT_TYPE_UBYTE;
+			chunk->responses[1].type = NXT_TYPE_UBYTE;
+			chunk->responses[2].type = NXT_TYPE_UWORD;
+			chunk->request.command = NXT_CMD_WRITE;
+			chunk->request.parameters = chunk->parameters;
+			chunk->request.responses = chunk->responses;
+			chunk->request.parameter_count = 2;
+			chunk->request.response_count = 3;
+			chunk->sent = stats_now();
+
+			nxtConnSubmit(connection, &(chunk->request));
+			offset += chunk->length;
+			count += 1;
+		}
+
+		chunk = &(chunks[head]);
+		reply_count = nxtConnWait(connection, &(chunk->request));
+		head = (head + 1) % NXT_PIPELINE_DEPTH_MAX;
+		count -= 1;
+		if (result != 0)
+		{
+			// draining the window after a failure
+			continue;
+		}
+
+		if (reply_count < 0)
+		{
+			result = reply_count;
+			continue;
+		}
+		if (reply_count >= 1 && chunk->responses[0].value.ubyte != NXT_STS_SUCCESS)
+		{
+			transfer->status = chunk->responses[0].value.ubyte;
+			result = NXT_LIBERR_STATUS;
+			continue;
+		}
+		if (reply_count < 3)
+		{
+			result = NXT_LIBERR_RESPONSE_TYPE_MISMATCH;
+			continue;
+		}
+
+		transfer->bytes += chunk->length;
+		report_progress(transfer, size, started);
+		window = adapt_window(window, depth, stats_now() - chunk->sent, &min_rtt);
+	}
+
+	return result;
+}
+
+// Linear files are required for programs and other files that the firmware
+// uses in place, and data files can be appended to later; anything else is
+// uploaded as a normal file.
+static nxtCommand upload_command(const char* filename)
+{
+	static const char*	linear[] = { "rxe", "rtm", "sys", "ric", "rpg", NULL };
+	static const char*	data[] = { "rdt", "log", NULL };
+	const char*	extension;
+	int	index;
+
+	extension = strrchr(filename, '.');
+	if (extension == NULL)
+	{
+		return NXT_CMD_OPENWRITE;
+	}
+	extension += 1;
+
+	index = 0;
+	while (linear[index] != NULL)
+	{
+		if (strcasecmp(extension, linear[index]) == 0)
+		{
+			return NXT_CMD_OPENWRITELINEAR;
+		}
+		index += 1;
+	}
+	index = 0;
+	while (data[index] != NULL)
+	{
+		if (strcasecmp(extension, data[index]) == 0)
+		{
+			return NXT_CMD_OPENWRITEDATA;
+		}
+		index += 1;
+	}
+
+	return NXT_CMD_OPENWRITE;
+}
+
+static int connection_depth(nxtConnection* connection)
+{
+	int	depth;
+
+	pthread_mutex_lock(&connection->lock);
+	depth = connection->pipeline_depth;
+	pthread_mutex_unlock(&connection->lock);
+
+	return depth;
+}
+
+static int adapt_window(int window, int depth, uint64_t rtt, uint64_t* min_rtt)
+{
+	double	queued;
+
+	if (rtt < *min_rtt)
+	{
+		*min_rtt = rtt;
+	}
+	if (rtt == 0)
+	{
+		return window;
+	}
+
+	queued = window - window * ((double) *min_rtt / rtt);
+	if (queued < 1 && window < depth)
+	{
+		return window + 1;
+	}
+	if (queued > 2 && window > 1)
+	{
+		return window - 1;
+	}
+
+	return window;
+}
+
+static void reset_transfer(nxtTransfer* transfer)
+{
+	transfer->size = 0;
+	transfer->bytes = 0;
+	transfer->elapsed = 0;
+	transfer->bytes_per_second = 0;
+	transfer->status = NXT_STS_SUCCESS;
+}
+
+static void finish_transfer(nxtTransfer* transfer, uint64_t started)
+{
+	transfer->elapsed = stats_now() - started;
+	if (transfer->elapsed > 0)
+	{
+		transfer->bytes_per_second = transfer->bytes / (transfer->elapsed / 1e9);
+	}
+}
+
+static void report_progress(nxtTransfer* transfer, uint32_t total, uint64_t started)
+{
+	uint64_t	elapsed;
+
+	if (transfer->progress == NULL)
+	{
+		return;
+	}
+
+	elapsed = stats_now() - started;
+	transfer->progress(transfer->bytes, total, elapsed > 0 ? transfer->bytes / (elapsed / 1e9) : 0, transfer->user_data);
+}
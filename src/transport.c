@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "libnxtbt.h"
+#include "transport.h"
+
+#define TRANSPORT_RFCOMM_PROTOCOL 3	// BTPROTO_RFCOMM
+#define TRANSPORT_RFCOMM_CHANNEL 1	// the NXT's serial port profile
+
+// The kernel's RFCOMM socket address, declared here so that libnxtbt does not
+// need the BlueZ headers. The Bluetooth address is stored last byte first.
+typedef struct
+{
+	sa_family_t	family;
+	uint8_t	address[6];
+	uint8_t	channel;
+} transportRfcommAddress;
+
+static int open_tty(const char* address);
+static int open_rfcomm(const char* address);
+static int open_unix(const char* address);
+static int open_tcp(const char* address);
+static int connect_socket(int domain, int protocol, const struct sockaddr* address, socklen_t address_length);
+static ssize_t read_descriptor(int descriptor, void* buffer, size_t length);
+static ssize_t write_descriptor(int descriptor, const void* buffer, size_t length);
+static ssize_t write_socket(int descriptor, const void* buffer, size_t length);
+static void close_descriptor(int descriptor);
+
+// The first entry is also used for device strings without a known prefix, so
+// that a plain path still names a serial device.
+static const transportBackend	mBackends[] =
+{
+	{ "tty:", open_tty, read_descriptor, write_descriptor, close_descriptor },
+	{ "rfcomm:", open_rfcomm, read_descriptor, write_socket, close_descriptor },
+	{ "unix:", open_unix, read_descriptor, write_socket, close_descriptor },
+	{ "tcp:", open_tcp, read_descriptor, write_socket, close_descriptor },
+};
+
+// LIBRARY FUNCTIONS
+
+// Returns the transport for device, and in address the part of device that
+// the transport's open function takes.
+const transportBackend* transport_find(const char* device, const char** address)
+{
+	size_t	index;
+	size_t	length;
+
+	index = 0;
+	while (index < sizeof(mBackends) / sizeof(mBackends[0]))
+	{
+		length = strlen(mBackends[index].prefix);
+		if (strncmp(device, mBackends[index].prefix, length) == 0)
+		{
+			*address = device + length;
+			return &(mBackends[index]);
+		}
+		index += 1;
+	}
+
+	*address = device;
+
+	return &(mBackends[0]);
+}
+
+// PRIVATE FUNCTIONS
+
+// A serial device such as one bound with rfcomm bind, in raw mode.
+static int open_tty(const char* address)
+{
+	struct termios	port_settings;
+	int	port;
+
+	port = open(address, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
+	if (port < 0)
+	{
+		return -1;
+	}
+	tcgetattr(port, &port_settings);
+	port_settings.c_iflag = 0;
+	port_settings.c_oflag = 0;
+	port_settings.c_cflag = 0;
+	port_settings.c_lflag = 0;
+	port_settings.c_cc[VTIME] = 1;
+	port_settings.c_cc[VMIN] = 1;
+	tcflush(port, TCIFLUSH);
+	tcsetattr(port, TCSANOW, &port_settings);
+
+	return port;
+}
+
+// A Bluetooth address such as 00:16:53:01:02:03, optionally followed by
+// /channel.
+static int open_rfcomm(const char* address)
+{
+	transportRfcommAddress	rfcomm;
+	unsigned int	octets[6];
+	unsigned int	channel;
+	int	index;
+	int	fields;
+
+	channel = TRANSPORT_RFCOMM_CHANNEL;
+	fields = sscanf(address, "%2x:%2x:%2x:%2x:%2x:%2x/%u", &octets[0], &octets[1], &octets[2], &octets[3], &octets[4], &octets[5], &channel);
+	if (fields < 6 || channel < 1 || channel > 30)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&rfcomm, 0, sizeof(rfcomm));
+	rfcomm.family = AF_BLUETOOTH;
+	index = 0;
+	while (index < 6)
+	{
+		rfcomm.address[index] = octets[5 - index];
+		index += 1;
+	}
+	rfcomm.channel = channel;
+
+	return connect_socket(AF_BLUETOOTH, TRANSPORT_RFCOMM_PROTOCOL, (struct sockaddr*) &rfcomm, sizeof(rfcomm));
+}
+
+// The path of a Unix-domain stream socket.
+static int open_unix(const char* address)
+{
+	struct sockaddr_un	local;
+
+	if (strlen(address) >= sizeof(local.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	strcpy(local.sun_path, address);
+
+	return connect_socket(AF_UNIX, 0, (struct sockaddr*) &local, sizeof(local));
+}
+
+// host:port, with an IPv6 host in brackets.
+static int open_tcp(const char* address)
+{
+	struct addrinfo	hints;
+	struct addrinfo*	addresses;
+	struct addrinfo*	candidate;
+	char*	host;
+	char*	service;
+	int	descriptor;
+	int	enabled;
+
+	host = strdup(address);
+	if (host == NULL)
+	{
+		return -1;
+	}
+	service = strrchr(host, ':');
+	if (service == NULL)
+	{
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*service = 0;
+	service += 1;
+	if (host[0] == '[' && service - host >= 3 && service[-2] == ']')
+	{
+		service[-2] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+	{
+		free(host);
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	free(host);
+
+	descriptor = -1;
+	candidate = addresses;
+	while (descriptor < 0 && candidate != NULL)
+	{
+		descriptor = connect_socket(candidate->ai_family, candidate->ai_protocol, candidate->ai_addr, candidate->ai_addrlen);
+		candidate = candidate->ai_next;
+	}
+	freeaddrinfo(addresses);
+
+	// packets are small and each one is written whole, so waiting to fill a
+	// segment would only add latency
+	if (descriptor >= 0)
+	{
+		enabled = 1;
+		setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+	}
+
+	return descriptor;
+}
+
+// Connects a stream socket, waiting for the connection to be made, and makes
+// it non-blocking.
+static int connect_socket(int domain, int protocol, const struct sockaddr* address, socklen_t address_length)
+{
+	int	descriptor;
+	int	error;
+
+	descriptor = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, protocol);
+	if (descriptor < 0)
+	{
+		return -1;
+	}
+	if (connect(descriptor, address, address_length) < 0)
+	{
+		error = errno;
+		close(descriptor);
+		errno = error;
+		return -1;
+	}
+	fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+
+	return descriptor;
+}
+
+static ssize_t read_descriptor(int descriptor, void* buffer, size_t length)
+{
+	return read(descriptor, buffer, length);
+}
+
+static ssize_t write_descriptor(int descriptor, const void* buffer, size_t length)
+{
+	return write(descriptor, buffer, length);
+}
+
+// A peer that has gone away is reported as an error rather than by SIGPIPE.
+static ssize_t write_socket(int descriptor, const void* buffer, size_t length)
+{
+	return send(descriptor, buffer, length, MSG_NOSIGNAL);
+}
+
+static void close_descriptor(int descriptor)
+{
+	close(descriptor);
+}
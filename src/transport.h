@@ -0,0 +1,20 @@
+#ifndef _transport_h_
+#define _transport_h_
+
+#include <sys/types.h>
+
+// A way of reaching the NXT. Every transport opens a non-blocking descriptor
+// that poll() can wait on, over which read and write carry the same
+// length-prefixed packets.
+typedef struct
+{
+	const char*	prefix;	// device strings starting with this select the transport
+	int	(*open)(const char* address);	// returns the descriptor, or -1 with errno set
+	ssize_t	(*read)(int descriptor, void* buffer, size_t length);
+	ssize_t	(*write)(int descriptor, const void* buffer, size_t length);
+	void	(*close)(int descriptor);
+} transportBackend;
+
+const transportBackend* transport_find(const char* device, const char** address);
+
+#endif
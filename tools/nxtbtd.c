@@ -0,0 +1,944 @@
+// Shares bricks between processes. Each brick is owned by the daemon and
+// served on its own Unix-domain socket, over which clients send and receive
+// the same length-prefixed packets as over Bluetooth, so that any program can
+// reach it with nxtConnect("unix:socket").
+//
+//     nxtbtd [-p pipeline_depth] [-t timeout_ms] socket device [socket device...]
+//
+// The packets of all the clients of a brick are passed to it in the order in
+// which they arrive, with up to pipeline_depth of them awaiting a reply. A
+// read-only query that is the same as one already on its way to the brick is
+// not sent again: its reply goes to every client that asked. A packet that the
+// brick does not answer within timeout_ms (2000 by default) is answered with
+// NXT_STS_COMMUNICATION_BUS_ERROR. If the connection to a brick is lost, the
+// daemon tries to reconnect once a second.
+//
+// Statistics for each client are printed to stderr when it disconnects, and
+// for every client on SIGUSR1.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libnxtbt.h"
+
+#define BROKER_HEADER_LENGTH 2	// little-endian length prefix in front of every packet
+#define BROKER_PACKET_MAX 256	// comfortably more than a 64 byte Bluetooth packet
+#define BROKER_CLIENTS_MAX 32
+#define BROKER_OUTPUT_MAX (64 * 1024)	// replies a client may fall behind by before it is dropped
+#define BROKER_BATCH_MAX 16	// no-reply packets written to the brick together
+#define BROKER_RECONNECT_INTERVAL 1000	// milliseconds
+
+typedef struct
+{
+	uint64_t	requests;	// packets asking for a reply
+	uint64_t	commands;	// packets sent without asking for a reply
+	uint64_t	shared;	// requests answered by a packet that another client sent
+	uint64_t	errors;	// requests answered with a communication bus error
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	latency;	// nanoseconds from request to reply, in total
+	uint64_t	latency_max;
+} brokerStats;
+
+typedef struct
+{
+	int	fd;	// -1 for a free slot
+	uint64_t	serial;	// tells the client apart from a later one in the same slot
+	uint64_t	last_sequence;	// of the last of its packets passed to the brick
+	uint8_t	input[BROKER_HEADER_LENGTH + BROKER_PACKET_MAX];
+	int	input_length;
+	uint8_t*	output;
+	int	output_length;
+	brokerStats	stats;
+} brokerClient;
+
+// One packet on its way to the brick, with every client awaiting its reply.
+typedef struct brokerPacket
+{
+	nxtRequest	request;
+	nxtParameter	parameter;
+	nxtResponse	response;
+	struct brokerBrick*	brick;
+	uint64_t	sequence;	// position in the order in which packets reach the brick
+	bool	reply;
+	uint8_t	body[BROKER_PACKET_MAX];
+	int	length;
+	uint8_t	reply_data[BROKER_PACKET_MAX];
+	int	waiter_count;
+	int	waiters[BROKER_CLIENTS_MAX];	// client slots
+	uint64_t	waiter_serials[BROKER_CLIENTS_MAX];
+	uint64_t	waiter_since[BROKER_CLIENTS_MAX];	// when each of them asked
+	struct brokerPacket*	next;
+} brokerPacket;
+
+typedef struct brokerBrick
+{
+	pthread_t	thread;
+	const char*	socket_path;
+	const char*	device;
+	int	pipeline_depth;
+	uint64_t	timeout;	// nanoseconds
+	nxtConnection*	connection;	// NULL while disconnected
+	uint64_t	reconnect;	// when to try again
+	int	listener;
+	int	wake[2];	// 'r' asks for a report, 'q' to stop
+	brokerClient	clients[BROKER_CLIENTS_MAX];
+	uint64_t	next_serial;
+	uint64_t	next_sequence;
+	brokerPacket*	queued_head;	// not yet passed to libnxtbt, oldest first
+	brokerPacket*	queued_tail;
+	brokerPacket*	outstanding_head;	// passed to libnxtbt and awaiting a reply, oldest first
+	brokerPacket*	outstanding_tail;
+	int	outstanding_count;
+	int	result;
+} brokerBrick;
+
+static void* serve_brick(void* argument);
+static int open_listener(brokerBrick* brick);
+static void connect_brick(brokerBrick* brick);
+static void disconnect_brick(brokerBrick* brick, int result);
+static void accept_client(brokerBrick* brick);
+static void drop_client(brokerBrick* brick, int slot);
+static void receive_packets(brokerBrick* brick, int slot);
+static void handle_packet(brokerBrick* brick, int slot, const uint8_t* body, int length);
+static brokerPacket* find_shared(brokerBrick* brick, brokerClient* client, const uint8_t* body, int length);
+static int is_shareable(uint8_t command);
+static void feed_brick(brokerBrick* brick);
+static void send_commands(brokerBrick* brick);
+static void complete_packet(nxtConnection* connection, nxtRequest* request, void* user_data);
+static void answer_packet(brokerBrick* brick, brokerPacket* packet, int result);
+static void queue_reply(brokerBrick* brick, int slot, const uint8_t* body, int length);
+static void flush_client(brokerBrick* brick, int slot);
+static void report_client(brokerBrick* brick, int slot);
+static uint64_t now_ns();
+
+int main(int argc, char* argv[])
+{
+	brokerBrick*	bricks;
+	sigset_t	signals;
+	int	pipeline_depth;
+	int	timeout;
+	int	brick_count;
+	int	brick_index;
+	int	signal_number;
+	int	failures;
+	int	option;
+
+	pipeline_depth = NXT_PIPELINE_DEPTH_DEFAULT;
+	timeout = 2000;
+
+	while ((option = getopt(argc, argv, "p:t:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'p':
+				pipeline_depth = atoi(optarg);
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p pipeline_depth] [-t timeout_ms] socket device [socket device...]\n", argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+	if (argc - optind < 2 || (argc - optind) % 2 != 0 || pipeline_depth < 1 || pipeline_depth > NXT_PIPELINE_DEPTH_MAX)
+	{
+		fprintf(stderr, "usage: %s [-p pipeline_depth] [-t timeout_ms] socket device [socket device...]\n", argv[0]);
+		return 1;
+	}
+
+	brick_count = (argc - optind) / 2;
+	bricks = calloc(brick_count, sizeof(brokerBrick));
+	if (bricks == NULL)
+	{
+		perror("nxtbtd");
+		return 1;
+	}
+
+	// block the signals before the threads start so that only sigwait sees them
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	brick_index = 0;
+	while (brick_index < brick_count)
+	{
+		bricks[brick_index].socket_path = argv[optind + 2 * brick_index];
+		bricks[brick_index].device = argv[optind + 2 * brick_index + 1];
+		bricks[brick_index].pipeline_depth = pipeline_depth;
+		bricks[brick_index].timeout = (uint64_t) timeout * 1000000;
+		if (pipe2(bricks[brick_index].wake, O_CLOEXEC) != 0 || open_listener(&(bricks[brick_index])) == false)
+		{
+			fprintf(stderr, "nxtbtd: cannot listen on %s: %s\n", bricks[brick_index].socket_path, strerror(errno));
+			return 1;
+		}
+		if (pthread_create(&(bricks[brick_index].thread), NULL, serve_brick, &(bricks[brick_index])) != 0)
+		{
+			perror("nxtbtd");
+			return 1;
+		}
+		brick_index += 1;
+	}
+
+	while (sigwait(&signals, &signal_number) == 0 && signal_number == SIGUSR1)
+	{
+		brick_index = 0;
+		while (brick_index < brick_count)
+		{
+			write(bricks[brick_index].wake[1], "r", 1);
+			brick_index += 1;
+		}
+	}
+
+	failures = 0;
+	brick_index = 0;
+	while (brick_index < brick_count)
+	{
+		write(bricks[brick_index].wake[1], "q", 1);
+		pthread_join(bricks[brick_index].thread, NULL);
+		if (bricks[brick_index].result < 0)
+		{
+			failures += 1;
+		}
+		brick_index += 1;
+	}
+
+	free(bricks);
+
+	return failures > 0 ? 1 : 0;
+}
+
+// The event loop of one brick: its listening socket, its clients and its
+// connection, all in one thread so that no locking is needed.
+static void* serve_brick(void* argument)
+{
+	brokerBrick*	brick;
+	struct pollfd	descriptors[3 + BROKER_CLIENTS_MAX];
+	uint64_t	deadline;
+	uint64_t	now;
+	char	wake;
+	int	timeout;
+	int	slot;
+	int	index;
+	int	result;
+
+	brick = argument;
+
+	slot = 0;
+	while (slot < BROKER_CLIENTS_MAX)
+	{
+		brick->clients[slot].fd = -1;
+		slot += 1;
+	}
+	connect_brick(brick);
+
+	while (true)
+	{
+		descriptors[0].fd = brick->wake[0];
+		descriptors[0].events = POLLIN;
+		descriptors[1].fd = brick->listener;
+		descriptors[1].events = POLLIN;
+		descriptors[2].fd = brick->connection != NULL ? nxtConnGetFd(brick->connection) : -1;
+		descriptors[2].events = brick->connection != NULL ? nxtConnPollEvents(brick->connection) : 0;
+		slot = 0;
+		while (slot < BROKER_CLIENTS_MAX)
+		{
+			descriptors[3 + slot].fd = brick->clients[slot].fd;
+			descriptors[3 + slot].events = brick->clients[slot].output_length > 0 ? POLLIN | POLLOUT : POLLIN;
+			slot += 1;
+		}
+
+		// wake in time for the brick's next timeout, or the next reconnection
+		now = now_ns();
+		deadline = brick->connection != NULL ? nxtConnGetDeadline(brick->connection) : brick->reconnect;
+		timeout = -1;
+		if (deadline != 0)
+		{
+			timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+		}
+
+		if (poll(descriptors, 3 + BROKER_CLIENTS_MAX, timeout) < 0 && errno != EINTR)
+		{
+			brick->result = NXT_LIBERR_GENERAL;
+			break;
+		}
+
+		if (descriptors[0].revents != 0)
+		{
+			if (read(brick->wake[0], &wake, 1) == 1 && wake == 'r')
+			{
+				slot = 0;
+				while (slot < BROKER_CLIENTS_MAX)
+				{
+					report_client(brick, slot);
+					slot += 1;
+				}
+				continue;
+			}
+			break;
+		}
+
+		if (brick->connection != NULL && (descriptors[2].revents != 0 || (deadline != 0 && now_ns() >= deadline)))
+		{
+			result = nxtConnProcess(brick->connection);
+			if (result == NXT_LIBERR_IO)
+			{
+				disconnect_brick(brick, result);
+			}
+		}
+		else if (brick->connection == NULL && now_ns() >= brick->reconnect)
+		{
+			connect_brick(brick);
+		}
+
+		index = 3;
+		while (index < 3 + BROKER_CLIENTS_MAX)
+		{
+			slot = index - 3;
+			if (brick->clients[slot].fd >= 0 && (descriptors[index].revents & POLLOUT) != 0)
+			{
+				flush_client(brick, slot);
+			}
+			if (brick->clients[slot].fd >= 0 && (descriptors[index].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+			{
+				receive_packets(brick, slot);
+			}
+			index += 1;
+		}
+		if ((descriptors[1].revents & POLLIN) != 0)
+		{
+			accept_client(brick);
+		}
+
+		feed_brick(brick);
+	}
+
+	slot = 0;
+	while (slot < BROKER_CLIENTS_MAX)
+	{
+		if (brick->clients[slot].fd >= 0)
+		{
+			drop_client(brick, slot);
+		}
+		slot += 1;
+	}
+	disconnect_brick(brick, NXT_LIBERR_NOT_CONNECTED);
+	close(brick->listener);
+	unlink(brick->socket_path);
+
+	return NULL;
+}
+
+static int open_listener(brokerBrick* brick)
+{
+	struct sockaddr_un	local;
+
+	if (strlen(brick->socket_path) >= sizeof(local.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	strcpy(local.sun_path, brick->socket_path);
+	unlink(local.sun_path);
+
+	brick->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (brick->listener < 0)
+	{
+		return false;
+	}
+	if (bind(brick->listener, (struct sockaddr*) &local, sizeof(local)) != 0 || listen(brick->listener, BROKER_CLIENTS_MAX) != 0)
+	{
+		close(brick->listener);
+		return false;
+	}
+
+	return true;
+}
+
+static void connect_brick(brokerBrick* brick)
+{
+	brick->connection = nxtConnect(brick->device);
+	if (brick->connection == NULL)
+	{
+		fprintf(stderr, "nxtbtd: %s: cannot open %s: %s\n", brick->socket_path, brick->device, strerror(errno));
+		brick->reconnect = now_ns() + (uint64_t) BROKER_RECONNECT_INTERVAL * 1000000;
+		brick->result = NXT_LIBERR_NOT_CONNECTED;
+		return;
+	}
+
+	nxtConnSetPipelineDepth(brick->connection, brick->pipeline_depth);
+	nxtConnSetTimeout(brick->connection, brick->timeout);
+	brick->result = 0;
+}
+
+// Answers everything still on its way to the brick with result and closes the
+// connection.
+static void disconnect_brick(brokerBrick* brick, int result)
+{
+	brokerPacket*	packet;
+
+	if (brick->connection != NULL)
+	{
+		if (result == NXT_LIBERR_IO)
+		{
+			fprintf(stderr, "nxtbtd: %s: lost %s\n", brick->socket_path, brick->device);
+		}
+		nxtDisconnect(brick->connection);
+		brick->connection = NULL;
+		brick->reconnect = now_ns() + (uint64_t) BROKER_RECONNECT_INTERVAL * 1000000;
+	}
+
+	// nxtDisconnect does not complete requests, so the outstanding ones are answered here
+	while (brick->outstanding_head != NULL)
+	{
+		packet = brick->outstanding_head;
+		brick->outstanding_head = packet->next;
+		answer_packet(brick, packet, result);
+		free(packet);
+	}
+	brick->outstanding_tail = NULL;
+	brick->outstanding_count = 0;
+
+	while (brick->queued_head != NULL)
+	{
+		packet = brick->queued_head;
+		brick->queued_head = packet->next;
+		answer_packet(brick, packet, result);
+		free(packet);
+	}
+	brick->queued_tail = NULL;
+}
+
+static void accept_client(brokerBrick* brick)
+{
+	brokerClient*	client;
+	int	descriptor;
+	int	slot;
+
+	descriptor = accept4(brick->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (descriptor < 0)
+	{
+		return;
+	}
+
+	slot = 0;
+	while (slot < BROKER_CLIENTS_MAX && brick->clients[slot].fd >= 0)
+	{
+		slot += 1;
+	}
+	if (slot == BROKER_CLIENTS_MAX)
+	{
+		close(descriptor);
+		return;
+	}
+
+	client = &(brick->clients[slot]);
+	memset(client, 0, sizeof(brokerClient));
+	client->output = malloc(BROKER_OUTPUT_MAX);
+	if (client->output == NULL)
+	{
+		client->fd = -1;
+		close(descriptor);
+		return;
+	}
+	client->fd = descriptor;
+	brick->next_serial += 1;
+	client->serial = brick->next_serial;
+}
+
+// Packets already passed on for the client are still sent; their replies are
+// thrown away.
+static void drop_client(brokerBrick* brick, int slot)
+{
+	brokerClient*	client;
+
+	client = &(brick->clients[slot]);
+	if (client->fd < 0)
+	{
+		return;
+	}
+
+	report_client(brick, slot);
+	close(client->fd);
+	client->fd = -1;
+	free(client->output);
+	client->output = NULL;
+	client->output_length = 0;
+}
+
+static void receive_packets(brokerBrick* brick, int slot)
+{
+	brokerClient*	client;
+	ssize_t	received;
+	int	length;
+
+	client = &(brick->clients[slot]);
+
+	while (true)
+	{
+		received = read(client->fd, client->input + client->input_length, sizeof(client->input) - client->input_length);
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		if (received <= 0)
+		{
+			drop_client(brick, slot);
+			return;
+		}
+		client->input_length += received;
+		client->stats.bytes_in += received;
+
+		while (client->input_length >= BROKER_HEADER_LENGTH)
+		{
+			length = client->input[0] | (client->input[1] << 8);
+			if (length > BROKER_PACKET_MAX)
+			{
+				// no NXT packet is this long, so the client is not speaking the protocol
+				drop_client(brick, slot);
+				return;
+			}
+			if (client->input_length < BROKER_HEADER_LENGTH + length)
+			{
+				break;
+			}
+
+			handle_packet(brick, slot, client->input + BROKER_HEADER_LENGTH, length);
+			if (client->fd < 0)
+			{
+				// answering the packet dropped the client, so the rest is not read
+				return;
+			}
+
+			client->input_length -= BROKER_HEADER_LENGTH + length;
+			memmove(client->input, client->input + BROKER_HEADER_LENGTH + length, client->input_length);
+		}
+	}
+}
+
+// Queues a packet from a client for the brick, or adds the client to the
+// waiters of an identical query that will reach the brick after everything
+// the client sent before.
+static void handle_packet(brokerBrick* brick, int slot, const uint8_t* body, int length)
+{
+	brokerClient*	client;
+	brokerPacket*	packet;
+	uint8_t	reply[3];
+	bool	wants_reply;
+
+	client = &(brick->clients[slot]);
+
+	// only direct and system commands are passed on
+	if (length < 2 || (body[0] & 0x7E) != 0)
+	{
+		return;
+	}
+	wants_reply = (body[0] & 0x80) == 0;
+	if (wants_reply == true)
+	{
+		client->stats.requests += 1;
+	}
+	else
+	{
+		client->stats.commands += 1;
+	}
+
+	if (wants_reply == true && is_shareable(body[1]) == true)
+	{
+		packet = find_shared(brick, client, body, length);
+		if (packet != NULL)
+		{
+			client->stats.shared += 1;
+			packet->waiters[packet->waiter_count] = slot;
+			packet->waiter_serials[packet->waiter_count] = client->serial;
+			packet->waiter_since[packet->waiter_count] = now_ns();
+			packet->waiter_count += 1;
+			return;
+		}
+	}
+
+	if (brick->connection == NULL)
+	{
+		if (wants_reply == true)
+		{
+			client->stats.errors += 1;
+			reply[0] = 0x02;
+			reply[1] = body[1];
+			reply[2] = NXT_STS_COMMUNICATION_BUS_ERROR;
+			queue_reply(brick, slot, reply, 3);
+		}
+		return;
+	}
+
+	packet = calloc(1, sizeof(brokerPacket));
+	if (packet == NULL)
+	{
+		return;
+	}
+	packet->brick = brick;
+	brick->next_sequence += 1;
+	packet->sequence = brick->next_sequence;
+	packet->reply = wants_reply;
+	memcpy(packet->body, body, length);
+	packet->length = length;
+	if (wants_reply == true)
+	{
+		packet->waiters[0] = slot;
+		packet->waiter_serials[0] = client->serial;
+		packet->waiter_since[0] = now_ns();
+		packet->waiter_count = 1;
+	}
+	client->last_sequence = packet->sequence;
+
+	if (brick->queued_tail == NULL)
+	{
+		brick->queued_head = packet;
+	}
+	else
+	{
+		brick->queued_tail->next = packet;
+	}
+	brick->queued_tail = packet;
+}
+
+// A packet may only be shared if it reaches the brick after everything the
+// client sent before, so that the reply reflects those commands and comes
+// back in the order the client expects.
+static brokerPacket* find_shared(brokerBrick* brick, brokerClient* client, const uint8_t* body, int length)
+{
+	brokerPacket*	lists[2];
+	brokerPacket*	packet;
+	int	list;
+
+	lists[0] = brick->outstanding_head;
+	lists[1] = brick->queued_head;
+
+	list = 0;
+	while (list < 2)
+	{
+		packet = lists[list];
+		while (packet != NULL)
+		{
+			if (packet->reply == true && packet->sequence > client->last_sequence && packet->waiter_count < BROKER_CLIENTS_MAX && packet->length == length && memcmp(packet->body + 1, body + 1, length - 1) == 0)
+			{
+				return packet;
+			}
+			packet = packet->next;
+		}
+		list += 1;
+	}
+
+	return NULL;
+}
+
+// Queries that change nothing on the brick, so that one reply does for all.
+static int is_shareable(uint8_t command)
+{
+	switch (command)
+	{
+		case NXT_CMD_GETOUTPUTSTATE:
+		case NXT_CMD_GETINPUTVALUES:
+		case NXT_CMD_GETBATTERYLEVEL:
+		case NXT_CMD_KEEPALIVE:
+		case NXT_CMD_GETCURRENTPROGRAMNAME:
+		case NXT_CMD_GETFIRMWAREVERSION:
+		case NXT_CMD_GETDEVICEINFO:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Passes queued packets to libnxtbt in order, as long as there is room in the
+// pipeline. Packets are only handed over when they can be sent at once, so
+// that a no-reply packet never overtakes a request queued before it.
+static void feed_brick(brokerBrick* brick)
+{
+	brokerPacket*	packet;
+	int	result;
+
+	while (brick->connection != NULL && brick->queued_head != NULL)
+	{
+		packet = brick->queued_head;
+		if (packet->reply == false)
+		{
+			send_commands(brick);
+			continue;
+		}
+		if (brick->outstanding_count >= brick->pipeline_depth)
+		{
+			break;
+		}
+
+		brick->queued_head = packet->next;
+		if (brick->queued_head == NULL)
+		{
+			brick->queued_tail = NULL;
+		}
+		packet->next = NULL;
+		if (brick->outstanding_tail == NULL)
+		{
+			brick->outstanding_head = packet;
+		}
+		else
+		{
+			brick->outstanding_tail->next = packet;
+		}
+		brick->outstanding_tail = packet;
+		brick->outstanding_count += 1;
+
+		// the parameters are passed on as they are, and the reply comes back the same way
+		packet->parameter.type = NXT_TYPE_BYTES;
+		packet->parameter.value.bytes = packet->body + 2;
+		packet->parameter.length = packet->length - 2;
+		packet->response.type = NXT_TYPE_BUFFER;
+		packet->response.value.bytes = packet->reply_data;
+		packet->response.length = sizeof(packet->reply_data);
+		packet->request.command = packet->body[1];
+		packet->request.parameters = &(packet->parameter);
+		packet->request.parameter_count = 1;
+		packet->request.responses = &(packet->response);
+		packet->request.response_count = 1;
+
+		// the completion may run before this returns
+		result = nxtConnQueue(brick->connection, &(packet->request), complete_packet, packet);
+		if (result == NXT_LIBERR_IO)
+		{
+			disconnect_brick(brick, result);
+		}
+	}
+}
+
+// Writes the no-reply packets at the head of the queue to the brick together.
+static void send_commands(brokerBrick* brick)
+{
+	nxtRequest	requests[BROKER_BATCH_MAX];
+	nxtParameter	parameters[BROKER_BATCH_MAX];
+	brokerPacket*	batch[BROKER_BATCH_MAX];
+	int	count;
+	int	index;
+	int	result;
+
+	count = 0;
+	while (count < BROKER_BATCH_MAX && brick->queued_head != NULL && brick->queued_head->reply == false)
+	{
+		batch[count] = brick->queued_head;
+		brick->queued_head = batch[count]->next;
+		parameters[count].type = NXT_TYPE_BYTES;
+		parameters[count].value.bytes = batch[count]->body + 2;
+		parameters[count].length = batch[count]->length - 2;
+		requests[count].command = batch[count]->body[1];
+		requests[count].parameters = &(parameters[count]);
+		requests[count].parameter_count = 1;
+		count += 1;
+	}
+	if (brick->queued_head == NULL)
+	{
+		brick->queued_tail = NULL;
+	}
+
+	result = nxtConnSendCommands(brick->connection, requests, count);
+
+	index = 0;
+	while (index < count)
+	{
+		free(batch[index]);
+		index += 1;
+	}
+
+	if (result == NXT_LIBERR_IO)
+	{
+		disconnect_brick(brick, result);
+	}
+}
+
+static void complete_packet(nxtConnection* connection, nxtRequest* request, void* user_data)
+{
+	brokerPacket*	packet;
+	brokerPacket*	previous;
+	brokerBrick*	brick;
+
+	packet = user_data;
+	brick = packet->brick;
+
+	// replies come back in order, so this is almost always the head
+	previous = NULL;
+	if (brick->outstanding_head != packet)
+	{
+		previous = brick->outstanding_head;
+		while (previous != NULL && previous->next != packet)
+		{
+			previous = previous->next;
+		}
+		if (previous == NULL)
+		{
+			return;
+		}
+	}
+	if (previous == NULL)
+	{
+		brick->outstanding_head = packet->next;
+	}
+	else
+	{
+		previous->next = packet->next;
+	}
+	if (brick->outstanding_tail == packet)
+	{
+		brick->outstanding_tail = previous;
+	}
+	brick->outstanding_count -= 1;
+
+	answer_packet(brick, packet, request->result);
+	free(packet);
+}
+
+// Sends the reply to a packet, or a communication bus error in its place, to
+// every client still waiting for it.
+static void answer_packet(brokerBrick* brick, brokerPacket* packet, int result)
+{
+	brokerClient*	client;
+	uint8_t	reply[2 + BROKER_PACKET_MAX];
+	uint64_t	latency;
+	int	length;
+	int	index;
+
+	reply[0] = 0x02;
+	reply[1] = packet->body[1];
+	length = 2;
+	if (result < 0)
+	{
+		reply[2] = NXT_STS_COMMUNICATION_BUS_ERROR;
+		length = 3;
+	}
+	else if (result > 0)
+	{
+		memcpy(reply + 2, packet->reply_data, packet->response.length);
+		length = 2 + packet->response.length;
+	}
+
+	index = 0;
+	while (index < packet->waiter_count)
+	{
+		client = &(brick->clients[packet->waiters[index]]);
+		if (client->fd >= 0 && client->serial == packet->waiter_serials[index])
+		{
+			if (result < 0)
+			{
+				client->stats.errors += 1;
+			}
+			latency = now_ns() - packet->waiter_since[index];
+			client->stats.latency += latency;
+			if (latency > client->stats.latency_max)
+			{
+				client->stats.latency_max = latency;
+			}
+			queue_reply(brick, packet->waiters[index], reply, length);
+		}
+		index += 1;
+	}
+}
+
+static void queue_reply(brokerBrick* brick, int slot, const uint8_t* body, int length)
+{
+	brokerClient*	client;
+
+	client = &(brick->clients[slot]);
+	if (client->fd < 0)
+	{
+		return;
+	}
+	if (client->output_length + BROKER_HEADER_LENGTH + length > BROKER_OUTPUT_MAX)
+	{
+		// a client that does not read its replies is not allowed to hold up the others
+		drop_client(brick, slot);
+		return;
+	}
+
+	client->output[client->output_length] = length & 0xFF;
+	client->output[client->output_length + 1] = length >> 8;
+	memcpy(client->output + client->output_length + BROKER_HEADER_LENGTH, body, length);
+	client->output_length += BROKER_HEADER_LENGTH + length;
+
+	flush_client(brick, slot);
+}
+
+static void flush_client(brokerBrick* brick, int slot)
+{
+	brokerClient*	client;
+	ssize_t	written;
+
+	client = &(brick->clients[slot]);
+	if (client->fd < 0)
+	{
+		return;
+	}
+
+	while (client->output_length > 0)
+	{
+		written = send(client->fd, client->output, client->output_length, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		if (written < 0)
+		{
+			drop_client(brick, slot);
+			return;
+		}
+		client->stats.bytes_out += written;
+		client->output_length -= written;
+		memmove(client->output, client->output + written, client->output_length);
+	}
+}
+
+static void report_client(brokerBrick* brick, int slot)
+{
+	brokerStats*	stats;
+	uint64_t	answered;
+
+	if (brick->clients[slot].fd < 0)
+	{
+		return;
+	}
+
+	stats = &(brick->clients[slot].stats);
+	answered = stats->requests > 0 ? stats->requests : 1;
+	fprintf(stderr, "nxtbtd: %s: client %llu: %llu requests (%llu shared, %llu failed), %llu commands, %llu bytes in, %llu bytes out, latency mean %.1f ms max %.1f ms\n", brick->socket_path, (unsigned long long) brick->clients[slot].serial, (unsigned long long) stats->requests, (unsigned long long) stats->shared, (unsigned long long) stats->errors, (unsigned long long) stats->commands, (unsigned long long) stats->bytes_in, (unsigned long long) stats->bytes_out, stats->latency / 1e6 / answered, stats->latency_max / 1e6);
+}
+
+static uint64_t now_ns()
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
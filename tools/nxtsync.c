@@ -0,0 +1,205 @@
+// Makes the files on one or more bricks the same as a local directory,
+// uploading only what has changed and deleting what is no longer there.
+//
+//     nxtsync [-p pattern] [-m manifest_directory] [-c chunk_size] [-k] [-n] directory device...
+//
+// Each brick is synchronised over its own connection in its own thread. What
+// has been uploaded to each brick is remembered in a manifest named after its
+// Bluetooth address (.nxtsync-<address> in the directory unless -m is given),
+// so that a file changed without changing its size is still noticed.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libnxtbt.h"
+
+typedef struct
+{
+	const char*	directory;
+	const char*	manifest_directory;
+	const char*	pattern;
+	int	chunk_size;
+	bool	keep_stale;
+	bool	dry_run;
+} syncOptions;
+
+// One brick being synchronised.
+typedef struct
+{
+	pthread_t	thread;
+	const syncOptions*	options;
+	const char*	device;
+	nxtSync	sync;
+	int	result;
+	char	error[128];
+} syncBrick;
+
+static void* sync_brick(void* argument);
+static void report(syncBrick* brick);
+
+int main(int argc, char* argv[])
+{
+	syncOptions	options;
+	syncBrick*	bricks;
+	int	brick_count;
+	int	brick_index;
+	int	failures;
+	int	option;
+
+	memset(&options, 0, sizeof(options));
+
+	while ((option = getopt(argc, argv, "p:m:c:knh")) != -1)
+	{
+		switch (option)
+		{
+			case 'p':
+				options.pattern = optarg;
+				break;
+			case 'm':
+				options.manifest_directory = optarg;
+				break;
+			case 'c':
+				options.chunk_size = atoi(optarg);
+				break;
+			case 'k':
+				options.keep_stale = true;
+				break;
+			case 'n':
+				options.dry_run = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p pattern] [-m manifest_directory] [-c chunk_size] [-k] [-n] directory device...\n", argv[0]);
+				return option == 'h' ? 0 : 1;
+		}
+	}
+	if (argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-p pattern] [-m manifest_directory] [-c chunk_size] [-k] [-n] directory device...\n", argv[0]);
+		return 1;
+	}
+	options.directory = argv[optind];
+	if (options.manifest_directory == NULL)
+	{
+		options.manifest_directory = options.directory;
+	}
+
+	brick_count = argc - optind - 1;
+	bricks = calloc(brick_count, sizeof(syncBrick));
+	if (bricks == NULL)
+	{
+		perror("nxtsync");
+		return 1;
+	}
+
+	brick_index = 0;
+	while (brick_index < brick_count)
+	{
+		bricks[brick_index].options = &options;
+		bricks[brick_index].device = argv[optind + 1 + brick_index];
+		if (pthread_create(&(bricks[brick_index].thread), NULL, sync_brick, &(bricks[brick_index])) != 0)
+		{
+			perror("nxtsync");
+			return 1;
+		}
+		brick_index += 1;
+	}
+
+	failures = 0;
+	brick_index = 0;
+	while (brick_index < brick_count)
+	{
+		pthread_join(bricks[brick_index].thread, NULL);
+		report(&(bricks[brick_index]));
+		if (bricks[brick_index].result < 0)
+		{
+			failures += 1;
+		}
+		brick_index += 1;
+	}
+
+	free(bricks);
+
+	return failures > 0 ? 1 : 0;
+}
+
+static void* sync_brick(void* argument)
+{
+	syncBrick*	brick;
+	nxtConnection*	connection;
+	nxtDeviceInfo	info;
+	char*	manifest;
+	char*	error;
+	int	result;
+
+	brick = argument;
+
+	connection = nxtConnect(brick->device);
+	if (connection == NULL)
+	{
+		brick->result = NXT_LIBERR_NOT_CONNECTED;
+		snprintf(brick->error, sizeof(brick->error), "cannot open device");
+		return NULL;
+	}
+
+	// the manifest belongs to the brick, not to the device it was reached through
+	result = nxtGetDeviceInfo(connection, &info);
+	if (result < 5 || info.status != NXT_STS_SUCCESS)
+	{
+		brick->result = result < 0 ? result : NXT_LIBERR_STATUS;
+		snprintf(brick->error, sizeof(brick->error), "cannot identify brick");
+		nxtDisconnect(connection);
+		return NULL;
+	}
+	if (asprintf(&manifest, "%s/.nxtsync-%02X%02X%02X%02X%02X%02X", brick->options->manifest_directory, info.address[0], info.address[1], info.address[2], info.address[3], info.address[4], info.address[5]) < 0)
+	{
+		brick->result = NXT_LIBERR_GENERAL;
+		snprintf(brick->error, sizeof(brick->error), "out of memory");
+		nxtDisconnect(connection);
+		return NULL;
+	}
+
+	brick->sync.pattern = brick->options->pattern;
+	brick->sync.keep_stale = brick->options->keep_stale;
+	brick->sync.dry_run = brick->options->dry_run;
+	brick->sync.transfer.chunk_size = brick->options->chunk_size;
+	brick->result = nxtSyncDirectory(connection, brick->options->directory, manifest, &(brick->sync));
+	if (brick->result < 0)
+	{
+		error = nxtLibErrorString(brick->result);
+		if (brick->sync.failed[0] != 0)
+		{
+			snprintf(brick->error, sizeof(brick->error), "%s: %s (status 0x%02X)", brick->sync.failed, error, brick->sync.transfer.status);
+		}
+		else
+		{
+			snprintf(brick->error, sizeof(brick->error), "%s", error);
+		}
+		free(error);
+	}
+
+	free(manifest);
+	nxtDisconnect(connection);
+
+	return NULL;
+}
+
+static void report(syncBrick* brick)
+{
+	printf("%s: %d uploaded, %d unchanged, %d deleted, %d skipped, %u bytes", brick->device, brick->sync.uploaded, brick->sync.unchanged, brick->sync.deleted, brick->sync.skipped, brick->sync.bytes);
+	if (brick->options->dry_run == true)
+	{
+		printf(" (dry run)");
+	}
+	if (brick->result < 0)
+	{
+		printf(": %s", brick->error);
+	}
+	printf("\n");
+}